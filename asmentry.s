@@ -1,20 +1,65 @@
 
+
+
 .globl Scheme_asmEntry
-# rdi: thisClosure, rsi: function ptr, rdx: heapPtr, rcx: heapLimit,
-# r8: threadstate
+# rdi: thisClosure, rsi: function ptr, rdx: pairPtr, rcx: pairLimit,
+# r8: threadstate, r9: top of the scheme stack
 Scheme_asmEntry:
+	push %rbx          # Scheme code uses rbx, rbp and r15 as temps
+	push %rbp
 	push %r12
 	push %r13
 	push %r14
+	push %r15
+	sub $8, %rsp       # Keep the stack aligned
 
 	mov %rdx, %r12     # set Hp
 	mov %rcx, %r13     # set HpLim
 	mov %r8,  %r14     # set ThreadState
+	mov %rsp, 104(%r14) # set CStackPtr, the runtime runs there
+	mov %r9,  %rsp     # Scheme code runs on its own stack
 	mov %rsp, 8(%r14)  # set SpBase
 
 	call *%rsi
 
+	mov 104(%r14), %rsp
+	add $8, %rsp
+	pop %r15
 	pop %r14
 	pop %r13
 	pop %r12
+	pop %rbp
+	pop %rbx
+	ret
+
+.globl Scheme_callRuntime
+# rax: C function, with its arguments in rdi, rsi and rdx.
+# r14: threadstate
+# Calls it on the C stack, so that the runtime (say, the recursive gc)
+# does not eat into the scheme stack and its guard. Clobbers r11.
+Scheme_callRuntime:
+	mov %rsp, %r11
+	mov 104(%r14), %rsp
+	push %r11          # Scheme's sp
+	sub $8, %rsp       # Keep the stack aligned
+	call *%rax
+	add $8, %rsp
+	pop %rsp
 	ret
+
+.globl Scheme_stackBarrier
+# Returned to instead of the return address that the last gc replaced,
+# above the youngest frame that it scanned: the frame returned to is
+# about to run. @See ThreadState::gcMoveStackBarrier
+# rax: the value returned, r14: threadstate
+Scheme_stackBarrier:
+	push %rax
+	mov %r14, %rdi
+	lea Scheme_moveStackBarrier(%rip), %rax
+	call Scheme_callRuntime
+	mov %rax, %r11     # Where it would have returned to
+	pop %rax
+	jmp *%r11
+
+# No executable stack.
+.section .note.GNU-stack,"",@progbits
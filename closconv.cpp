@@ -0,0 +1,639 @@
+#include <assert.h>
+
+#include <string>
+
+#include "closconv.hpp"
+#include "codegen2.hpp"
+
+ClosureConversion::Scope::Scope(Scope *parent, bool isClosure)
+  : parent(parent)
+  , locals(Util::newAssocList())
+  , isClosure(isClosure)
+  , captured(Util::newGrowableArray())
+  , self(Object::newNil())
+{ }
+
+ClosureConversion::ClosureConversion(CGModule *module)
+  : module(module)
+  , lifted(Util::newGrowableArray())
+  , payloadSizes(Util::newAssocList())
+{ }
+
+Object *ClosureConversion::run(const Handle &defns) {
+  Handle items = Util::newGrowableArray();
+  Util::listToArray(defns, items);
+
+  for (intptr_t i = 0; i < Util::arrayLength(items); ++i) {
+    Handle xs = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(items, i), xs);
+    if (Util::arrayLength(xs) != 3 ||
+        !Util::arrayAt(xs, 2)->isPair() ||
+        Util::arrayAt(xs, 2)->raw()->car() != module->symLambda) {
+      // genModule complains about it.
+      continue;
+    }
+
+    Scope scope(NULL, false);
+    Handle lamExpr = convertLambda(Util::arrayAt(xs, 2), &scope,
+                                   Util::newGrowableArray());
+    Util::arraySet(xs, 2, lamExpr);
+    Handle defn = Util::arrayToList(xs);
+    Util::arraySet(items, i, defn);
+  }
+
+  for (intptr_t i = 0; i < Util::arrayLength(lifted); ++i) {
+    Util::arrayAppend(items, Util::arrayAt(lifted, i));
+  }
+  return Util::arrayToList(items);
+}
+
+intptr_t ClosureConversion::numPayloadOf(const Handle &name) {
+  bool ok;
+  Handle size = Util::assocLookup(payloadSizes, name, Util::kPtrEq, &ok);
+  return ok ? size->fromFixnum() : 0;
+}
+
+Object *ClosureConversion::convertLambda(const Handle &lamExpr,
+                                         Scope *scope,
+                                         const Handle &extra) {
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(lamExpr, xs);
+  Handle params = Util::newGrowableArray();
+  Util::listToArray(Util::arrayAt(xs, 1), params);
+  Handle body = Util::arrayToList(xs, 2);
+
+  // The extra arguments come first, and hold the box if there is one.
+  Handle newParams = Util::newGrowableArray();
+  for (intptr_t i = 0; i < Util::arrayLength(extra); ++i) {
+    Handle name = Util::arrayAt(extra, i);
+    Handle kind = kindOf(name, scope->parent);
+    Handle newKind = isBoxed(kind) ? name.getPtr() : Object::newTrue();
+    scope->locals = Util::assocInsert(scope->locals, name, newKind,
+                                      Util::kPtrEq);
+    Util::arrayAppend(newParams, name);
+  }
+
+  // A box is only needed if a copy could miss an assignment.
+  Handle newBody = Util::newGrowableArray();
+  for (intptr_t i = 0; i < Util::arrayLength(params); ++i) {
+    Handle name = Util::arrayAt(params, i);
+    Handle kind = Object::newTrue();
+    if (assigns(body, name) && mentionsInLambda(body, name)) {
+      kind = newName(name, "box");
+      Handle box = Object::newPair(module->symPrimVector,
+                                   Object::newPair(name, Object::newNil()));
+      Handle tail = Object::newPair(box, Object::newNil());
+      tail = Object::newPair(kind, tail);
+      Handle defn = Object::newPair(module->symDefine, tail);
+      Util::arrayAppend(newBody, defn);
+    }
+    scope->locals = Util::assocInsert(scope->locals, name, kind,
+                                      Util::kPtrEq);
+    Util::arrayAppend(newParams, name);
+  }
+
+  Handle defines = Util::newGrowableArray();
+  collectDefines(body, defines);
+  for (intptr_t i = 0; i < Util::arrayLength(defines); ++i) {
+    Handle name = Util::arrayAt(defines, i)->raw()->cdr()->raw()->car();
+    bool ok;
+    Util::assocLookup(scope->locals, name, Util::kPtrEq, &ok);
+    // Defined twice is assigned as well.
+    Handle kind = Object::newBool((ok || assigns(body, name)) &&
+                                  mentionsInLambda(body, name));
+    // A boxed define keeps its name, for the box.
+    scope->locals = Util::assocInsert(scope->locals, name,
+                                      kind->isTrue() ? name.getPtr()
+                                                     : Object::newTrue(),
+                                      Util::kPtrEq);
+  }
+  findLifted(body, defines, scope);
+
+  Handle exprs = Util::newGrowableArray();
+  Util::listToArray(body, exprs);
+  intptr_t len = Util::arrayLength(exprs);
+  for (intptr_t i = 0; i < len; ++i) {
+    Handle x = Util::arrayAt(exprs, i);
+    Handle kind;
+    // A lifted define has nothing left to do, unless it is the value.
+    if (i != len - 1 && x->isPair() &&
+        x->raw()->car() == module->symDefine &&
+        (kind = kindOf(x->raw()->cdr()->raw()->car(), scope)) &&
+        isLifted(kind)) {
+      continue;
+    }
+    x = convert(x, scope);
+    Util::arrayAppend(newBody, x);
+  }
+
+  Handle tail = Util::arrayToList(newBody);
+  tail = Object::newPair(Util::arrayToList(newParams), tail);
+  return Object::newPair(module->symLambda, tail);
+}
+
+Object *ClosureConversion::convertClosure(const Handle &lamExpr,
+                                          Scope *parent,
+                                          const Handle &self) {
+  Scope scope(parent, true);
+  scope.self = self;
+  Handle newLam = convertLambda(lamExpr, &scope, Util::newGrowableArray());
+
+  Handle name = newName(self->isSymbol() ? self : module->symLambda, NULL);
+  Handle tail = Object::newPair(newLam, Object::newNil());
+  Handle defn = Object::newPair(module->symDefine,
+                                Object::newPair(name, tail));
+  Util::arrayAppend(lifted, defn);
+
+  intptr_t numPayload = Util::arrayLength(scope.captured);
+  if (!numPayload) {
+    return name;
+  }
+  payloadSizes = Util::assocInsert(payloadSizes, name,
+                                   Object::newFixnum(numPayload),
+                                   Util::kPtrEq);
+
+  // The parent may capture them in turn.
+  Handle xs = Util::newGrowableArray();
+  Util::arrayAppend(xs, module->symPrimMakeClosure);
+  Util::arrayAppend(xs, name);
+  for (intptr_t i = 0; i < numPayload; ++i) {
+    Handle x = storageOf(Util::arrayAt(scope.captured, i), parent);
+    Util::arrayAppend(xs, x);
+  }
+  return Util::arrayToList(xs);
+}
+
+Object *ClosureConversion::convert(const Handle &expr, Scope *scope) {
+  if (expr->isSymbol()) {
+    return refOf(expr, scope);
+  }
+  else if (!expr->isPair()) {
+    return expr;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t len = Util::arrayLength(xs);
+  Handle head = Util::arrayAt(xs, 0);
+
+  if (head == module->symQuote) {
+    return expr;
+  }
+  else if (head == module->symLambda) {
+    return convertClosure(expr, scope, Object::newNil());
+  }
+  else if (head == module->symDefine && len == 3) {
+    Handle name = Util::arrayAt(xs, 1),
+           val = Util::arrayAt(xs, 2),
+           kind = kindOf(name, scope);
+    if (isLifted(kind)) {
+      val = kind->raw()->car();
+    }
+    else if (val->isPair() && val->raw()->car() == module->symLambda) {
+      Handle self = kind->isTrue() ? name.getPtr() : Object::newNil();
+      val = convertClosure(val, scope, self);
+    }
+    else {
+      val = convert(val, scope);
+    }
+
+    if (isBoxed(kind)) {
+      val = Object::newPair(module->symPrimVector,
+                            Object::newPair(val, Object::newNil()));
+    }
+    Util::arraySet(xs, 2, val);
+    return Util::arrayToList(xs);
+  }
+  else if (head == module->symSete && len == 3) {
+    Handle name = Util::arrayAt(xs, 1),
+           val = convert(Util::arrayAt(xs, 2), scope),
+           kind = kindOf(name, scope);
+    if (kind && isBoxed(kind)) {
+      // (vector-set!# box 0 val)
+      Handle tail = Object::newPair(val, Object::newNil());
+      tail = Object::newPair(Object::newFixnum(0), tail);
+      tail = Object::newPair(storageOf(name, scope), tail);
+      return Object::newPair(module->symPrimVectorSet, tail);
+    }
+    Util::arraySet(xs, 2, val);
+    return Util::arrayToList(xs);
+  }
+  else if (head->isSymbol()) {
+    Handle kind = kindOf(head, scope);
+    if (kind && isLifted(kind)) {
+      return convertCall(xs, kind, scope);
+    }
+  }
+
+  for (intptr_t i = 0; i < len; ++i) {
+    Handle x = convert(Util::arrayAt(xs, i), scope);
+    Util::arraySet(xs, i, x);
+  }
+  return Util::arrayToList(xs);
+}
+
+Object *ClosureConversion::convertCall(const Handle &xs,
+                                       const Handle &kind,
+                                       Scope *scope) {
+  Handle extra = kind->raw()->cdr();
+  Handle call = Util::newGrowableArray();
+  Util::arrayAppend(call, kind->raw()->car());
+  for (intptr_t i = 0; i < Util::arrayLength(extra); ++i) {
+    Handle x = storageOf(Util::arrayAt(extra, i), scope);
+    Util::arrayAppend(call, x);
+  }
+  for (intptr_t i = 1; i < Util::arrayLength(xs); ++i) {
+    Handle x = convert(Util::arrayAt(xs, i), scope);
+    Util::arrayAppend(call, x);
+  }
+  return Util::arrayToList(call);
+}
+
+void ClosureConversion::findLifted(const Handle &body,
+                                   const Handle &defines,
+                                   Scope *scope) {
+  // Parallel arrays, indexed by candidate.
+  Handle names = Util::newGrowableArray(),
+         lambdas = Util::newGrowableArray(),
+         free = Util::newGrowableArray();
+  for (intptr_t i = 0; i < Util::arrayLength(defines); ++i) {
+    Handle defn = Util::arrayAt(defines, i);
+    Handle name = defn->raw()->cdr()->raw()->car(),
+           val = defn->raw()->cdr()->raw()->cdr()->raw()->car();
+    if (!val->isPair() || val->raw()->car() != module->symLambda ||
+        !val->raw()->cdr()->raw()->car()->isList() ||
+        !kindOf(name, scope)->isTrue() ||
+        assigns(body, name) || arrayContains(names, name)) {
+      continue;
+    }
+    intptr_t arity = 0;
+    for (Handle iter = val->raw()->cdr()->raw()->car(); iter->isPair();
+         iter = iter->raw()->cdr()) {
+      ++arity;
+    }
+    if (!onlyCalled(body, name, arity)) {
+      continue;
+    }
+    Handle fvs = Util::newGrowableArray();
+    collectFree(val, Util::newAssocList(), scope, fvs);
+    Util::arrayAppend(names, name);
+    Util::arrayAppend(lambdas, val);
+    Util::arrayAppend(free, fvs);
+  }
+
+  // A candidate also needs what the ones that it calls need. Dropping
+  // one makes it a variable to the others, so start over then.
+  Handle extras;
+  while (true) {
+    intptr_t numCandidates = Util::arrayLength(names);
+    extras = Util::newGrowableArray();
+    for (intptr_t i = 0; i < numCandidates; ++i) {
+      Util::arrayAppend(extras, Util::newGrowableArray());
+    }
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (intptr_t i = 0; i < numCandidates; ++i) {
+        Handle fvs = Util::arrayAt(free, i),
+               out = Util::arrayAt(extras, i);
+        for (intptr_t j = 0; j < Util::arrayLength(fvs); ++j) {
+          Handle fv = Util::arrayAt(fvs, j);
+          Handle kind = kindOf(fv, scope);
+          Handle needs = Util::newGrowableArray();
+          intptr_t k;
+          for (k = 0; k < numCandidates; ++k) {
+            if (Util::arrayAt(names, k) == fv) {
+              break;
+            }
+          }
+          if (k < numCandidates) {
+            needs = Util::arrayAt(extras, k);
+          }
+          else if (isLifted(kind)) {
+            needs = kind->raw()->cdr();
+          }
+          else {
+            Util::arrayAppend(needs, fv);
+          }
+          for (intptr_t m = 0; m < Util::arrayLength(needs); ++m) {
+            Handle x = Util::arrayAt(needs, m);
+            if (!arrayContains(out, x)) {
+              Util::arrayAppend(out, x);
+              changed = true;
+            }
+          }
+        }
+      }
+    }
+
+    // The extra arguments are passed in registers as well. A call from
+    // under a lambda that rebinds one of them would pass the wrong one.
+    intptr_t maxArgs = sizeof(kArgRegs) / sizeof(kArgRegs[0]);
+    intptr_t drop;
+    for (drop = 0; drop < numCandidates; ++drop) {
+      Handle name = Util::arrayAt(names, drop),
+             out = Util::arrayAt(extras, drop),
+             lamExpr = Util::arrayAt(lambdas, drop);
+      intptr_t arity = 0;
+      for (Handle iter = lamExpr->raw()->cdr()->raw()->car();
+           iter->isPair(); iter = iter->raw()->cdr()) {
+        ++arity;
+      }
+      if (Util::arrayLength(out) + arity > maxArgs ||
+          shadows(body, name, out)) {
+        break;
+      }
+    }
+    if (drop == numCandidates) {
+      break;
+    }
+
+    Handle newNames = Util::newGrowableArray(),
+           newLambdas = Util::newGrowableArray(),
+           newFree = Util::newGrowableArray();
+    for (intptr_t i = 0; i < numCandidates; ++i) {
+      if (i != drop) {
+        Util::arrayAppend(newNames, Util::arrayAt(names, i));
+        Util::arrayAppend(newLambdas, Util::arrayAt(lambdas, i));
+        Util::arrayAppend(newFree, Util::arrayAt(free, i));
+      }
+    }
+    names = newNames;
+    lambdas = newLambdas;
+    free = newFree;
+  }
+
+  // Bind all of them first: they may call each other.
+  Handle freshNames = Util::newGrowableArray();
+  for (intptr_t i = 0; i < Util::arrayLength(names); ++i) {
+    Handle fresh = newName(Util::arrayAt(names, i), NULL);
+    Handle kind = Object::newPair(fresh, Util::arrayAt(extras, i));
+    scope->locals = Util::assocInsert(scope->locals, Util::arrayAt(names, i),
+                                      kind, Util::kPtrEq);
+    Util::arrayAppend(freshNames, fresh);
+  }
+
+  for (intptr_t i = 0; i < Util::arrayLength(names); ++i) {
+    Scope liftedScope(scope, false);
+    Handle newLam = convertLambda(Util::arrayAt(lambdas, i), &liftedScope,
+                                  Util::arrayAt(extras, i));
+    Handle tail = Object::newPair(newLam, Object::newNil());
+    Handle defn = Object::newPair(
+        module->symDefine,
+        Object::newPair(Util::arrayAt(freshNames, i), tail));
+    Util::arrayAppend(lifted, defn);
+  }
+}
+
+void ClosureConversion::collectFree(const Handle &expr, const Handle &bound,
+                                    Scope *scope, const Handle &out) {
+  if (expr->isSymbol()) {
+    bool ok;
+    Util::assocLookup(bound, expr, Util::kPtrEq, &ok);
+    if (!ok && kindOf(expr, scope) && !arrayContains(out, expr)) {
+      Util::arrayAppend(out, expr);
+    }
+    return;
+  }
+  else if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t start = 0;
+  Handle newBound = bound;
+  if (Util::arrayAt(xs, 0) == module->symLambda &&
+      Util::arrayLength(xs) >= 2) {
+    Handle binders = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(xs, 1), binders);
+    Handle defines = Util::newGrowableArray();
+    collectDefines(Util::arrayToList(xs, 2), defines);
+    for (intptr_t i = 0; i < Util::arrayLength(defines); ++i) {
+      Util::arrayAppend(
+          binders, Util::arrayAt(defines, i)->raw()->cdr()->raw()->car());
+    }
+    for (intptr_t i = 0; i < Util::arrayLength(binders); ++i) {
+      newBound = Util::assocInsert(newBound, Util::arrayAt(binders, i),
+                                   Object::newTrue(), Util::kPtrEq);
+    }
+    start = 2;
+  }
+  for (intptr_t i = start; i < Util::arrayLength(xs); ++i) {
+    collectFree(Util::arrayAt(xs, i), newBound, scope, out);
+  }
+}
+
+Object *ClosureConversion::refOf(const Handle &name, Scope *scope) {
+  Handle kind = kindOf(name, scope);
+  if (!kind) {
+    return name;
+  }
+  Handle storage = storageOf(name, scope);
+  if (!isBoxed(kind)) {
+    return storage;
+  }
+  // (vector-ref# box 0)
+  Handle tail = Object::newPair(Object::newFixnum(0), Object::newNil());
+  tail = Object::newPair(storage, tail);
+  return Object::newPair(module->symPrimVectorRef, tail);
+}
+
+Object *ClosureConversion::storageOf(const Handle &name, Scope *scope) {
+  bool ok;
+  Handle kind = Util::assocLookup(scope->locals, name, Util::kPtrEq, &ok);
+  if (ok) {
+    return isBoxed(kind) ? kind : name;
+  }
+
+  // The free variables of a lifted function are its arguments: only a
+  // closure sees the locals of another function.
+  assert(scope->isClosure);
+  if (name == scope->self) {
+    return Object::newPair(module->symPrimThisClosure, Object::newNil());
+  }
+
+  intptr_t i, len = Util::arrayLength(scope->captured);
+  for (i = 0; i < len; ++i) {
+    if (Util::arrayAt(scope->captured, i) == name) {
+      break;
+    }
+  }
+  if (i == len) {
+    Util::arrayAppend(scope->captured, name);
+  }
+  Handle tail = Object::newPair(Object::newFixnum(i), Object::newNil());
+  return Object::newPair(module->symPrimClosureRef, tail);
+}
+
+Object *ClosureConversion::kindOf(const Handle &name, Scope *scope) {
+  for (Scope *s = scope; s; s = s->parent) {
+    bool ok;
+    Handle kind = Util::assocLookup(s->locals, name, Util::kPtrEq, &ok);
+    if (ok) {
+      return kind;
+    }
+    else if (s->isClosure && name == s->self) {
+      return Object::newTrue();
+    }
+  }
+  return NULL;
+}
+
+bool ClosureConversion::isBoxed(const Handle &kind) {
+  return kind->isSymbol();
+}
+
+bool ClosureConversion::isLifted(const Handle &kind) {
+  return kind->isPair();
+}
+
+void ClosureConversion::collectDefines(const Handle &expr,
+                                       const Handle &out) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote ||
+      expr->raw()->car() == module->symLambda) {
+    return;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  if (Util::arrayAt(xs, 0) == module->symDefine &&
+      Util::arrayLength(xs) == 3) {
+    Util::arrayAppend(out, expr);
+  }
+  for (intptr_t i = 0; i < Util::arrayLength(xs); ++i) {
+    collectDefines(Util::arrayAt(xs, i), out);
+  }
+}
+
+bool ClosureConversion::shadows(const Handle &expr, const Handle &name,
+                                const Handle &extra) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return false;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  if (Util::arrayAt(xs, 0) == module->symLambda &&
+      Util::arrayLength(xs) >= 2 && mentions(expr, name)) {
+    Handle binders = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(xs, 1), binders);
+    Handle defines = Util::newGrowableArray();
+    collectDefines(Util::arrayToList(xs, 2), defines);
+    for (intptr_t i = 0; i < Util::arrayLength(defines); ++i) {
+      Util::arrayAppend(
+          binders, Util::arrayAt(defines, i)->raw()->cdr()->raw()->car());
+    }
+    for (intptr_t i = 0; i < Util::arrayLength(binders); ++i) {
+      if (arrayContains(extra, Util::arrayAt(binders, i))) {
+        return true;
+      }
+    }
+  }
+  for (intptr_t i = 0; i < Util::arrayLength(xs); ++i) {
+    if (shadows(Util::arrayAt(xs, i), name, extra)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ClosureConversion::mentions(const Handle &expr, const Handle &name) {
+  if (expr->isSymbol()) {
+    return expr == name;
+  }
+  else if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return false;
+  }
+
+  for (Handle iter = expr; iter->isPair(); iter = iter->raw()->cdr()) {
+    if (mentions(iter->raw()->car(), name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ClosureConversion::mentionsInLambda(const Handle &expr,
+                                         const Handle &name) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return false;
+  }
+  else if (expr->raw()->car() == module->symLambda) {
+    return mentions(expr, name);
+  }
+
+  for (Handle iter = expr; iter->isPair(); iter = iter->raw()->cdr()) {
+    if (mentionsInLambda(iter->raw()->car(), name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ClosureConversion::assigns(const Handle &expr, const Handle &name) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return false;
+  }
+  else if (expr->raw()->car() == module->symSete &&
+           expr->raw()->cdr()->isPair() &&
+           expr->raw()->cdr()->raw()->car() == name) {
+    return true;
+  }
+
+  for (Handle iter = expr; iter->isPair(); iter = iter->raw()->cdr()) {
+    if (assigns(iter->raw()->car(), name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ClosureConversion::onlyCalled(const Handle &expr, const Handle &name,
+                                   intptr_t argc) {
+  if (expr->isSymbol()) {
+    return expr.getPtr() != name.getPtr();
+  }
+  else if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return true;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t len = Util::arrayLength(xs),
+           start = 0;
+  Handle head = Util::arrayAt(xs, 0);
+  if (head == name && len - 1 == argc) {
+    start = 1;
+  }
+  else if (head == module->symDefine && len == 3 &&
+           Util::arrayAt(xs, 1) == name) {
+    start = 2;
+  }
+  for (intptr_t i = start; i < len; ++i) {
+    if (!onlyCalled(Util::arrayAt(xs, i), name, argc)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Object *ClosureConversion::newName(const Handle &name, const char *suffix) {
+  // Not interned: cannot clash with any other name.
+  std::string str = name->rawSymbol();
+  if (suffix) {
+    str += "/";
+    str += suffix;
+  }
+  return Object::newSymbolFromC(str.c_str());
+}
+
+bool ClosureConversion::arrayContains(const Handle &arr, const Handle &x) {
+  for (intptr_t i = 0; i < Util::arrayLength(arr); ++i) {
+    if (Util::arrayAt(arr, i) == x) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,101 @@
+#ifndef CLOSCONV_HPP
+#define CLOSCONV_HPP
+
+#include "gc.hpp"
+#include "object.hpp"
+#include "util.hpp"
+
+class CGModule;
+
+// Turns the lambdas that are not at the top level into top-level
+// functions of their own. Works on the s-expressions, before the
+// CGFunctions are made.
+//
+// A local (define f (lambda ...)) that is only ever called, with the
+// right number of arguments, is lambda lifted: its free variables become
+// extra arguments that each call passes, and nothing is allocated. Any
+// other lambda becomes a flat closure: (make-closure# f v ...) copies the
+// values of its free variables into the payload, and f reads them back
+// with (closure-ref# i). Without free variables it is just f, whose
+// closure is made once.
+//
+// A captured local that is (set!) lives in a box, a (vector# x), so that
+// the copies see the assignments.
+class ClosureConversion {
+ public:
+  ClosureConversion(CGModule *module);
+
+  // Returns the definitions with the lifted functions appended.
+  Object *run(const Handle &defns);
+
+  // The payload size of the closures of a lifted function.
+  intptr_t numPayloadOf(const Handle &name);
+
+ private:
+  struct Scope {
+    Scope(Scope *parent, bool isClosure);
+
+    Scope *parent;
+    // Assoc list of our locals. A name maps to #t, to the local that
+    // holds its box, or to (f . extra-args) if it is a lifted function.
+    Handle locals;
+    bool isClosure;
+    // Closures only: growable array of the captured names, in payload
+    // order, and the local that the closure was defined as, which is
+    // (this-closure#).
+    Handle captured;
+    Handle self;
+  };
+
+  // Returns the new (lambda ...). extra are the free variables of a
+  // lifted function.
+  Object *convertLambda(const Handle &lamExpr, Scope *scope,
+                        const Handle &extra);
+  // A lambda in an expression: its closure.
+  Object *convertClosure(const Handle &lamExpr, Scope *parent,
+                         const Handle &self);
+  Object *convert(const Handle &expr, Scope *scope);
+  Object *convertCall(const Handle &xs, const Handle &lifted,
+                      Scope *scope);
+
+  // Decides which of the defines of the lambda's body are lifted, and
+  // binds them to their new names.
+  void findLifted(const Handle &body, const Handle &defines, Scope *scope);
+  // Appends the free names of expr that scope can see, without
+  // duplicates.
+  void collectFree(const Handle &expr, const Handle &bound, Scope *scope,
+                   const Handle &out);
+
+  // The value of a variable, and where it is kept: the box if it has
+  // one.
+  Object *refOf(const Handle &name, Scope *scope);
+  Object *storageOf(const Handle &name, Scope *scope);
+  // NULL for a global.
+  Object *kindOf(const Handle &name, Scope *scope);
+  bool isBoxed(const Handle &kind);
+  bool isLifted(const Handle &kind);
+
+  // Syntactic helpers. None of them look into quotes.
+  // Appends the (define ...)s of expr that are not in a lambda.
+  void collectDefines(const Handle &expr, const Handle &out);
+  // True if a lambda in expr that mentions name binds one of extra.
+  bool shadows(const Handle &expr, const Handle &name, const Handle &extra);
+  bool mentions(const Handle &expr, const Handle &name);
+  bool mentionsInLambda(const Handle &expr, const Handle &name);
+  bool assigns(const Handle &expr, const Handle &name);
+  // True if every mention of name is the head of a call with argc
+  // arguments, or the name of its own define.
+  bool onlyCalled(const Handle &expr, const Handle &name, intptr_t argc);
+
+  Object *newName(const Handle &name, const char *suffix);
+  bool arrayContains(const Handle &arr, const Handle &x);
+
+  CGModule *module;
+
+  // Growable array of the lifted (define f (lambda ...))s
+  Handle lifted;
+  // Assoc list: lifted function -> payload size
+  Handle payloadSizes;
+};
+
+#endif
@@ -1,21 +1,22 @@
 #include <assert.h>
+#include <stdio.h>
+#include <sys/mman.h>
 
+#include "closconv.hpp"
 #include "codegen2.hpp"
+#include "inliner.hpp"
+#include "ir.hpp"
+#include "irgen.hpp"
 #include "runtime.hpp"
-
-#define KB 1024
-#define MB (KB * KB)
+#include "taginfer.hpp"
 
 using namespace AsmJit;
 
-static const int kPtrSize = sizeof(void *);
-static const GpReg kArgRegs[5] = { rsi, rdx, rcx, r8, r9 };
-static const GpReg kArgRegsWithClosure[6] = { rdi, rsi, rdx, rcx, r8, r9 };
-static const auto kClosureReg    = rdi,
-                  kFrameDescrReg = r10,
-                  kHeapPtr       = r12,
-                  kHeapLimit     = r13,
-                  kThreadState   = r14;
+// Registers that hold the top of the operand stack. They are callee-saved
+// in the C ABI so calling into the runtime does not clobber them.
+// @See CODEGEN_NOTES.md
+static const GpReg kTempRegs[3] = { rbx, r15, rbp };
+static const intptr_t kNumTempRegs = 3;
 
 Module::Module() {
   root = Object::newVector(2, Object::newNil());
@@ -40,7 +41,7 @@ intptr_t Module::addName(const Handle &name, const Handle &val) {
   Handle maybeIndex = Util::assocLookup(hAssoc, name, Util::kPtrEq, &ok);
   if (ok) {
     intptr_t ix = maybeIndex->fromFixnum();
-    Util::arrayAt(array(), ix) = val;
+    Util::arraySet(array(), ix, val);
     return ix;
   }
   else {
@@ -49,6 +50,7 @@ intptr_t Module::addName(const Handle &name, const Handle &val) {
     Handle newAssoc = Util::assocInsert(
         hAssoc, name, Object::newFixnum(ix), Util::kPtrEq);
     assoc() = newAssoc;
+    ThreadState::global().gcWriteBarrier(root);
     return ix;
   }
 }
@@ -87,29 +89,33 @@ static void forEachListItem(const Handle &kxs, F f) {
   }
 }
 
-static Object *listToArray(const Handle &xs, Handle *out) {
-  Handle restOut;
-  forEachListItem(xs,
-      [&](const Handle &x, intptr_t _, const Handle &rest) -> bool {
-
-    Util::arrayAppend(*out, x);
-    restOut = rest;
-    return true;
-  });
-  return restOut;
-}
-
 CGModule::CGModule() {
+  mutatedGlobals = Util::newAssocList();
+  for (auto &stub : lazyStubs) {
+    stub = NULL;
+  }
+
   symDefine      = Object::internSymbol("define");
   symSete        = Object::internSymbol("set!");
   symLambda      = Object::internSymbol("lambda");
   symQuote       = Object::internSymbol("quote");
   symBegin       = Object::internSymbol("begin");
   symIf          = Object::internSymbol("if");
+  symLet         = Object::internSymbol("let#");
   symPrimAdd     = Object::internSymbol("+#");
   symPrimSub     = Object::internSymbol("-#");
   symPrimLt      = Object::internSymbol("<#");
   symPrimCons    = Object::internSymbol("cons#");
+  symPrimMakeVector   = Object::internSymbol("make-vector#");
+  symPrimVector       = Object::internSymbol("vector#");
+  symPrimVectorRef    = Object::internSymbol("vector-ref#");
+  symPrimVectorSet    = Object::internSymbol("vector-set!#");
+  symPrimVectorLength = Object::internSymbol("vector-length#");
+
+  symPrimMakeClosure = Object::internSymbol("make-closure#");
+  symPrimClosureRef  = Object::internSymbol("closure-ref#");
+  symPrimThisClosure = Object::internSymbol("this-closure#");
+
   symPrimTrace   = Object::internSymbol("trace#");
   symPrimDisplay = Object::internSymbol("display#");
   symPrimNewLine = Object::internSymbol("newline#");
@@ -138,11 +144,14 @@ Object *CGModule::genModule(const Handle &top) {
   Handle mainClo;
 
   assert(top->isPair());
+  // The nested lambdas become definitions of their own.
+  ClosureConversion conversion(this);
+  Handle defns = conversion.run(top);
   forEachListItem(
-      top, [&](const Handle &defn, intptr_t _u, Object *_u2) -> bool {
+      defns, [&](const Handle &defn, intptr_t _u, Object *_u2) -> bool {
 
     Handle items = Util::newGrowableArray();
-    Handle rest = listToArray(defn, &items);
+    Handle rest = Util::listToArray(defn, items);
     assert(Util::arrayLength(items) == 3);
     assert(rest->isNil());
 
@@ -152,19 +161,30 @@ Object *CGModule::genModule(const Handle &top) {
 
     Handle name = Util::arrayAt(items, 1);
     Handle lamExpr = Util::newGrowableArray();
-    rest = listToArray(Util::arrayAt(items, 2), &lamExpr);
+    rest = Util::listToArray(Util::arrayAt(items, 2), lamExpr);
     assert(Util::arrayLength(lamExpr) >= 3);
     assert(Util::arrayAt(lamExpr, 0) == symLambda);
     assert(Util::arrayAt(lamExpr, 1)->isList());
 
-    CGFunction *cgf = new CGFunction(name, lamExpr, this);
+    CGFunction *cgf = new CGFunction(name, lamExpr, this,
+                                     conversion.numPayloadOf(name));
     // Provides an indirection for other code to refer
-    module.addName(name, cgf->makeClosure());
+    intptr_t ix = module.addName(name, cgf->makeClosure());
     if (name == symMain) {
       mainClo = cgf->closure;
     }
     cgfuncs.push_back(cgf);
 
+    if (ix < (intptr_t) globalFuncs.size()) {
+      // Defined twice: cannot be called directly.
+      markMutated(name);
+      globalFuncs[ix] = cgf;
+    }
+    else {
+      globalFuncs.push_back(cgf);
+    }
+    findMutatedGlobals(Util::arrayAt(items, 2));
+
     return true;
   });
 
@@ -173,14 +193,77 @@ Object *CGModule::genModule(const Handle &top) {
   moduleRoot = module.getRoot();
   moduleGlobalVector = moduleRoot->raw()->vectorAt(1);
 
+  // Needs to know all the globals and which of them are mutated.
+  Inliner inliner(this, Option::global().kInlineBudget);
+  for (auto cgf : cgfuncs) {
+    inliner.run(cgf);
+  }
+  TagInference(this).run(cgfuncs);
+
+  if (Option::global().kLazyCompile) {
+    // Only the functions that are called get compiled, and only then.
+    for (auto cgf : cgfuncs) {
+      RawObject *info = makeLazyFunction(cgf);
+      cgf->closure->raw()->cloInfo() = info;
+      // An incremental gc may have copied the closure already.
+      ThreadState::global().gcWriteBarrier(cgf->closure);
+    }
+    return mainClo;
+  }
+
   for (auto cgf : cgfuncs) {
     // Do the actual compilation
     cgf->compileFunction();
   }
 
+  // All the functions have their code now.
+  for (auto cgf : cgfuncs) {
+    cgf->patchDirectCalls();
+  }
+
   return mainClo;
 }
 
+void CGModule::findMutatedGlobals(const Handle &expr) {
+  if (!expr->isPair()) {
+    return;
+  }
+
+  Handle head = expr->raw()->car();
+  if (head == symQuote) {
+    return;
+  }
+  else if (head == symSete) {
+    Handle rest = expr->raw()->cdr();
+    if (rest->isPair() && rest->raw()->car()->isSymbol()) {
+      // Might be a local as well, but we are being conservative here.
+      markMutated(rest->raw()->car());
+    }
+  }
+
+  forEachListItem(expr,
+      [&](const Handle &x, intptr_t _u, Object *_u2) -> bool {
+    findMutatedGlobals(x);
+    return true;
+  });
+}
+
+void CGModule::markMutated(const Handle &name) {
+  mutatedGlobals = Util::assocInsert(mutatedGlobals, name,
+                                     Object::newTrue(), Util::kPtrEq);
+}
+
+CGFunction *CGModule::lookupKnownFunction(const Handle &name) {
+  intptr_t ix = lookupGlobal(name);
+  if (ix == -1) {
+    return NULL;
+  }
+
+  bool mutated;
+  Util::assocLookup(mutatedGlobals, name, Util::kPtrEq, &mutated);
+  return mutated ? NULL : globalFuncs[ix];
+}
+
 intptr_t CGModule::lookupGlobal(const Handle &name) {
   assert(moduleRoot);
   return module.lookupName(name);
@@ -189,21 +272,148 @@ intptr_t CGModule::lookupGlobal(const Handle &name) {
 // Short-hand
 #define __ xasm.
 
+// Code gets mappings of its own, instead of the assembler's: it is
+// read-write while it is filled in, and then read-execute except while
+// its direct calls are linked. @See protectCode
+static void *makeCode(X86Assembler &xasm) {
+  void *code = mmap(NULL, __ getCodeSize(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    perror("makeCode: mmap");
+    exit(1);
+  }
+  __ relocCode(code);
+  return code;
+}
+
+// [from, to) are page-aligned offsets in code, or to is its end.
+static void protectCode(void *code, intptr_t from, intptr_t to,
+                        bool isWritable) {
+  int prot = PROT_READ | (isWritable ? PROT_WRITE : PROT_EXEC);
+  if (mprotect(reinterpret_cast<char *>(code) + from, to - from, prot)) {
+    perror("protectCode: mprotect");
+    exit(1);
+  }
+}
+
+// Pads with zeros up to the next page, which the next protectCode can
+// then start at.
+static void padToPage(X86Assembler &xasm) {
+  __ align(kPtrSize);
+  while (!Util::isAligned<12>(__ getOffset())) {
+    __ emitQWord(0);
+  }
+}
+
+RawObject *CGModule::makeLazyFunction(CGFunction *f) {
+  X86Assembler xasm;
+
+  // Keep in sync with object.hpp's function definition.
+  for (intptr_t i = 0; i < RawObject::kFuncCodeOffset / kPtrSize; ++i) {
+    __ emitQWord(0);
+  }
+  __ mov(kScratchReg, reinterpret_cast<intptr_t>(f));
+  __ mov(rax, reinterpret_cast<intptr_t>(makeLazyStub(f->arity)));
+  __ jmp(rax);
+
+  intptr_t codeSize = __ getCodeSize();
+  void *rawPtr = makeCode(xasm);
+
+  // Checked and scanned as the real one would be.
+  RawObject *info = Object::newFunction(rawPtr, f->arity,
+      Object::newImmortal(f->name),
+      Object::newImmortalVector(0, Object::newNil()), f->numPayload);
+  info->funcSize() = codeSize;
+  protectCode(rawPtr, 0, codeSize, false);
+  return info;
+}
+
+void *CGModule::makeLazyStub(intptr_t arity) {
+  if (lazyStubs[arity]) {
+    return lazyStubs[arity];
+  }
+
+  X86Assembler xasm;
+
+  // For our pushes: compiling runs on the C stack.
+  if (Option::global().kInsertStackCheck) {
+    __ mov(rax, qword_ptr(rsp, -kStackProbeDistance));
+  }
+
+  // A frame like the callee's after its prologue, so that the gc sees
+  // (and updates) the closure and the arguments while we compile.
+  StackMap map(arity + 1);
+  for (intptr_t i = 0; i <= arity; ++i) {
+    __ push(kArgRegsWithClosure[i]);
+    map.setIsPtr(i);
+  }
+  __ mov(qword_ptr(kThreadState, kPtrSize * ThreadState::kPairPtrOffset),
+         kPairPtr);
+  __ mov(qword_ptr(kThreadState, kPtrSize * ThreadState::kPairLimitOffset),
+         kPairLimit);
+  __ mov(rax, reinterpret_cast<intptr_t>(StackMap::intern(map)));
+  __ mov(qword_ptr(kThreadState,
+                   kPtrSize * ThreadState::kLastStackMapOffset), rax);
+  __ mov(qword_ptr(kThreadState,
+                   kPtrSize * ThreadState::kLastStackPtrOffset), rsp);
+
+  // The CGFunction is in %r11, from the lazy function's code.
+  __ mov(rdi, kScratchReg);
+  __ mov(rsi, kThreadState);
+  __ mov(rax, reinterpret_cast<intptr_t>(&Runtime::compileOnFirstCall));
+  __ call(reinterpret_cast<void *>(&Scheme_callRuntime));
+
+  // Compiling allocates.
+  __ mov(kPairPtr,
+      qword_ptr(kThreadState, kPtrSize * ThreadState::kPairPtrOffset));
+  __ mov(kPairLimit,
+      qword_ptr(kThreadState, kPtrSize * ThreadState::kPairLimitOffset));
+  for (intptr_t i = arity; i >= 0; --i) {
+    __ pop(kArgRegsWithClosure[i]);
+  }
+
+  // The closure called may be a copy that make-closure# made before,
+  // and not the one that compileFunction patched.
+  __ mov(qword_ptr(kClosureReg, RawObject::kCloInfoOffset -
+                                RawObject::kClosureTag), rax);
+  __ lea(rax, qword_ptr(rax, RawObject::kFuncCodeOffset));
+  __ jmp(rax);
+
+  void *code = makeCode(xasm);
+  protectCode(code, 0, __ getCodeSize(), false);
+  if (Option::global().kInsertStackCheck) {
+    // The probe, with nothing pushed yet.
+    StackMap::record(reinterpret_cast<intptr_t>(code),
+                     StackMap::intern(StackMap(0)));
+  }
+  lazyStubs[arity] = code;
+  return code;
+}
+
 CGFunction::CGFunction(const Handle &name, const Handle &lamBody,
-                       CGModule *parent)
+                       CGModule *parent, intptr_t numPayload)
   : frameSize(0)
+  , numTemps(0)
+  , argRegsValid(0)
   , name(name)
   , lamBody(lamBody)
   , parent(parent)
+  , numPayload(numPayload)
+  , loopFrameSize(0)
+  , rawFunc(NULL)
+  , codeEnd(0)
   , locals(Util::newAssocList())
+  , argArray(Util::newGrowableArray())
   , stackItemList(Object::newNil())
-  , ptrOffsets(Util::newGrowableArray())
-  , relocArray(Util::newGrowableArray())
-{ }
+  , constPool(Util::newGrowableArray())
+{
+  Handle restArgs = Util::listToArray(Util::arrayAt(lamBody, 1), argArray);
+  arity = Util::arrayLength(argArray);
+}
 
 const Handle &CGFunction::makeClosure() {
   assert(!closure.getPtr());
-  closure = Object::newClosure(NULL);
+  closure = Object::newClosure(NULL, numPayload);
   //dprintf(2, "[mkClosure] %s => %p\n", name->rawSymbol(), closure);
   return closure;
 }
@@ -222,17 +432,23 @@ void CGFunction::compileFunction() {
     Util::logObj("CompileFunction Start", name);
   }
 
-  emitFuncHeader();
+  // Needs to be done before emitting anything: the frame layout depends
+  // on the register allocation. Falls back to compiling the
+  // s-expressions directly if the ir does not handle the function.
+  IRFunction ir(this);
+  IRGen irGen(this, &ir);
+  bool useIR = false;
+  if (Option::global().kUseIR && IRBuilder(this, &ir).build()) {
+    ir.optimize();
+    useIR = irGen.allocate();
+  }
 
-  // push frameDescr
-  pushReg(kFrameDescrReg, kIsNotPtr);
+  emitFuncHeader();
+  labelConstPool = __ newLabel();
 
   // push thisClosure
   pushReg(kClosureReg, kIsPtr);
 
-  Handle argArray = Util::newGrowableArray();
-  Handle restArgs = listToArray(Util::arrayAt(lamBody, 1), &argArray);
-  intptr_t arity = Util::arrayLength(argArray);
   // To be able to pass by reg
   assert(arity <= 5);
 
@@ -246,63 +462,98 @@ void CGFunction::compileFunction() {
     pushReg(kArgRegs[i], kIsPtr);
     addNewLocal(arg);
   }
+  // And they are still in their registers.
+  argRegsValid = (1 << arity) - 1;
+
+  // Check stack overflow: faults on the guard if there is less than
+  // kStackProbeDistance left, which is enough for our frame and the
+  // frames of the leaf functions that we call. Those skip the probe.
+  // @See Runtime::installStackOvfHandler
+  if (Option::global().kInsertStackCheck && !(useIR && irGen.isLeaf())) {
+    recordStackMap(__ getOffset(), makeStackMap());
+    __ mov(rax, qword_ptr(rsp, -kStackProbeDistance));
+  }
 
-  // Check stack overflow
-  auto labelStackOvf = __ newLabel();
-  FrameDescr fdAtPrologue = FrameDescr::unpack(makeFrameDescr());
-  if (Option::global().kInsertStackCheck) {
-    // diff = ts.firstSp - currSp;
-    // if (diff > 1MB) {
-    //   handleStackOvf();
-    // }
-    __ lea(rax, qword_ptr(rsp, 1 * MB));
-    __ cmp(rax, qword_ptr(kThreadState,
-                          kPtrSize * ThreadState::kFirstStackPtrOffset));
-    __ jl(labelStackOvf);
+  if (useIR) {
+    irGen.emitBody();
   }
+  else {
+    // Self tail calls jump back here with the new arguments in place.
+    labelLoopHeader = __ newLabel();
+    loopFrameSize = frameSize;
+    __ bind(labelLoopHeader);
 
-  // TCO can be runtime-specified
-  compileBody(lamBody, 2, Option::global().kTailCallOpt);
+    // TCO can be runtime-specified
+    compileBody(lamBody, 2, Option::global().kTailCallOpt);
 
-  // Return last value on the stack
-  popReg(rax);
-  popFrame();
-  __ ret();
+    // Return last value on the stack
+    popReg(rax);
+    assert(numTemps == 0);
+    popFrame();
+    __ ret();
+  }
 
-  // Handles stack overflow
-  if (Option::global().kInsertStackCheck) {
-    __ bind(labelStackOvf);
-    syncThreadState(&fdAtPrologue);
-    __ mov(rdi, kThreadState);
-    __ jmp((void *) Runtime::handleStackOvf);
+  // Used by direct calls whose target turns out to be too far away.
+  for (auto &dc : directCalls) {
+    __ bind(dc.stub);
+    dc.stubOffset = __ getOffset();
+    __ mov(kScratchReg, 0L);
+    dc.stubImmOffset = __ lastImmOffset().offset;
+    __ jmp(kScratchReg);
+  }
+
+  // The constants that may move, on pages of their own after the code:
+  // the gc updates them there, and the code stays read-execute.
+  intptr_t numConsts = Util::arrayLength(constPool);
+  Handle trimmedConstOffsets = Object::newImmortalVector(numConsts,
+                                                         Object::newNil());
+  intptr_t poolOffset = 0,
+           poolEnd = 0;
+  if (numConsts) {
+    padToPage(xasm);
+    __ bind(labelConstPool);
+    poolOffset = __ getOffset();
+    for (intptr_t i = 0; i < numConsts; ++i) {
+      __ emitQWord(0);
+      trimmedConstOffsets->raw()->vectorAt(i) = Object::newFixnum(
+          poolOffset - RawObject::kFuncCodeOffset + i * kPtrSize);
+    }
+    // The assembler's trampolines to the runtime go after it: they are
+    // code again.
+    padToPage(xasm);
+    poolEnd = __ getOffset();
   }
 
   // Used for debugging
   intptr_t codeSize = __ getCodeSize();
   // Create function and patch closure.
-  void *rawPtr = __ make();
+  void *rawPtr = makeCode(xasm);
 
-  Handle trimmedConstOffsets = Util::arrayToVector(ptrOffsets);
-
-  rawFunc = Object::newFunction(rawPtr, arity, name,
+  rawFunc = Object::newFunction(rawPtr, arity, Object::newImmortal(name),
       /* const ptr offset array */ trimmedConstOffsets,
-      /* num payload */ 0);
+      numPayload);
   rawFunc->funcSize() = codeSize;
   closure->raw()->cloInfo() = rawFunc;
 
-  // Patch relocs
-  for (intptr_t i = 0, len = Util::arrayLength(relocArray);
-       i < len; ++i) {
-    intptr_t base = rawFunc->funcCodeAs<intptr_t>();
-    Handle ptrVal = Util::arrayAt(relocArray, i);
-    intptr_t offset = Util::arrayAt(ptrOffsets, i)->fromFixnum();
-    Object **addr = reinterpret_cast<Object **>(base + offset);
-    *addr = ptrVal;
+  for (auto &site : stackMapSites) {
+    StackMap::record(reinterpret_cast<intptr_t>(rawPtr) + site.first,
+                     site.second);
+  }
 
-    //dprintf(2, "[PatchCodeReloc] %s[%ld] ", name->rawSymbol(), offset);
-    //ptrVal->displayDetail(2);
-    //dprintf(2, "\n");
+  // Fill the pool
+  Object **pool = reinterpret_cast<Object **>(
+      rawFunc->as<intptr_t>() + poolOffset);
+  for (intptr_t i = 0; i < numConsts; ++i) {
+    pool[i] = Util::arrayAt(constPool, i);
+  }
+  codeEnd = numConsts ? poolOffset : codeSize;
+  protectCode(rawPtr, 0, codeEnd, false);
+  if (numConsts) {
+    protectCode(rawPtr, poolEnd, codeSize, false);
   }
+  // The pool is outside of the heap: its pointers are only found
+  // through the closure, which may be old already.
+  ThreadState::global().gcWriteBarrier(closure);
 
   if (Option::global().kLogInfo) {
     Util::logPtr("CompileFunction Done", rawFunc->funcCodeAs<void *>());
@@ -319,7 +570,7 @@ void CGFunction::compileBody(const Handle &body, intptr_t start,
     }
     else {
       compileExpr(x, false);
-      popSome(1);
+      dropTemps(1);
     }
   }
 }
@@ -338,20 +589,23 @@ void CGFunction::compileExpr(const Handle &expr, bool isTail) {
     // Lookup first
     ix = lookupName(expr, &varLoc);
     if (varLoc == kIsLocal) {
-      __ mov(rax, qword_ptr(rsp, ix * kPtrSize));
-      pushReg(rax, kIsPtr);
+      intptr_t argIx = lookupArgReg(expr);
+      if (argIx != -1) {
+        pushTemp(kArgRegs[argIx]);
+      }
+      else {
+        const GpReg &r = nextTempReg(rax);
+        __ mov(r, qword_ptr(rsp, ix * kPtrSize));
+        pushTemp(r);
+      }
     }
     else if (varLoc == kIsGlobal) {
-      __ mov(rax, 0L);
-      // We add this pointer into our code later,
-      // since copying gc cannot track into unfinished code.
-      recordLastPtrOffset();
-      recordReloc(parent->moduleGlobalVector);
-
-      __ mov(rax, qword_ptr(rax,
+      const GpReg &r = nextTempReg(rax);
+      movObject(r, parent->moduleGlobalVector);
+      __ mov(r, qword_ptr(r,
             RawObject::kVectorElemOffset - RawObject::kVectorTag +
             kPtrSize * ix));
-      pushReg(rax, kIsPtr);
+      pushTemp(r);
     }
     else {
       dprintf(2, "lookupGlobal: %s not found\n", expr->rawSymbol());
@@ -363,7 +617,7 @@ void CGFunction::compileExpr(const Handle &expr, bool isTail) {
   case RawObject::kPairTag:
   {
     Handle xs = Util::newGrowableArray();
-    assert(listToArray(expr, &xs)->isNil());
+    assert(Util::listToArray(expr, xs)->isNil());
 
     // Check for define
     if (tryIf(xs, isTail)) {
@@ -374,6 +628,8 @@ void CGFunction::compileExpr(const Handle &expr, bool isTail) {
     }
     else if (tryBegin(xs, isTail)) {
     }
+    else if (tryLet(xs, isTail)) {
+    }
     else if (tryQuote(xs)) {
     }
     else if (tryPrimOp(xs, isTail)) {
@@ -406,6 +662,17 @@ void CGFunction::compileCall(const Handle &xs, bool isTail) {
   intptr_t argc = Util::arrayLength(xs) - 1;
   assert(argc < 6);
 
+  CGFunction *callee = lookupKnownCallee(Util::arrayAt(xs, 0));
+  if (callee && callee->arity == argc) {
+    if (isTail && callee == this) {
+      compileSelfTailCall(xs);
+    }
+    else {
+      compileDirectCall(callee, xs, isTail);
+    }
+    return;
+  }
+
   for (intptr_t i = 0; i < argc + 1; ++i) {
     // Evaluate func and args
     compileExpr(Util::arrayAt(xs, i), false);
@@ -415,8 +682,12 @@ void CGFunction::compileCall(const Handle &xs, bool isTail) {
     // Reverse pop values to argument pos
     popReg(kArgRegsWithClosure[i]);
   }
+  argRegsValid = 0;
+
+  // Temps of the enclosing expressions need to survive the call.
+  intptr_t numSpilled = isTail ? 0 : spillTemps();
 
-  FrameDescr savedFd = FrameDescr::unpack(makeFrameDescr());
+  const StackMap *savedMap = makeStackMap();
 
   // Check closure type
   __ mov(rax, rdi);
@@ -439,45 +710,186 @@ void CGFunction::compileCall(const Handle &xs, bool isTail) {
 
   auto labelOk = __ newLabel();
   if (!isTail) {
-    __ mov(kFrameDescrReg, makeFrameDescr());
-
     // If doing normal call:
     __ call(rax);
+    recordStackMap(__ getOffset(), savedMap);
 
     // After call
-    pushReg(rax, kIsPtr);
+    reloadTemps(numSpilled);
+    pushTemp(rax);
     __ jmp(labelOk);
   }
   else {
-    // Get caller's FD
-    __ mov(kFrameDescrReg, qword_ptr(rsp, getFrameDescr()));
-
     popPhysicalFrame();
     // Tail call
     __ jmp(rax);
 
     // To compensate for stack depth
-    pushVirtual(kIsPtr);
+    pushTempVirtual();
   }
 
   // Not a closure(%rdi = func, rsi = threadstate)
   __ bind(labelNotAClosure);
-  syncThreadState(&savedFd);
+  syncThreadState(savedMap);
   __ mov(rsi, kThreadState);
-  __ jmp(reinterpret_cast<void *>(&Runtime::handleNotAClosure));
+  callRuntime(reinterpret_cast<void *>(&Runtime::handleNotAClosure));
 
   // Wrong arg count(%rdi = func, %rsi = actual argc, rdx = threadstate)
   __ bind(labelArgCountMismatch);
-  syncThreadState(&savedFd);
+  syncThreadState(savedMap);
   __ mov(rsi, argc);
   __ mov(rdx, kThreadState);
-  __ jmp(reinterpret_cast<void *>(&Runtime::handleArgCountMismatch));
+  callRuntime(
+      reinterpret_cast<void *>(&Runtime::handleArgCountMismatch));
 
   if (!isTail) {
     __ bind(labelOk);
   }
 }
 
+void CGFunction::compileDirectCall(CGFunction *callee, const Handle &xs,
+                                   bool isTail) {
+  intptr_t argc = Util::arrayLength(xs) - 1;
+
+  for (intptr_t i = 1; i < argc + 1; ++i) {
+    compileExpr(Util::arrayAt(xs, i), false);
+  }
+
+  for (intptr_t i = argc; i >= 1; --i) {
+    popReg(kArgRegsWithClosure[i]);
+  }
+  argRegsValid = 0;
+
+  // The global is never assigned so the closure is a constant.
+  movObject(kClosureReg, callee->closure);
+
+  // Calls the code directly: no need to check for closure type and arity.
+  // The real target is patched in by patchDirectCalls.
+  DirectCall dc;
+  dc.callee = callee;
+  dc.stub = __ newLabel();
+
+  if (!isTail) {
+    intptr_t numSpilled = spillTemps();
+    __ call(dc.stub);
+    dc.relOffset = __ getOffset() - 4;
+    recordStackMap(__ getOffset(), makeStackMap());
+    reloadTemps(numSpilled);
+    pushTemp(rax);
+  }
+  else {
+    popPhysicalFrame();
+    __ jmp(dc.stub);
+    dc.relOffset = __ getOffset() - 4;
+
+    // To compensate for stack depth
+    pushTempVirtual();
+  }
+
+  directCalls.push_back(dc);
+}
+
+void CGFunction::compileSelfTailCall(const Handle &xs) {
+  // An argument passed unchanged in its own position needs neither to
+  // be evaluated nor to be stored back. Argument evaluation order is
+  // unspecified, so reading it after the others is fine.
+  intptr_t unchanged = 0;
+  for (intptr_t i = 0; i < arity; ++i) {
+    Handle arg = Util::arrayAt(argArray, i);
+    if (Util::arrayAt(xs, i + 1) == arg &&
+        lookupLocal(arg) == getArgSlot(i) / kPtrSize) {
+      unchanged |= 1 << i;
+    }
+  }
+
+  for (intptr_t i = 0; i < arity; ++i) {
+    if (!(unchanged & (1 << i))) {
+      compileExpr(Util::arrayAt(xs, i + 1), false);
+    }
+  }
+
+  for (intptr_t i = arity - 1; i >= 0; --i) {
+    if (!(unchanged & (1 << i))) {
+      popReg(kArgRegs[i]);
+    }
+  }
+
+  // Reuse the argument slots in place.
+  for (intptr_t i = 0; i < arity; ++i) {
+    if (!(unchanged & (1 << i))) {
+      __ mov(qword_ptr(rsp, getArgSlot(i)), kArgRegs[i]);
+    }
+    else if (!(argRegsValid & (1 << i))) {
+      __ mov(kArgRegs[i], qword_ptr(rsp, getArgSlot(i)));
+    }
+  }
+
+  // Drop the locals defined in the body and loop. The closure and frame
+  // descriptor slots are still ours.
+  if (frameSize != loopFrameSize) {
+    __ add(rsp, (frameSize - loopFrameSize) * kPtrSize);
+  }
+  __ jmp(labelLoopHeader);
+
+  // To compensate for stack depth
+  pushTempVirtual();
+}
+
+CGFunction *CGFunction::lookupKnownCallee(const Handle &func) {
+  if (!func->isSymbol() || lookupLocal(func) != -1) {
+    return NULL;
+  }
+  return parent->lookupKnownFunction(func);
+}
+
+RawObject *CGFunction::compileOnFirstCall() {
+  if (rawFunc) {
+    // Called through a closure that still has our lazy function: one
+    // that make-closure# copied from ours before we were compiled, or
+    // the copy that an incremental gc made of it.
+    return rawFunc;
+  }
+
+  compileFunction();
+  patchDirectCalls();
+  for (auto caller : lazyCallers) {
+    caller->patchDirectCalls(this);
+  }
+  lazyCallers.clear();
+  return rawFunc;
+}
+
+void CGFunction::patchDirectCalls(CGFunction *onlyTo) {
+  intptr_t base = rawFunc->as<intptr_t>();
+  if (directCalls.empty()) {
+    return;
+  }
+  protectCode(rawFunc, 0, codeEnd, true);
+
+  for (auto &dc : directCalls) {
+    if (onlyTo && dc.callee != onlyTo) {
+      continue;
+    }
+    if (!dc.callee->rawFunc && (dc.callee->lazyCallers.empty() ||
+                                dc.callee->lazyCallers.back() != this)) {
+      // Patched again once it is compiled.
+      dc.callee->lazyCallers.push_back(this);
+    }
+
+    intptr_t target =
+        dc.callee->closure->raw()->cloInfo()->funcCodeAs<intptr_t>();
+    *reinterpret_cast<intptr_t *>(base + dc.stubImmOffset) = target;
+
+    // Bypass the stub if the target is within reach.
+    intptr_t disp = target - (base + dc.relOffset + 4);
+    if (disp != static_cast<int32_t>(disp)) {
+      disp = dc.stubOffset - (dc.relOffset + 4);
+    }
+    *reinterpret_cast<int32_t *>(base + dc.relOffset) = disp;
+  }
+  protectCode(rawFunc, 0, codeEnd, false);
+}
+
 intptr_t CGFunction::lookupName(const Handle &name, LookupResult *out) {
   intptr_t ix = lookupLocal(name);
   if (ix != -1) {
@@ -503,7 +915,11 @@ bool CGFunction::tryDefine(const Handle &xs) {
 
   assert(Util::arrayAt(xs, 1)->isSymbol());
   compileExpr(Util::arrayAt(xs, 2));
+  // Locals always live in the frame.
+  const GpReg &r = popToReg(rax);
+  pushReg(r, kIsPtr);
   // XXX: handle duplicate define?
+  invalidateArgReg(Util::arrayAt(xs, 1));
   addNewLocal(Util::arrayAt(xs, 1));
   pushObject(Object::newVoid());
   return true;
@@ -526,18 +942,16 @@ bool CGFunction::trySete(const Handle &xs) {
 
   if (loc == kIsLocal) {
     __ mov(qword_ptr(rsp, ix * kPtrSize), rax);
+    invalidateArgReg(varName);
   }
   else if (loc == kIsGlobal) {
-    __ mov(rcx, 0L);
-    // We add this pointer into our code later,
-    // since copying gc cannot track into unfinished code.
-    recordLastPtrOffset();
-    recordReloc(parent->moduleGlobalVector);
-
-    // Write back. XXX: write barrier when using generational GC?
-    __ mov(qword_ptr(rcx, RawObject::kVectorElemOffset -
+    movObject(kScratchReg, parent->moduleGlobalVector);
+
+    // Write back. The vector is most likely old.
+    __ mov(qword_ptr(kScratchReg, RawObject::kVectorElemOffset -
                           RawObject::kVectorTag + kPtrSize * ix),
         rax);
+    emitWriteBarrier(kScratchReg, RawObject::kVectorTag);
   }
   else {
     dprintf(2, "set!: variable not defined: ");
@@ -559,22 +973,35 @@ bool CGFunction::tryIf(const Handle &xs, bool isTail) {
   Label labelFalse = __ newLabel(),
         labelDone  = __ newLabel();
 
-  // Pred
-  compileExpr(Util::arrayAt(xs, 1));
-  popReg(rax);
+  // Pred. Compares jump on the flags directly.
+  const Handle pred = Util::arrayAt(xs, 1);
+  CondCode cond;
+  Handle predXs = Util::newGrowableArray();
+  if (pred->isPair() && Util::listToArray(pred, predXs)->isNil() &&
+      tryCompare(predXs, &cond)) {
+    jumpIf(negateCond(cond), labelFalse);
+  }
+  else {
+    compileExpr(pred);
+    popReg(rax);
 
-  __ cmp(rax, Object::newFalse()->as<intptr_t>());
-  __ je(labelFalse);
+    __ cmp(rax, Object::newFalse()->as<intptr_t>());
+    __ je(labelFalse);
+  }
 
+  intptr_t argRegsValidAtPred = argRegsValid;
   compileExpr(Util::arrayAt(xs, 2), isTail);
   __ jmp(labelDone);
   // Since we need to balance out those two branches
-  popVirtual(1);
+  dropTempsVirtual(1);
+  intptr_t argRegsValidAtThen = argRegsValid;
+  argRegsValid = argRegsValidAtPred;
 
   __ bind(labelFalse);
   compileExpr(Util::arrayAt(xs, 3), isTail);
 
   __ bind(labelDone);
+  argRegsValid &= argRegsValidAtThen;
 
   return true;
 }
@@ -584,7 +1011,7 @@ bool CGFunction::tryQuote(const Handle &expr) {
       Util::arrayAt(expr, 0) != parent->symQuote) {
     return false;
   }
-  pushObject(Util::arrayAt(expr, 1));
+  pushObject(Object::newImmortal(Util::arrayAt(expr, 1)));
   return true;
 }
 
@@ -596,6 +1023,50 @@ bool CGFunction::tryBegin(const Handle &expr, bool isTail) {
   return true;
 }
 
+bool CGFunction::tryLet(const Handle &xs, bool isTail) {
+  intptr_t len = Util::arrayLength(xs);
+  if (len < 3 || Util::arrayAt(xs, 0) != parent->symLet) {
+    return false;
+  }
+
+  Handle bindings = Util::newGrowableArray();
+  Handle rest = Util::listToArray(Util::arrayAt(xs, 1), bindings);
+  assert(rest->isNil());
+  intptr_t numBindings = Util::arrayLength(bindings);
+
+  Handle localsAtEntry = locals;
+  intptr_t frameSizeAtEntry = frameSize;
+
+  for (intptr_t i = 0; i < numBindings; ++i) {
+    Handle binding = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(bindings, i), binding);
+    assert(Util::arrayLength(binding) == 2);
+
+    // Names are fresh (see Inliner), so they never shadow other locals.
+    Handle name = Util::arrayAt(binding, 0);
+    assert(name->isSymbol());
+    assert(lookupLocal(name) == -1);
+
+    compileExpr(Util::arrayAt(binding, 1));
+    // Bindings live in the frame, like defines.
+    const GpReg &r = popToReg(rax);
+    pushReg(r, kIsPtr);
+    addNewLocal(name);
+  }
+
+  compileBody(xs, 2, isTail);
+
+  // Drop the bindings from under the result.
+  const GpReg &r = popToReg(rax);
+  assert(frameSize == frameSizeAtEntry + numBindings);
+  popSome(numBindings);
+  pushTemp(r);
+
+  // New names were consed in front of the old ones.
+  locals = localsAtEntry;
+  return true;
+}
+
 bool CGFunction::tryPrimOp(const Handle &xs, bool isTail) {
   intptr_t len = Util::arrayLength(xs);
   if (len < 1) {
@@ -606,32 +1077,53 @@ bool CGFunction::tryPrimOp(const Handle &xs, bool isTail) {
 
   //dprintf(2, "opName = %s, size = %ld\n", opName.c_str(), xs.size());
 
+  CondCode cond;
+  if (tryCompare(xs, &cond)) {
+    const GpReg &r = nextTempReg(rax);
+    __ mov(kScratchReg, Object::newTrue()->as<intptr_t>());
+    __ mov(r, Object::newFalse()->as<intptr_t>());
+    cmovIf(cond, r, kScratchReg);
+    pushTemp(r);
+    return true;
+  }
+
+  intptr_t imm, constIx = -1;
   if (opName == parent->symPrimAdd && len == 3) {
+    constIx = isSmallFixnum(Util::arrayAt(xs, 2), &imm) ? 2 :
+              isSmallFixnum(Util::arrayAt(xs, 1), &imm) ? 1 : -1;
+  }
+
+  if (opName == parent->symPrimAdd && constIx != -1) {
+    // The tags cancel out: add the untagged constant instead.
+    compileExpr(Util::arrayAt(xs, 3 - constIx));
+    const GpReg &lhs = popToReg(rax);
+    __ add(lhs, imm);
+    pushTemp(lhs);
+  }
+  else if (opName == parent->symPrimSub && len == 3 &&
+           isSmallFixnum(Util::arrayAt(xs, 2), &imm)) {
     compileExpr(Util::arrayAt(xs, 1));
-    compileExpr(Util::arrayAt(xs, 2));
-    popReg(rax);
-    __ add(rax, qword_ptr(rsp));
-    __ sub(rax, RawObject::kFixnumTag);
-    __ mov(qword_ptr(rsp), rax);
+    const GpReg &lhs = popToReg(rax);
+    __ sub(lhs, imm);
+    pushTemp(lhs);
   }
-  else if (opName == parent->symPrimSub && len == 3) {
+  else if (opName == parent->symPrimAdd && len == 3) {
     compileExpr(Util::arrayAt(xs, 1));
     compileExpr(Util::arrayAt(xs, 2));
-    __ mov(rax, qword_ptr(rsp, kPtrSize));
-    __ sub(rax, qword_ptr(rsp));
-    __ add(rax, RawObject::kFixnumTag);
-    popSome(1);
-    __ mov(qword_ptr(rsp), rax);
+    const GpReg &rhs = popToReg(kScratchReg);
+    const GpReg &lhs = popToReg(rax);
+    // One of the tags has to go.
+    __ lea(lhs, qword_ptr(lhs, rhs, 0, -RawObject::kFixnumTag));
+    pushTemp(lhs);
   }
-  else if (opName == parent->symPrimLt && len == 3) {
+  else if (opName == parent->symPrimSub && len == 3) {
     compileExpr(Util::arrayAt(xs, 1));
     compileExpr(Util::arrayAt(xs, 2));
-    popReg(rax);
-    __ cmp(rax, qword_ptr(rsp));
-    __ mov(ecx, Object::newTrue()->as<intptr_t>());
-    __ mov(eax, Object::newFalse()->as<intptr_t>());
-    __ cmovg(rax, rcx);
-    __ mov(qword_ptr(rsp), rax);
+    const GpReg &rhs = popToReg(kScratchReg);
+    const GpReg &lhs = popToReg(rax);
+    __ sub(lhs, rhs);
+    __ add(lhs, RawObject::kFixnumTag);
+    pushTemp(lhs);
   }
   else if (opName == parent->symPrimCons && len == 3) {
     // (cons# 1 2)
@@ -641,50 +1133,154 @@ bool CGFunction::tryPrimOp(const Handle &xs, bool isTail) {
     allocPair();
   }
 
+  else if (opName == parent->symPrimMakeVector && len == 3) {
+    // (make-vector# n fill). The fill is compiled first so that it stays
+    // a temp, and so is updated by the gc, while the vector is allocated.
+    compileExpr(Util::arrayAt(xs, 2));
+    compileExpr(Util::arrayAt(xs, 1));
+    popReg(rax);
+    // The header and the size come before the elements.
+    __ sar(rax, RawObject::kTagShift);
+    __ shl(rax, 3);
+    __ add(rax, sizeof(GcHeader) + RawObject::kVectorElemOffset);
+    allocObject(0, RawObject::kVectorTag);
+
+    __ lea(rcx, qword_ptr(rax, -static_cast<intptr_t>(sizeof(GcHeader)) -
+                               RawObject::kVectorElemOffset));
+    __ shr(rcx, 3);
+    __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                  RawObject::kVectorSizeOffset), rcx);
+    __ lea(rdi, qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                       RawObject::kVectorElemOffset));
+    popReg(rax);
+    __ rep_stosq();
+    // %rcx is kArgRegs[2].
+    argRegsValid &= ~(1 << 2);
+
+    const GpReg &r = nextTempReg(rax);
+    __ lea(r, qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                     RawObject::kVectorTag));
+    pushTemp(r);
+  }
+  else if (opName == parent->symPrimVector) {
+    // (vector# a b ...): a fixed size. The elements are stored as they
+    // are popped.
+    intptr_t numElems = len - 1;
+    for (intptr_t i = 1; i < len; ++i) {
+      compileExpr(Util::arrayAt(xs, i));
+    }
+    allocObject(sizeof(GcHeader) + RawObject::kVectorElemOffset +
+                kPtrSize * numElems, RawObject::kVectorTag);
+
+    __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                  RawObject::kVectorSizeOffset), numElems);
+    for (intptr_t i = numElems - 1; i >= 0; --i) {
+      const GpReg &x = popToReg(rax);
+      __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                    RawObject::kVectorElemOffset +
+                                    kPtrSize * i), x);
+    }
+
+    const GpReg &r = nextTempReg(rax);
+    __ lea(r, qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                     RawObject::kVectorTag));
+    pushTemp(r);
+  }
+  else if (opName == parent->symPrimVectorRef && len == 3) {
+    compileExpr(Util::arrayAt(xs, 1));
+    compileExpr(Util::arrayAt(xs, 2));
+    popReg(kScratchReg);
+    __ sar(kScratchReg, RawObject::kTagShift);
+    const GpReg &r = popToReg(rax);
+    __ mov(r, qword_ptr(r, kScratchReg, 3, RawObject::kVectorElemOffset -
+                                           RawObject::kVectorTag));
+    pushTemp(r);
+  }
+  else if (opName == parent->symPrimVectorSet && len == 4) {
+    compileExpr(Util::arrayAt(xs, 1));
+    compileExpr(Util::arrayAt(xs, 2));
+    compileExpr(Util::arrayAt(xs, 3));
+    const GpReg &x = popToReg(rax);
+    popReg(kScratchReg);
+    __ sar(kScratchReg, RawObject::kTagShift);
+    // Not an argument register here: thisClosure is read from its slot.
+    popReg(kClosureReg);
+    __ mov(qword_ptr(kClosureReg, kScratchReg, 3,
+                     RawObject::kVectorElemOffset - RawObject::kVectorTag),
+           x);
+    emitWriteBarrier(kClosureReg, RawObject::kVectorTag);
+    pushObject(Object::newVoid());
+  }
+  else if (opName == parent->symPrimVectorLength && len == 2) {
+    compileExpr(Util::arrayAt(xs, 1));
+    const GpReg &r = popToReg(rax);
+    __ mov(r, qword_ptr(r, RawObject::kVectorSizeOffset -
+                           RawObject::kVectorTag));
+    __ shl(r, RawObject::kTagShift);
+    __ add(r, RawObject::kFixnumTag);
+    pushTemp(r);
+  }
+  else if (opName == parent->symPrimMakeClosure && len >= 2) {
+    // (make-closure# f v ...): f is a lifted function, which may not be
+    // compiled yet, so its info is read from its own closure. The values
+    // are stored as they are popped. @See ClosureConversion
+    CGFunction *callee = parent->lookupKnownFunction(Util::arrayAt(xs, 1));
+    intptr_t numPayload = len - 2;
+    assert(callee && callee->numPayload == numPayload);
+    for (intptr_t i = 2; i < len; ++i) {
+      compileExpr(Util::arrayAt(xs, i));
+    }
+    allocObject(sizeof(GcHeader) + RawObject::kCloPayloadOffset +
+                kPtrSize * numPayload, RawObject::kClosureTag);
+
+    movObject(rax, callee->closure);
+    __ mov(rax, qword_ptr(rax, RawObject::kCloInfoOffset -
+                               RawObject::kClosureTag));
+    __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                  RawObject::kCloInfoOffset), rax);
+    for (intptr_t i = numPayload - 1; i >= 0; --i) {
+      const GpReg &x = popToReg(rax);
+      __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                    RawObject::kCloPayloadOffset +
+                                    kPtrSize * i), x);
+    }
+
+    const GpReg &r = nextTempReg(rax);
+    __ lea(r, qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                     RawObject::kClosureTag));
+    pushTemp(r);
+  }
+  else if (opName == parent->symPrimClosureRef && len == 2) {
+    const GpReg &r = nextTempReg(rax);
+    __ mov(r, qword_ptr(rsp, getThisClosure()));
+    __ mov(r, qword_ptr(r, RawObject::kCloPayloadOffset +
+                           kPtrSize * Util::arrayAt(xs, 1)->fromFixnum() -
+                           RawObject::kClosureTag));
+    pushTemp(r);
+  }
+  else if (opName == parent->symPrimThisClosure && len == 1) {
+    const GpReg &r = nextTempReg(rax);
+    __ mov(r, qword_ptr(rsp, getThisClosure()));
+    pushTemp(r);
+  }
+
 #define MK_IMPL(_unused, klsName, attrName)                             \
   else if (opName == parent->symPrim ## attrName && len == 2) {         \
     compileExpr(Util::arrayAt(xs, 1));                                  \
-    popReg(rax);                                                        \
-    __ mov(rax, qword_ptr(rax,                                          \
+    const GpReg &r = popToReg(rax);                                     \
+    __ mov(r, qword_ptr(r,                                              \
           RawObject::k ## attrName ## Offset -                          \
           RawObject::k ## klsName ## Tag));                             \
-    pushReg(rax, kIsPtr);                                               \
+    pushTemp(r);                                                        \
   }
 PRIM_ATTR_ACCESSORS(MK_IMPL)
-#undef MK_IMPL
-
-#define MK_IMPL(_unused, typeName)                                      \
-  else if (opName == parent->symPrim ## typeName ## p && len == 2) {    \
-    compileExpr(Util::arrayAt(xs, 1));                                  \
-    popReg(rax);                                                        \
-    __ and_(eax, RawObject::kTagMask);                                  \
-    __ cmp(eax, RawObject::k ## typeName ## Tag);                       \
-    __ mov(ecx, Object::newTrue()->as<intptr_t>());                     \
-    __ mov(eax, Object::newFalse()->as<intptr_t>());                    \
-    __ cmove(eax, ecx);                                                 \
-    pushReg(rax, kIsPtr);                                               \
-  }
-PRIM_TAG_PREDICATES(MK_IMPL)
-#undef MK_IMPL
-
-#define MK_IMPL(_unused, objName)                                       \
-  else if (opName == parent->symPrim ## objName ## p && len == 2) {     \
-    compileExpr(Util::arrayAt(xs, 1));                                  \
-    popReg(rax);                                                        \
-    __ mov(ecx, reinterpret_cast<intptr_t>(Object::new ## objName()));  \
-    __ cmp(rax, rcx);                                                   \
-    __ mov(ecx, Object::newTrue()->as<intptr_t>());                     \
-    __ mov(eax, Object::newFalse()->as<intptr_t>());                    \
-    __ cmove(eax, ecx);                                                 \
-    pushReg(rax, kIsPtr);                                               \
-  }
-PRIM_SINGLETON_PREDICATES(MK_IMPL)
 #undef MK_IMPL
 
   else if (opName == parent->symPrimTrace && len == 3) {
     compileExpr(Util::arrayAt(xs, 1));
     popReg(rdi);
-    __ call(reinterpret_cast<intptr_t>(&Runtime::traceObject));
+    callRuntime(reinterpret_cast<void *>(&Runtime::traceObject));
+    argRegsValid = 0;
     compileExpr(Util::arrayAt(xs, 2), isTail);
   }
   else if (opName == parent->symPrimDisplay && len == 2) {
@@ -692,12 +1288,14 @@ PRIM_SINGLETON_PREDICATES(MK_IMPL)
     // Stdout
     popReg(rdi);
     __ mov(esi, 1);
-    __ call(reinterpret_cast<intptr_t>((void *) &Object::displayDetail));
+    callRuntime((void *) &Object::displayDetail);
+    argRegsValid = 0;
     pushObject(Object::newVoid());
   }
   else if (opName == parent->symPrimNewLine && len == 1) {
     __ mov(edi, 1);
-    __ call(reinterpret_cast<intptr_t>((void *) &Runtime::printNewLine));
+    callRuntime((void *) &Runtime::printNewLine);
+    argRegsValid = 0;
     pushObject(Object::newVoid());
   }
   else if (opName == parent->symPrimError && len == 2) {
@@ -707,10 +1305,10 @@ PRIM_SINGLETON_PREDICATES(MK_IMPL)
     popReg(rdi);
     syncThreadState();
     __ mov(rsi, kThreadState);
-    __ jmp((intptr_t) &Runtime::handleUserError);
+    callRuntime((void *) &Runtime::handleUserError);
 
     // To keep stack balence
-    pushVirtual(kIsPtr);
+    pushTempVirtual();
   }
   else {
     return false;
@@ -720,21 +1318,22 @@ PRIM_SINGLETON_PREDICATES(MK_IMPL)
 }
 
 void CGFunction::allocPair() {
-  size_t hSize = sizeof(GcHeader);
-  size_t rawAllocSize = RawObject::kSizeOfPair + hSize;
-  assert(Util::isAligned<4>(rawAllocSize));
-  assert(hSize == 0x10);
+  // In the pair nursery, with no header.
+  size_t rawAllocSize = RawObject::kSizeOfPair;
+  assert(rawAllocSize == ThreadState::kPairSize);
 
   auto labelAllocOk = __ newLabel();
 
 #ifndef kSanyaGCDebug
   // Try alloc
-  __ lea(rcx, qword_ptr(kHeapPtr, rawAllocSize));
-  __ cmp(rcx, kHeapLimit);
+  __ lea(kScratchReg, qword_ptr(kPairPtr, rawAllocSize));
+  __ cmp(kScratchReg, kPairLimit);
   __ jle(labelAllocOk);
 #endif
 
-  // Alloc failed: Do GC
+  // Alloc failed: Do GC. Car, cdr and other temps that are in registers
+  // need to be visible to (and be updated by) the gc.
+  intptr_t numSpilled = spillTemps();
   syncThreadState();
   __ mov(rax, rawAllocSize);
   __ mov(qword_ptr(kThreadState,
@@ -742,37 +1341,87 @@ void CGFunction::allocPair() {
         rax);
 
   __ mov(rdi, kThreadState);
-  __ call(reinterpret_cast<void *>(&Runtime::collectAndAlloc));
-  // Extract new heapPtr and limitPtr
-  __ mov(kHeapPtr,
-      qword_ptr(kThreadState, kPtrSize * ThreadState::kHeapPtrOffset));
-  __ mov(kHeapLimit,
-      qword_ptr(kThreadState, kPtrSize * ThreadState::kHeapLimitOffset));
+  callRuntime(reinterpret_cast<void *>(&Runtime::collectAndAlloc));
+  // Extract new pairPtr and pairLimit
+  __ mov(kPairPtr,
+      qword_ptr(kThreadState, kPtrSize * ThreadState::kPairPtrOffset));
+  __ mov(kPairLimit,
+      qword_ptr(kThreadState, kPtrSize * ThreadState::kPairLimitOffset));
+  reloadTemps(numSpilled);
+  reloadArgRegs();
   // And retry
-  __ lea(rcx, qword_ptr(kHeapPtr, rawAllocSize));
+  __ lea(kScratchReg, qword_ptr(kPairPtr, rawAllocSize));
 
   // Alloc ok: fill content
   __ bind(labelAllocOk);
-  // Init gc header
-  // Mark: 0
-  __ mov(dword_ptr(kHeapPtr, 0), 0);
-  // size: (precalculated)
-  __ mov(dword_ptr(kHeapPtr, 4), rawAllocSize);
 
   // Put cdr
-  popReg(rax);
-  __ mov(qword_ptr(kHeapPtr, hSize + RawObject::kCdrOffset), rax);
+  const GpReg &cdr = popToReg(rax);
+  __ mov(qword_ptr(kPairPtr, RawObject::kCdrOffset), cdr);
 
   // Put car
-  popReg(rax);
-  __ mov(qword_ptr(kHeapPtr, hSize + RawObject::kCarOffset), rax);
+  const GpReg &car = popToReg(rax);
+  __ mov(qword_ptr(kPairPtr, RawObject::kCarOffset), car);
+
+  // Tag
+  __ add(kPairPtr, RawObject::kPairTag);
+  pushTemp(kPairPtr);
+
+  // Write new pairPtr back
+  __ mov(kPairPtr, kScratchReg);
+}
+
+void CGFunction::allocObject(intptr_t size, intptr_t tag) {
+  Mem lastAllocReq = qword_ptr(kThreadState,
+                               kPtrSize * ThreadState::kLastAllocReqOffset);
+  auto labelAllocFailed = __ newLabel(),
+       labelAllocOk = __ newLabel();
+
+  if (size) {
+    assert(Util::isAligned<3>(size));
+    __ mov(rax, size);
+  }
+  __ mov(lastAllocReq, rax);
+
+#ifndef kSanyaGCDebug
+  // In the object nursery, whose pointers stay in threadState.
+  Mem heapPtr = qword_ptr(kThreadState,
+                          kPtrSize * ThreadState::kHeapPtrOffset),
+      heapLimit = qword_ptr(kThreadState,
+                            kPtrSize * ThreadState::kHeapLimitOffset);
+  intptr_t maxNurserySize = ThreadState::kLargeObjectSize + sizeof(GcHeader);
+  if (!size || size < maxNurserySize) {
+    // Try alloc
+    if (!size) {
+      __ cmp(rax, maxNurserySize);
+      __ jae(labelAllocFailed);
+    }
+    __ mov(kScratchReg, heapPtr);
+    __ add(rax, kScratchReg);
+    __ cmp(rax, heapLimit);
+    __ ja(labelAllocFailed);
+    __ mov(heapPtr, rax);
+    __ sub(rax, kScratchReg);
+    __ mov(dword_ptr(kScratchReg, 0), 0);
+    __ mov(dword_ptr(kScratchReg, 4), eax);
+    __ jmp(labelAllocOk);
+  }
+#endif
 
-  // GcHeader padding and tag
-  __ add(kHeapPtr, hSize + RawObject::kPairTag);
-  pushReg(kHeapPtr, kIsPtr);
+  // Alloc failed, or the object is large: the runtime allocates it, and
+  // may do a gc first.
+  __ bind(labelAllocFailed);
+  intptr_t numSpilled = spillTemps();
+  syncThreadState();
+  __ mov(rdi, kThreadState);
+  __ mov(rsi, tag);
+  callRuntime(reinterpret_cast<void *>(&Runtime::allocObject));
+  __ mov(kScratchReg, rax);
+  __ mov(eax, dword_ptr(kScratchReg, 4));
+  reloadTemps(numSpilled);
+  reloadArgRegs();
 
-  // Write new heapPtr back
-  __ mov(kHeapPtr, rcx);
+  __ bind(labelAllocOk);
 }
 
 void CGFunction::shiftLocal(intptr_t n) {
@@ -780,42 +1429,147 @@ void CGFunction::shiftLocal(intptr_t n) {
   forEachListItem(locals,
       [=](const Handle &x, intptr_t _u, Object *_u2) -> bool {
     x->raw()->cdr() = Object::newFixnum(x->raw()->cdr()->fromFixnum() + n);
+    ThreadState::global().gcWriteBarrier(x);
     return true;
   });
 }
 
-intptr_t CGFunction::getThisClosure() {
-  return (frameSize - 2) * kPtrSize;
+bool CGFunction::tryCompare(const Handle &xs, CondCode *cond) {
+  intptr_t len = Util::arrayLength(xs);
+  if (len < 1) {
+    return false;
+  }
+
+  const Handle opName = Util::arrayAt(xs, 0);
+  intptr_t imm;
+
+  if (opName == parent->symPrimLt && len == 3) {
+    if (isImmediate(Util::arrayAt(xs, 2), &imm)) {
+      compileExpr(Util::arrayAt(xs, 1));
+      const GpReg &lhs = popToReg(rax);
+      __ cmp(lhs, imm);
+      *cond = kCondLess;
+    }
+    else if (isImmediate(Util::arrayAt(xs, 1), &imm)) {
+      // Constants have no effects, so only the rhs needs to be compiled.
+      compileExpr(Util::arrayAt(xs, 2));
+      const GpReg &rhs = popToReg(rax);
+      __ cmp(rhs, imm);
+      *cond = kCondGreater;
+    }
+    else {
+      compileExpr(Util::arrayAt(xs, 1));
+      compileExpr(Util::arrayAt(xs, 2));
+      const GpReg &rhs = popToReg(kScratchReg);
+      const GpReg &lhs = popToReg(rax);
+      __ cmp(lhs, rhs);
+      *cond = kCondLess;
+    }
+  }
+
+#define MK_IMPL(_unused, typeName)                                      \
+  else if (opName == parent->symPrim ## typeName ## p && len == 2) {    \
+    compileExpr(Util::arrayAt(xs, 1));                                  \
+    popReg(rax);                                                        \
+    __ and_(eax, RawObject::kTagMask);                                  \
+    __ cmp(eax, RawObject::k ## typeName ## Tag);                       \
+    *cond = kCondEqual;                                                 \
+  }
+PRIM_TAG_PREDICATES(MK_IMPL)
+#undef MK_IMPL
+
+#define MK_IMPL(_unused, objName)                                       \
+  else if (opName == parent->symPrim ## objName ## p && len == 2) {     \
+    compileExpr(Util::arrayAt(xs, 1));                                  \
+    const GpReg &r = popToReg(rax);                                     \
+    __ cmp(r, reinterpret_cast<intptr_t>(Object::new ## objName()));    \
+    *cond = kCondEqual;                                                 \
+  }
+PRIM_SINGLETON_PREDICATES(MK_IMPL)
+#undef MK_IMPL
+
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+void CGFunction::jumpIf(CondCode cond, const Label &label) {
+  switch (cond) {
+  case kCondLess:         __ jl(label);  break;
+  case kCondGreaterEqual: __ jge(label); break;
+  case kCondGreater:      __ jg(label);  break;
+  case kCondLessEqual:    __ jle(label); break;
+  case kCondEqual:        __ je(label);  break;
+  case kCondNotEqual:     __ jne(label); break;
+  }
+}
+
+void CGFunction::cmovIf(CondCode cond, const GpReg &dst, const GpReg &src) {
+  switch (cond) {
+  case kCondLess:         __ cmovl(dst, src);  break;
+  case kCondGreaterEqual: __ cmovge(dst, src); break;
+  case kCondGreater:      __ cmovg(dst, src);  break;
+  case kCondLessEqual:    __ cmovle(dst, src); break;
+  case kCondEqual:        __ cmove(dst, src);  break;
+  case kCondNotEqual:     __ cmovne(dst, src); break;
+  }
+}
+
+bool CGFunction::isSmallFixnum(const Handle &x, intptr_t *untagged) {
+  if (!x->isFixnum()) {
+    return false;
+  }
+  intptr_t v = x->as<intptr_t>() - RawObject::kFixnumTag;
+  *untagged = v;
+  return v == static_cast<int32_t>(v);
+}
+
+bool CGFunction::isImmediate(const Handle &x, intptr_t *imm) {
+  if (x->isHeapAllocated()) {
+    return false;
+  }
+  intptr_t v = x->as<intptr_t>();
+  *imm = v;
+  return v == static_cast<int32_t>(v);
 }
 
-intptr_t CGFunction::getFrameDescr() {
+intptr_t CGFunction::getThisClosure() {
   return (frameSize - 1) * kPtrSize;
 }
 
-void CGFunction::recordReloc(const Handle &e) {
-  Util::arrayAppend(relocArray, e);
+intptr_t CGFunction::getArgSlot(intptr_t i) {
+  return (frameSize - 2 - i) * kPtrSize;
 }
 
-void CGFunction::recordLastPtrOffset() {
-  intptr_t size = __ lastImmOffset().size,
-           offset = __ lastImmOffset().offset;
-  assert(size == 8);
-  Util::arrayAppend(ptrOffsets,
-      Object::newFixnum(offset - RawObject::kFuncCodeOffset));
+intptr_t CGFunction::constPoolSlotOf(const Handle &x) {
+  intptr_t len = Util::arrayLength(constPool);
+  for (intptr_t i = 0; i < len; ++i) {
+    if (Util::arrayAt(constPool, i) == x) {
+      return i;
+    }
+  }
+  Util::arrayAppend(constPool, x);
+  return len;
 }
 
 void CGFunction::pushObject(const Handle &x) {
-  if (x->isHeapAllocated()) {
-    // To be patched later. See @Invariant
-    __ mov(rax, 0L);
-    recordReloc(x);
-    recordLastPtrOffset();
+  const GpReg &r = nextTempReg(rax);
+  movObject(r, x);
+  pushTemp(r);
+}
+
+void CGFunction::movObject(const GpReg &r, const Handle &x) {
+  if (x->isHeapAllocated() && !ThreadState::global().isImmortal(x)) {
+    // RIP-relative, from the pool that is filled in once the code is
+    // made. @See compileFunction
+    __ mov(r, qword_ptr(labelConstPool,
+                        kPtrSize * constPoolSlotOf(x)));
   }
   else {
-    __ mov(rax, x->as<intptr_t>());
+    __ mov(r, x->as<intptr_t>());
   }
-  __ push(rax);
-  pushVirtual(kIsPtr);
 }
 
 void CGFunction::pushInt(intptr_t i) {
@@ -850,11 +1604,6 @@ void CGFunction::popPhysicalFrame() {
   __ add(rsp, kPtrSize * frameSize);
 }
 
-void CGFunction::popReg(const GpReg &r) {
-  __ pop(r);
-  popVirtual(1);
-}
-
 void CGFunction::popVirtual(intptr_t n) {
   shiftLocal(-n);
   for (intptr_t i = 0; i < n; ++i) {
@@ -864,42 +1613,173 @@ void CGFunction::popVirtual(intptr_t n) {
   //dprintf(2, "[popV] -= %ld, frameSize = %ld\n", n, frameSize);
 }
 
-intptr_t CGFunction::makeFrameDescr() {
-  FrameDescr fd;
-  // Current max fd size.
-  assert(frameSize <= 48);
-  fd.frameSize = frameSize;
+const GpReg &CGFunction::nextTempReg(const GpReg &orElse) {
+  return isTempInReg(numTemps) ? kTempRegs[numTemps] : orElse;
+}
+
+void CGFunction::pushTemp(const GpReg &r) {
+  intptr_t i = numTemps++;
+  if (!isTempInReg(i)) {
+    pushReg(r, kIsPtr);
+  }
+  else if (kTempRegs[i].getRegCode() != r.getRegCode()) {
+    __ mov(kTempRegs[i], r);
+  }
+}
+
+void CGFunction::pushTempVirtual() {
+  if (!isTempInReg(numTemps++)) {
+    pushVirtual(kIsPtr);
+  }
+}
+
+const GpReg &CGFunction::popToReg(const GpReg &orElse) {
+  intptr_t i = --numTemps;
+  assert(i >= 0);
+  if (isTempInReg(i)) {
+    return kTempRegs[i];
+  }
+  __ pop(orElse);
+  popVirtual(1);
+  return orElse;
+}
+
+void CGFunction::popReg(const GpReg &r) {
+  const GpReg &src = popToReg(r);
+  if (src.getRegCode() != r.getRegCode()) {
+    __ mov(r, src);
+  }
+}
+
+void CGFunction::dropTemps(intptr_t n) {
+  intptr_t inStack = 0;
+  for (intptr_t i = 0; i < n; ++i) {
+    if (!isTempInReg(--numTemps)) {
+      ++inStack;
+    }
+  }
+  if (inStack) {
+    popSome(inStack);
+  }
+}
+
+void CGFunction::dropTempsVirtual(intptr_t n) {
+  intptr_t inStack = 0;
+  for (intptr_t i = 0; i < n; ++i) {
+    if (!isTempInReg(--numTemps)) {
+      ++inStack;
+    }
+  }
+  popVirtual(inStack);
+}
+
+intptr_t CGFunction::spillTemps() {
+  intptr_t n = numTemps < kNumTempRegs ? numTemps : kNumTempRegs;
+  for (intptr_t i = 0; i < n; ++i) {
+    pushReg(kTempRegs[i], kIsPtr);
+  }
+  return n;
+}
+
+void CGFunction::reloadTemps(intptr_t n) {
+  for (intptr_t i = n - 1; i >= 0; --i) {
+    __ pop(kTempRegs[i]);
+    popVirtual(1);
+  }
+}
+
+bool CGFunction::isTempInReg(intptr_t i) {
+  return i < kNumTempRegs;
+}
+
+intptr_t CGFunction::lookupArgReg(const Handle &name) {
+  for (intptr_t i = 0, len = Util::arrayLength(argArray); i < len; ++i) {
+    if (Util::arrayAt(argArray, i) == name) {
+      return (argRegsValid & (1 << i)) ? i : -1;
+    }
+  }
+  return -1;
+}
+
+void CGFunction::invalidateArgReg(const Handle &name) {
+  for (intptr_t i = 0, len = Util::arrayLength(argArray); i < len; ++i) {
+    if (Util::arrayAt(argArray, i) == name) {
+      argRegsValid &= ~(1 << i);
+    }
+  }
+}
+
+void CGFunction::reloadArgRegs() {
+  for (intptr_t i = 0, len = Util::arrayLength(argArray); i < len; ++i) {
+    if (argRegsValid & (1 << i)) {
+      intptr_t ix = lookupLocal(Util::arrayAt(argArray, i));
+      __ mov(kArgRegs[i], qword_ptr(rsp, ix * kPtrSize));
+    }
+  }
+}
+
+const StackMap *CGFunction::makeStackMap() {
+  StackMap map(frameSize);
   Handle stackIter = stackItemList;
   for (intptr_t i = 0; i < frameSize; ++i) {
     assert(stackIter->isPair());
     if (stackIter->raw()->car()->isTrue()) {
-      //dprintf(2, "[mkFd %s] %ld is ptr\n", name->rawSymbol(), i);
-      fd.setIsPtr(i);
-    }
-    else {
-      //dprintf(2, "[mkFd %s] %ld is not ptr\n", name->rawSymbol(), i);
-      assert(!fd.isPtr(i));
+      map.setIsPtr(i);
     }
     stackIter = stackIter->raw()->cdr();
   }
-  //dprintf(2, "[mkFd %s] fd = %ld\n", name->rawSymbol(), fd.pack());
-  return fd.pack();
+  return StackMap::intern(map);
+}
+
+void CGFunction::recordStackMap(intptr_t offset, const StackMap *map) {
+  stackMapSites.push_back(std::make_pair(offset, map));
+}
+
+void CGFunction::callRuntime(void *func) {
+  __ mov(rax, reinterpret_cast<intptr_t>(func));
+  __ call(reinterpret_cast<void *>(&Scheme_callRuntime));
+}
+
+void CGFunction::emitWriteBarrier(const GpReg &obj, intptr_t tag) {
+  static const GpReg *savedRegs[] = {
+    &rax, &rcx, &rdx, &rsi, &rdi, &r8, &r9, &r10
+  };
+  const intptr_t numSavedRegs = sizeof(savedRegs) / sizeof(*savedRegs);
+  auto labelDone = __ newLabel();
+
+  __ test(dword_ptr(obj, -tag - static_cast<intptr_t>(sizeof(GcHeader))),
+          1 << GcHeader::kRemembered);
+  __ jnz(labelDone);
+
+  // The runtime neither allocates nor walks the stack: the pushes need
+  // no stack map.
+  for (intptr_t i = 0; i < numSavedRegs; ++i) {
+    __ push(*savedRegs[i]);
+  }
+  __ mov(rdi, obj);
+  __ mov(rsi, kThreadState);
+  callRuntime(reinterpret_cast<void *>(&Runtime::rememberObject));
+  for (intptr_t i = numSavedRegs - 1; i >= 0; --i) {
+    __ pop(*savedRegs[i]);
+  }
+  __ bind(labelDone);
 }
 
-void CGFunction::syncThreadState(FrameDescr *fdToUse) {
+void CGFunction::syncThreadState(const StackMap *mapToUse) {
   // Store gc info
   __ mov(
-      qword_ptr(kThreadState, kPtrSize * ThreadState::kHeapPtrOffset),
-      kHeapPtr);
+      qword_ptr(kThreadState, kPtrSize * ThreadState::kPairPtrOffset),
+      kPairPtr);
   __ mov(
-      qword_ptr(kThreadState, kPtrSize * ThreadState::kHeapLimitOffset),
-      kHeapLimit);
+      qword_ptr(kThreadState, kPtrSize * ThreadState::kPairLimitOffset),
+      kPairLimit);
 
-  // Store frame descr
-  __ mov(rax, fdToUse ? fdToUse->pack() : makeFrameDescr());
+  // Store stack map
+  __ mov(rax, reinterpret_cast<intptr_t>(mapToUse ? mapToUse
+                                                  : makeStackMap()));
   __ mov(
       qword_ptr(kThreadState,
-        kPtrSize * ThreadState::kLastFrameDescrOffset),
+        kPtrSize * ThreadState::kLastStackMapOffset),
       rax);
 
   // And stack ptr
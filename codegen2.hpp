@@ -10,6 +10,29 @@
 #include "object.hpp"
 #include "util.hpp"
 
+// Calling convention, shared with IRGen. @See CODEGEN_NOTES.md
+static const int kPtrSize = sizeof(void *);
+static const AsmJit::GpReg kArgRegs[5] = {
+  AsmJit::rsi, AsmJit::rdx, AsmJit::rcx, AsmJit::r8, AsmJit::r9
+};
+static const AsmJit::GpReg kArgRegsWithClosure[6] = {
+  AsmJit::rdi, AsmJit::rsi, AsmJit::rdx, AsmJit::rcx, AsmJit::r8, AsmJit::r9
+};
+static const auto kClosureReg    = AsmJit::rdi,
+                  kScratchReg    = AsmJit::r11,
+                  kPairPtr       = AsmJit::r12,
+                  kPairLimit     = AsmJit::r13,
+                  kThreadState   = AsmJit::r14;
+
+// Prologues read this far below %rsp. Less than the guard, so that they
+// can't skip over it. @See ThreadState::kStackGuardSize
+static const int kStackProbeDistance = 16 * 1024;
+
+extern "C" {
+  // @See asmentry.s
+  extern void Scheme_callRuntime();
+}
+
 // Runtime representation of module, referenced by generated functions
 class Module {
  public:
@@ -49,6 +72,21 @@ class CGFunction;
   V(car, Pair, Car)              \
   V(cdr, Pair, Cdr)
 
+// What a compare leaves in the flags for the predicate to be true.
+enum CondCode {
+  kCondLess,
+  kCondGreaterEqual,
+  kCondGreater,
+  kCondLessEqual,
+  kCondEqual,
+  kCondNotEqual
+};
+
+inline CondCode negateCond(CondCode cond) {
+  // Pairs of opposites
+  return static_cast<CondCode>(cond ^ 1);
+}
+
 class CGModule {
  public:
   CGModule();
@@ -59,6 +97,19 @@ class CGModule {
   // Returns -1 when not found
   intptr_t lookupGlobal(const Handle &name);
 
+  // Immutable globals: (define)d once and never (set!).
+  void findMutatedGlobals(const Handle &expr);
+  void markMutated(const Handle &name);
+  // Returns NULL if the global might be reassigned.
+  CGFunction *lookupKnownFunction(const Handle &name);
+
+  // A function for f's closure to start with, whose code compiles f on
+  // its first call. @See Runtime::compileOnFirstCall
+  RawObject *makeLazyFunction(CGFunction *f);
+  // The code that the lazy functions of the arity jump to. Made once
+  // for each arity.
+  void *makeLazyStub(intptr_t arity);
+
  private:
   Module module;
   Handle moduleRoot, moduleGlobalVector;
@@ -69,12 +120,22 @@ class CGModule {
          symQuote,
          symBegin,
          symIf,
+         symLet,
 
          symPrimAdd,
          symPrimSub,
          symPrimLt,
 
          symPrimCons,
+         symPrimMakeVector,
+         symPrimVector,
+         symPrimVectorRef,
+         symPrimVectorSet,
+         symPrimVectorLength,
+
+         symPrimMakeClosure,
+         symPrimClosureRef,
+         symPrimThisClosure,
 
          symPrimTrace,
          symPrimDisplay,
@@ -93,14 +154,33 @@ PRIM_SINGLETON_PREDICATES(MK_SYM)
 PRIM_ATTR_ACCESSORS(MK_SYM)
 #undef MK_SYM
 
+  // Assoc list of globals that are assigned somewhere
+  Handle mutatedGlobals;
+
   std::vector<CGFunction *> cgfuncs;
+  // Indexed by global index
+  std::vector<CGFunction *> globalFuncs;
+
+  // Indexed by arity. @See makeLazyStub
+  void *lazyStubs[6];
 
   friend class CGFunction;
+  friend class ClosureConversion;
+  friend class Inliner;
+  friend class TagInference;
+  friend class IRBuilder;
+  friend class IRGen;
 };
 
 class CGFunction {
+ public:
+  // Compiles us if we are not yet, and points the direct calls that the
+  // compiled functions make to us at our code.
+  RawObject *compileOnFirstCall();
+
  protected:
-  CGFunction(const Handle &name, const Handle &lamBody, CGModule *parent);
+  CGFunction(const Handle &name, const Handle &lamBody, CGModule *parent,
+             intptr_t numPayload);
 
   const Handle &makeClosure();
 
@@ -114,6 +194,15 @@ class CGFunction {
   void compileBody(const Handle &exprs, intptr_t start, bool isTail);
   void compileExpr(const Handle &expr, bool isTail = false);
   void compileCall(const Handle &xs, bool isTail);
+  void compileDirectCall(CGFunction *callee, const Handle &xs, bool isTail);
+  // Jumps back to the loop header instead of going through the prologue.
+  void compileSelfTailCall(const Handle &xs);
+  // Returns NULL if func is not a known global function.
+  CGFunction *lookupKnownCallee(const Handle &func);
+  // Fills in the targets of direct calls: the code of their callee's
+  // closure, which is its lazy function until it is compiled. Only the
+  // calls to onlyTo if given.
+  void patchDirectCalls(CGFunction *onlyTo = NULL);
 
   enum LookupResult {
     kIsLocal,
@@ -127,25 +216,79 @@ class CGFunction {
   bool tryIf(const Handle &expr, bool isTail);
   bool tryQuote(const Handle &expr);
   bool tryBegin(const Handle &expr, bool isTail);
+  // (let# ((name expr) ...) body ...), emitted by the inliner.
+  bool tryLet(const Handle &expr, bool isTail);
   bool tryPrimOp(const Handle &expr, bool isTail);
+  // Emits the compare for <# and the predicates, to be used by a jcc or
+  // a cmov. Returns false if xs is not one of them.
+  bool tryCompare(const Handle &xs, CondCode *cond);
+  void jumpIf(CondCode cond, const AsmJit::Label &label);
+  void cmovIf(CondCode cond, const AsmJit::GpReg &dst,
+              const AsmJit::GpReg &src);
 
   // Stores regs back to ThreadState. Uses %rax only.
-  void syncThreadState(FrameDescr *fdToUse = NULL);
+  void syncThreadState(const StackMap *mapToUse = NULL);
 
-  intptr_t getThisClosure();
-  intptr_t getFrameDescr();
+  // True if x is a fixnum whose untagged value fits in an imm32.
+  bool isSmallFixnum(const Handle &x, intptr_t *untagged);
+  // True if x is not heap allocated and fits in an imm32 as it is.
+  bool isImmediate(const Handle &x, intptr_t *imm);
 
-  void recordReloc(const Handle &e);
-  void recordLastPtrOffset();
-  intptr_t makeFrameDescr();
+  intptr_t getThisClosure();
+  intptr_t getArgSlot(intptr_t i);
+
+  // Where x is in the constant pool, adding it if it is not yet.
+  intptr_t constPoolSlotOf(const Handle &x);
+  const StackMap *makeStackMap();
+  // Makes map the one at offset in our code: the return address of a
+  // call, or a stack probe.
+  void recordStackMap(intptr_t offset, const StackMap *map);
+  // Calls a runtime function on the C stack. Clobbers %rax and %r11,
+  // and the caller-saved registers as any C call.
+  void callRuntime(void *func);
+  // Remembers obj for the minor gc after a pointer is stored into it.
+  // Only calls the runtime the first time, and saves every register
+  // but %r11 around that. obj is tagged with tag.
+  void emitWriteBarrier(const AsmJit::GpReg &obj, intptr_t tag);
 
   // Alloc related
 
   // Assume car and cdr are pushed
   void allocPair();
-
-  // Also records virtual frame
+  // Bumps heapPtr by size bytes, header included, or by %rax if size is
+  // 0, and leaves the object's header in %r11 and its size in %rax. Large
+  // objects and a full nursery go through Runtime::allocObject, with the
+  // temps visible to the gc. The caller fills in the payload before
+  // anything else can allocate. Clobbers %rdi and %rsi.
+  void allocObject(intptr_t size, intptr_t tag);
+
+  // Operand stack. The first few temps live in registers and the rest
+  // on the stack. @See CODEGEN_NOTES.md
   void pushObject(const Handle &);
+  void movObject(const AsmJit::GpReg &r, const Handle &);
+  void pushTemp(const AsmJit::GpReg &r);
+  void pushTempVirtual();
+  // Where the next temp will be. Returns orElse if it's not in a register.
+  const AsmJit::GpReg &nextTempReg(const AsmJit::GpReg &orElse);
+  // Pops the top temp and returns the register that holds it, using
+  // orElse if the temp is on the stack.
+  const AsmJit::GpReg &popToReg(const AsmJit::GpReg &orElse);
+  void popReg(const AsmJit::GpReg &r);
+  void dropTemps(intptr_t n);
+  void dropTempsVirtual(intptr_t n);
+  bool isTempInReg(intptr_t i);
+  // Push temps in registers to the stack so that they survive a call
+  // and are visible to the gc. Returns the number of spilled temps.
+  intptr_t spillTemps();
+  void reloadTemps(intptr_t n);
+
+  // Returns -1 if name is not an argument or its register is clobbered.
+  intptr_t lookupArgReg(const Handle &name);
+  void invalidateArgReg(const Handle &name);
+  // Used after a gc to refresh the arguments that are still valid.
+  void reloadArgRegs();
+
+  // Machine stack. Also records virtual frame
   void pushInt(intptr_t);
   enum IsPtr { kIsNotPtr = 0, kIsPtr = 1 };
   void pushReg(const AsmJit::GpReg &r, IsPtr isPtr);
@@ -155,7 +298,6 @@ class CGFunction {
   void popFrame();
   // But don't pop virtual. Used by tailcall.
   void popPhysicalFrame();
-  void popReg(const AsmJit::GpReg &r);
 
   intptr_t lookupName(const Handle &name, LookupResult *);
   intptr_t lookupLocal(const Handle &name) {
@@ -183,26 +325,72 @@ class CGFunction {
   // in ptrSize (8).
   intptr_t frameSize;
 
+  // Number of values on the operand stack.
+  intptr_t numTemps;
+
+  // Bit i is set if kArgRegs[i] still holds the i-th argument.
+  intptr_t argRegsValid;
+
   Handle name, lamBody;
   CGModule *parent;
+  intptr_t arity;
+  // Of its closures, which (make-closure# ...) fills in.
+  // @See ClosureConversion
+  intptr_t numPayload;
+
+  // Bound right after the prologue, where frameSize is loopFrameSize.
+  AsmJit::Label labelLoopHeader;
+  intptr_t loopFrameSize;
+  // After the code and the stubs, on pages of their own if there are
+  // constants. @See constPoolSlotOf
+  AsmJit::Label labelConstPool;
 
   RawObject *rawFunc;
+  // Where the pages of the pool start in rawFunc, or its end if it has
+  // no pool. The pages before are code: read-execute once made.
+  // @See patchDirectCalls
+  intptr_t codeEnd;
   Handle closure;
   // Maps symbol to index
   Handle locals;
 
+  // Growable array of argument names
+  Handle argArray;
+
   // (# #t #f #t ...) vector of stack items. 
   // True if is pointer
   Handle stackItemList;
 
-  // Growable array of #<Fixnum const-offset>
-  Handle ptrOffsets;
+  // Growable array of the objects that the code loads from its constant
+  // pool, which is at labelConstPool.
+  Handle constPool;
+
+  // Call sites that jump to another function's code directly.
+  struct DirectCall {
+    CGFunction *callee;
+    // Jumps to the callee. Used when the callee is not within rel32.
+    AsmJit::Label stub;
+    // Offsets of the call's rel32, the stub and the stub's imm64 in our
+    // code.
+    intptr_t relOffset;
+    intptr_t stubOffset;
+    intptr_t stubImmOffset;
+  };
+  std::vector<DirectCall> directCalls;
+  // Compiled functions whose direct calls to us still go to our lazy
+  // function. @See compileOnFirstCall
+  std::vector<CGFunction *> lazyCallers;
 
-  // Growable array of objects. Will be used to patch the generated
-  // code.
-  Handle relocArray;
+  // Offsets in our code and their stack maps. Recorded by their
+  // absolute address once the code is made.
+  std::vector<std::pair<intptr_t, const StackMap *> > stackMapSites;
 
   friend class CGModule;
+  friend class Inliner;
+  friend class TagInference;
+  friend class IRFunction;
+  friend class IRBuilder;
+  friend class IRGen;
 };
 
 #endif
@@ -1,5 +1,13 @@
+#include <sys/mman.h>
+#include <time.h>
+
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+
 #include "gc.hpp"
 #include "object.hpp"
+#include "pargc.hpp"
 #include "util.hpp"
 #include "runtime.hpp"
 
@@ -8,29 +16,81 @@
 
 ThreadState *ThreadState::global_ = NULL;
 
+// Pages are only committed when touched.
+static intptr_t mapHeapSpace(intptr_t size) {
+  void *space = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (space == MAP_FAILED) {
+    perror("mapHeapSpace: mmap");
+    exit(1);
+  }
+  return reinterpret_cast<intptr_t>(space);
+}
+
+static void unmapHeapSpace(intptr_t space, intptr_t size) {
+  munmap(reinterpret_cast<void *>(space), size);
+}
+
+// With the forwarding words after the pairs: @See
+// ThreadState::pairForwardOf
+static intptr_t pairSpaceSize(intptr_t size) {
+  return size + size / 2;
+}
+
+static_assert(static_cast<intptr_t>(ThreadState::kPairSize) ==
+                  RawObject::kSizeOfPair,
+              "pairs are allocated without RawObject");
+
 ThreadState *ThreadState::create() {
   void *raw = malloc(kLastOffset * sizeof(void *));
   ThreadState *ts = reinterpret_cast<ThreadState *>(raw);
 
   // Mocking compiled code info
-  ts->lastFrameDescr() = FrameDescr();
+  ts->lastStackMap()   = NULL;
   ts->firstStackPtr()  = 0;
   ts->lastStackPtr()   = 0;
-
-  // Init gc
-  ts->heapSize()      = 256 * KB;
+  ts->stackBarrier()   = 0;
+
+  // Scheme stack. It starts small and grows at the stack probes, which
+  // are not there without the stack check.
+  ts->mapStack(Option::global().kInsertStackCheck ?
+      std::min<intptr_t>(kInitialStackSize, Option::global().kStackSize) :
+      Option::global().kStackSize);
+  ts->cStackPtr() = 0;
+
+  // Init gc. The semispaces are reserved at their max size, and
+  // heapSize is how much of them is used.
+  ts->heapMaxSize()   = Option::global().kHeapSize;
+  ts->heapSize()      = std::min<intptr_t>(kInitialHeapSize,
+                                           ts->heapMaxSize());
 #ifndef kSanyaGCDebug
-  ts->heapBase()      = (intptr_t) malloc(ts->heapSize() * 2);
-  ts->heapPtr()       = ts->heapBase();
-  ts->heapLimit()     = ts->heapBase() + ts->heapSize();
+  ts->heapBase()      = mapHeapSpace(ts->heapMaxSize() * 2);
   ts->heapFromSpace() = ts->heapBase();
-  ts->heapToSpace()   = ts->heapBase() + ts->heapSize();
+  ts->heapToSpace()   = ts->heapBase() + ts->heapMaxSize();
+  ts->pairFromSpace() = mapHeapSpace(pairSpaceSize(ts->heapMaxSize()) * 2);
+  ts->pairToSpace()   = ts->pairFromSpace() +
+                        pairSpaceSize(ts->heapMaxSize());
 #else
-  ts->heapBase()      = (intptr_t) malloc(ts->heapSize());
-  ts->heapPtr()       = ts->heapBase();
-  ts->heapLimit()     = ts->heapBase() + ts->heapSize();
+  ts->heapBase()      = mapHeapSpace(ts->heapMaxSize());
   ts->heapFromSpace() = ts->heapBase();
+  ts->pairFromSpace() = mapHeapSpace(pairSpaceSize(ts->heapMaxSize()));
 #endif
+  ts->heapCopyPtr()   = ts->heapFromSpace();
+  ts->pairCopyPtr()   = ts->pairFromSpace();
+  ts->nurserySize()   = kDefaultNurserySize;
+  ts->nurseryBase()   = (intptr_t) malloc(ts->nurserySize());
+  ts->pairNurserySize() = kDefaultNurserySize;
+  ts->pairNurseryBase() = (intptr_t) calloc(
+      1, pairSpaceSize(ts->pairNurserySize()));
+  ts->pairPtr()       = ts->pairNurseryBase();
+  ts->resetNursery();
+  ts->rememberedSet() = new RememberedSet();
+  ts->gcIsMinor()     = false;
+  ts->errorJmpBuf()   = NULL;
+  ts->incrementalGc() = new IncrementalGc();
+  ts->largeObjects()  = new LargeObjectSpace();
+  ts->immortalBase()  = mapHeapSpace(kImmortalSpaceSize);
+  ts->immortalPtr()   = ts->immortalBase();
 
   // Create linkedlist head
   ts->handleHead() = reinterpret_cast<Handle *>(malloc(sizeof(Handle)));
@@ -52,51 +112,240 @@ void ThreadState::initGlobalState() {
 void *ThreadState::initGcHeader(intptr_t raw, size_t size) {
   GcHeader *h = reinterpret_cast<GcHeader *>(raw);
   h->mark = 0;
-  h->setMarkAt<GcHeader::kCopied, false>();
   h->size = size;
-  h->copiedTo = NULL;
   return reinterpret_cast<void *>(h->toRawObject());
 }
 
+void ThreadState::mapStack(intptr_t size) {
+  // Guard below. Pages are only committed when touched.
+  stackSize() = kStackGuardSize + Util::align<12>(size);
+  void *stack = mmap(NULL, stackSize(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    perror("ThreadState::mapStack: mmap");
+    exit(1);
+  }
+  stackBase() = reinterpret_cast<intptr_t>(stack);
+  mprotect(stack, kStackGuardSize, PROT_NONE);
+}
+
+bool ThreadState::growStack(intptr_t *stackPtr) {
+  intptr_t oldBase = stackBase(),
+           oldSize = stackSize(),
+           maxSize = Option::global().kStackSize,
+           size = oldSize - kStackGuardSize;
+  if (size >= maxSize) {
+    return false;
+  }
+
+  // Frames hold no pointers into the stack, so they can be moved as
+  // they are. Only %rsp needs to follow.
+  intptr_t used = firstStackPtr() - *stackPtr;
+  mapStack(std::min(size * 2, maxSize));
+  intptr_t newStackPtr = stackTop() - used;
+  memcpy(reinterpret_cast<void *>(newStackPtr),
+         reinterpret_cast<void *>(*stackPtr), used);
+  munmap(reinterpret_cast<void *>(oldBase), oldSize);
+
+  if (Option::global().kLogInfo) {
+    dprintf(2, "[growStack] %ld -> %ld\n", size,
+            stackSize() - kStackGuardSize);
+  }
+
+  firstStackPtr() = stackTop();
+  if (stackBarrier()) {
+    stackBarrier() += newStackPtr - *stackPtr;
+  }
+  *stackPtr = newStackPtr;
+  return true;
+}
+
+void ThreadState::gcResetStackBarrier() {
+  if (stackBarrier()) {
+    *reinterpret_cast<intptr_t *>(stackBarrier()) = stackBarrierRetAddr();
+    stackBarrier() = 0;
+  }
+  if (lastStackPtr() != firstStackPtr()) {
+    gcSetStackBarrier(lastStackPtr() +
+                      lastStackMap()->frameSize() * sizeof(void *));
+  }
+}
+
+void ThreadState::gcSetStackBarrier(intptr_t slot) {
+  intptr_t *retAddr = reinterpret_cast<intptr_t *>(slot);
+  stackBarrierRetAddr() = *retAddr;
+  *retAddr = reinterpret_cast<intptr_t>(&Scheme_stackBarrier);
+  stackBarrier() = slot;
+}
+
+intptr_t ThreadState::gcMoveStackBarrier() {
+  intptr_t retAddr = stackBarrierRetAddr(),
+           stackPtr = stackBarrier() + sizeof(void *);
+  stackBarrier() = 0;
+  // Unless it returns to Scheme_asmEntry.
+  if (stackPtr != firstStackPtr()) {
+    const StackMap *map = StackMap::lookup(retAddr);
+    assert(map && "No stack map for the return");
+    gcSetStackBarrier(stackPtr + map->frameSize() * sizeof(void *));
+  }
+  return retAddr;
+}
+
+intptr_t Scheme_moveStackBarrier(ThreadState *ts) {
+  return ts->gcMoveStackBarrier();
+}
+
 void ThreadState::destroy() {
+  munmap(reinterpret_cast<void *>(stackBase()), stackSize());
   free(handleHead());
-  free(reinterpret_cast<void *>(heapBase()));
+#ifndef kSanyaGCDebug
+  unmapHeapSpace(heapBase(), heapMaxSize() * 2);
+  unmapHeapSpace(pairFromSpace(), pairSpaceSize(heapMaxSize()) * 2);
+#else
+  unmapHeapSpace(heapBase(), heapMaxSize());
+  unmapHeapSpace(pairFromSpace(), pairSpaceSize(heapMaxSize()));
+#endif
+  free(reinterpret_cast<void *>(nurseryBase()));
+  free(reinterpret_cast<void *>(pairNurseryBase()));
+  delete rememberedSet();
+
+  IncrementalGc *incr = incrementalGc();
+  if (Option::global().kGcPauseBudget) {
+    dprintf(2, "[gc] %ld pauses, the longest %ld us, %ld over the "
+               "budget of %ld us\n",
+            incr->numPauses, incr->maxPause, incr->numOverBudget,
+            Option::global().kGcPauseBudget);
+    if (incr->maxPause >
+        IncrementalGc::kMaxPauseFactor * Option::global().kGcPauseBudget) {
+      dprintf(2, "[gc] the longest pause is over %ld times the budget\n",
+              IncrementalGc::kMaxPauseFactor);
+    }
+  }
+  delete incr;
+
+  for (GcHeader *h : largeObjects()->objects) {
+    unmapHeapSpace(reinterpret_cast<intptr_t>(h), Util::align<12>(h->size));
+  }
+  delete largeObjects();
+  unmapHeapSpace(immortalBase(), kImmortalSpaceSize);
   free(this);
 }
 
 void ThreadState::display(int fd) {
-  dprintf(fd, "[ThreadState] Hp = %ld, HpLim = %ld\n",
-          heapPtr(), heapLimit());
+  dprintf(fd, "[ThreadState] Hp = %ld, HpLim = %ld, PairPtr = %ld, "
+              "PairLim = %ld\n",
+          heapPtr(), heapLimit(), pairPtr(), pairLimit());
 }
 
 void *ThreadState::gcAllocSlow(size_t size) {
   heapPtr() -= size;
   lastAllocReq() = size;
   gcCollect();
+  gcEnsureRoom(heapLimit() - heapPtr());
 
   intptr_t raw = heapPtr();
   heapPtr() += size;
   return initGcHeader(raw, size);
 }
 
+void *ThreadState::gcAllocPairSlow() {
+  pairPtr() -= kPairSize;
+  lastAllocReq() = kPairSize;
+  gcCollect();
+  gcEnsureRoom(pairLimit() - pairPtr());
+
+  intptr_t raw = pairPtr();
+  pairPtr() += kPairSize;
+  return reinterpret_cast<void *>(raw);
+}
+
+void *ThreadState::gcAllocImmortal(size_t size) {
+  assert(Util::isAligned<3>(size));
+  size += sizeof(GcHeader);
+  if (immortalPtr() + static_cast<intptr_t>(size) >
+      immortalBase() + kImmortalSpaceSize) {
+    dprintf(2, "gcAllocImmortal: out of space\n");
+    exit(1);
+  }
+  intptr_t raw = immortalPtr();
+  immortalPtr() += size;
+  return initGcHeader(raw, size);
+}
+
+void *ThreadState::gcAllocImmortalPair() {
+  if (immortalPtr() + kPairSize > immortalBase() + kImmortalSpaceSize) {
+    dprintf(2, "gcAllocImmortalPair: out of space\n");
+    exit(1);
+  }
+  intptr_t raw = immortalPtr();
+  immortalPtr() += kPairSize;
+  return reinterpret_cast<void *>(raw);
+}
+
+void *ThreadState::gcAllocLarge(size_t size) {
+  LargeObjectSpace *los = largeObjects();
+  size += sizeof(GcHeader);
+  intptr_t mapSize = Util::align<12>(size);
+
+  // A major gc once as much as the old space holds has been allocated
+  // here, as it is the only one that frees large objects.
+  if (los->allocated + mapSize > heapSize() ||
+      los->size + mapSize > heapMaxSize()) {
+    lastAllocReq() = mapSize;
+    los->isMajorDue = true;
+    gcCollect();
+    gcEnsureRoom(heapMaxSize() - los->size);
+  }
+
+  GcHeader *h = reinterpret_cast<GcHeader *>(mapHeapSpace(mapSize));
+  h->mark = 1U << GcHeader::kLarge;
+  h->size = size;
+  los->objects.push_back(h);
+  los->size += mapSize;
+  los->allocated += mapSize;
+  return h->toRawObject();
+}
+
+void ThreadState::gcEnsureRoom(intptr_t room) {
+  if (room < static_cast<intptr_t>(lastAllocReq())) {
+    Runtime::handleHeapOvf(this);
+  }
+}
+
 // XXX: tags
 void ThreadState::gcScavenge(Object **loc) {
   Object *ptr = *loc;
 
-  if (!ptr || !ptr->isHeapAllocated()) {
+  if (!ptr || !ptr->isHeapAllocated() || isImmortal(ptr)) {
+    return;
+  }
+  if (GcWorker *worker = GcWorker::current()) {
+    // Called back by Object::gcScavenge in a parallel gc.
+    worker->scavenge(loc);
+    return;
+  }
+  if (ptr->isPair()) {
+    gcScavengePair(loc);
     return;
   }
   //dprintf(2, "[GcScav] [%p] %ld (%p)\n", loc, (intptr_t) ptr, ptr);
   RawObject::Tag ptrTag = ptr->getTag();
   GcHeader *h = GcHeader::fromRawObject(ptr->raw());
 
-  if (h->markAt<GcHeader::kCopied>()) {
-    // If is in from space and already copied: do redirection
-    *loc = h->copiedTo->toRawObject()->tagWith(ptrTag);
+  if (gcIsMinor() ? !isInNursery(h) : isInToSpace(h)) {
+    // If is old in a minor gc, or is in to space: do nothing. Old
+    // objects may have copies of an incremental gc, which the minor
+    // ones don't use.
     return;
   }
-  else if (isInToSpace(h)) {
-    // If is in to space: do nothing
+  else if (h->markAt<GcHeader::kLarge>()) {
+    // Stays where it is.
+    gcMarkLarge(ptr);
+    return;
+  }
+  else if (h->markAt<GcHeader::kCopied>()) {
+    // If is in from space and already copied: do redirection
+    *loc = h->copiedTo()->toRawObject()->tagWith(ptrTag);
     return;
   }
 
@@ -104,104 +353,598 @@ void ThreadState::gcScavenge(Object **loc) {
   //ptr->displayDetail(2);
   //dprintf(2, "\n");
 
-  h->setMarkAt<GcHeader::kCopied, true>();
-
   // Do copy
   GcHeader *newH = reinterpret_cast<GcHeader *>(heapCopyPtr());
   memcpy(newH, h, h->size);
   heapCopyPtr() += h->size;
 
-  // Redirect loc and interior ptrs.
+  // Redirect loc. The copy is old and has not been stored into yet. Its
+  // interior ptrs are left to gcScanCopies.
   newH->setMarkAt<GcHeader::kCopied, false>();
-  h->copiedTo = newH;
-  Object *newPtr = newH->toRawObject()->tagWith(ptrTag);
-  *loc = newPtr;
-  newPtr->gcScavenge(this);
+  newH->setMarkAt<GcHeader::kRemembered, false>();
+  newH->setCopiedTag(ptrTag);
+  h->setCopiedTo(newH);
+  *loc = newH->toRawObject()->tagWith(ptrTag);
+}
+
+void ThreadState::gcMarkLarge(Object *obj) {
+  GcHeader *h = GcHeader::fromRawObject(obj->raw());
+  h->setMarkAt<GcHeader::kMarked, true>();
+  largeObjects()->grey.push_back(obj);
+}
+
+void ThreadState::gcScavengeThrough(Object *obj) {
+  // Only vectors get that large.
+  RawObject *raw = obj->raw();
+  assert(obj->isVector());
+  for (intptr_t i = 0, len = raw->vectorSize(); i < len; ++i) {
+    Object *elem = raw->vectorAt(i);
+    gcScavenge(&elem);
+  }
+}
+
+void ThreadState::gcScavengePair(Object **loc) {
+  intptr_t pair = reinterpret_cast<intptr_t>((*loc)->raw());
+
+  if (gcIsMinor() ? !isPairInNursery(pair) : isPairInToSpace(pair)) {
+    // As for the other objects
+    return;
+  }
+
+  Object **forward = pairForwardOf(pair);
+  if (!*forward) {
+    RawObject *copy = RawObject::from(pairCopyPtr());
+    memcpy(copy, reinterpret_cast<void *>(pair), kPairSize);
+    pairCopyPtr() += kPairSize;
+    *forward = copy->tagAsPair();
+  }
+  *loc = *forward;
+}
+
+bool ThreadState::gcScanCopies(intptr_t *scanPtr, intptr_t *pairScanPtr,
+                               intptr_t deadline, intptr_t minBytes) {
+  LargeObjectSpace *los = largeObjects();
+  intptr_t numScanned = 0,
+           scanStart = *scanPtr + *pairScanPtr;
+  // Minor gcs never mark, and leave the slices' marks alone.
+  auto hasGrey = [&] { return !gcIsMinor() && !los->grey.empty(); };
+  while (*scanPtr < heapCopyPtr() || *pairScanPtr < pairCopyPtr() ||
+         hasGrey()) {
+    // Looks at the clock only now and then.
+    if (deadline && ++numScanned % 16 == 0 &&
+        *scanPtr + *pairScanPtr - scanStart >= minBytes &&
+        nowUs() >= deadline) {
+      return false;
+    }
+
+    if (hasGrey()) {
+      Object *obj = los->grey.back();
+      los->grey.pop_back();
+      if (incrementalGc()->isSlicing) {
+        // The Scheme code still uses it: only copies what it points to.
+        gcScavengeThrough(obj);
+        los->deferred.push_back(obj);
+      }
+      else {
+        obj->gcScavenge(this);
+      }
+      continue;
+    }
+
+    if (*pairScanPtr < pairCopyPtr()) {
+      RawObject *pair = RawObject::from(*pairScanPtr);
+      *pairScanPtr += kPairSize;
+      pair->tagAsPair()->gcScavenge(this);
+      continue;
+    }
+
+    GcHeader *h = reinterpret_cast<GcHeader *>(*scanPtr);
+    *scanPtr += h->size;
+
+    if (*scanPtr < heapCopyPtr()) {
+      // The next copy is scanned right after this one: start fetching
+      // the headers of what its first fields point to. These may not
+      // be pointers, but prefetches never fault.
+      auto next = reinterpret_cast<intptr_t *>(
+          reinterpret_cast<GcHeader *>(*scanPtr)->toRawObject());
+      __builtin_prefetch(reinterpret_cast<void *>(
+          (next[0] & ~7L) - sizeof(GcHeader)));
+      __builtin_prefetch(reinterpret_cast<void *>(
+          (next[1] & ~7L) - sizeof(GcHeader)));
+    }
+
+    auto tag = static_cast<RawObject::Tag>(h->copiedTag());
+    h->toRawObject()->tagWith(tag)->gcScavenge(this);
+  }
+  return true;
+}
+
+void ThreadState::gcScavengeRoots() {
+  // A minor gc looks for young objects, which the frames that did not
+  // run since the last gc can't point to.
+  forEachRoot([&](Object **loc) {
+    gcScavenge(loc);
+  }, gcIsMinor());
 }
 
 void ThreadState::gcCollect() {
   //dprintf(2, "[GC] Collect\n");
 
-  // Invariant: we are using simple semispace gc
+  IncrementalGc *incr = incrementalGc();
+  intptr_t budget = Option::global().kGcPauseBudget,
+           start = budget ? nowUs() : 0;
+
+  // Promotes everything in the nurseries if the old space can take
+  // full ones, and then makes room there for the next ones.
+  bool isMajor = false;
+  if (oldSpaceFree() >= nurseriesSize()) {
+    intptr_t used = heapSize() - oldSpaceFree();
+    gcCollectMinor();
+    intptr_t promoted = heapSize() - oldSpaceFree() - used;
+
+    if (budget) {
+      // Follows a rise at once, and a fall over a few minors.
+      incr->promotedRate = std::max(promoted,
+                                    (incr->promotedRate + promoted) / 2);
+      if (!incr->isActive && gcIsIncrementalDue(budget)) {
+        if (used + promoted <= incr->scanRate * budget) {
+          // One slice would do it all: without the walk of the roots
+          // at the start, which the flip does again.
+          gcCollectMajor();
+          isMajor = true;
+        }
+        else {
+          gcStartIncremental();
+        }
+      }
+    }
+    // Leaves a little of the budget for the end of the gc, as the slice
+    // only looks at the clock now and then.
+    if (incr->isActive &&
+        gcSlice(start + budget - budget / 16, promoted)) {
+      gcFinishIncremental();
+      isMajor = true;
+    }
+  }
+  if (!isMajor && (oldSpaceFree() < nurseriesSize() ||
+                   largeObjects()->isMajorDue)) {
+    // Even if the slices are not done: that is over the budget.
+    if (incr->isActive) {
+      gcFinishIncremental();
+    }
+    else {
+      gcCollectMajor();
+    }
+    isMajor = true;
+  }
+  if (isMajor) {
+    resizeOldSpace();
+  }
+  resetNursery();
+  gcResetStackBarrier();
+
+  intptr_t pause = 0;
+  if (budget) {
+    pause = nowUs() - start;
+    ++incr->numPauses;
+    incr->numOverBudget += pause > budget;
+    incr->maxPause = std::max(incr->maxPause, pause);
+  }
+
+  if (Option::global().kLogInfo) {
+    dprintf(2, "[gcCollect] %s (%ld/%ld)",
+                isMajor ? "major" :
+                    incr->isActive ? "minor+slice" : "minor",
+                heapSize() - oldSpaceFree(),
+                heapSize());
+    if (budget) {
+      dprintf(2, " %ld us", pause);
+    }
+    dprintf(2, "\n");
+  }
+}
+
+void ThreadState::gcCollectMinor() {
+  // Copies into the old space, after what is already there.
+  gcIsMinor() = true;
+  intptr_t scanPtr = heapCopyPtr(),
+           pairScanPtr = pairCopyPtr();
+
+  gcScavengeRoots();
+
+  // And the old objects that were stored into since the last gc.
+  for (Object *obj : *rememberedSet()) {
+    if (!obj->isPair()) {
+      GcHeader::fromRawObject(obj->raw())->
+          setMarkAt<GcHeader::kRemembered, false>();
+    }
+    obj->gcScavenge(this);
+    if (incrementalGc()->isActive) {
+      gcUpdateCopy(obj);
+    }
+  }
+  rememberedSet()->clear();
+  gcScanCopies(&scanPtr, &pairScanPtr);
+
+  gcIsMinor() = false;
+}
+
+void ThreadState::gcCollectMajor() {
+  bool isParallel = ParallelGc::global().shouldRun(this);
+
+  // Invariant: the old space is a simple semispace, and the nursery is
+  // copied along with it.
 #ifndef kSanyaGCDebug
   heapCopyPtr() = heapToSpace();
+  pairCopyPtr() = pairToSpace();
 #else
-  heapToSpace() = (intptr_t) malloc(heapSize());
+  heapToSpace() = mapHeapSpace(heapMaxSize());
   heapCopyPtr() = heapToSpace();
+  pairToSpace() = mapHeapSpace(pairSpaceSize(heapMaxSize()));
+  pairCopyPtr() = pairToSpace();
 #endif
 
-  // Scavenge C++ roots
-  for (Handle *iter = handleHead()->next;
-       iter != handleHead(); iter = iter->next) {
-    gcScavenge(&iter->ptr);
+  if (isParallel) {
+    std::vector<Object **> roots;
+    forEachRoot([&](Object **loc) {
+      roots.push_back(loc);
+    });
+    ParallelGc::global().run(this, roots);
+  }
+  else {
+    intptr_t scanPtr = heapToSpace(),
+             pairScanPtr = pairToSpace();
+    gcScavengeRoots();
+    gcScanCopies(&scanPtr, &pairScanPtr);
   }
 
-  gcScavengeSchemeStack();
+  gcFlip();
+}
 
-  // Scavenge symbol intern table
-  gcScavenge(&symbolInternTable());
+void ThreadState::gcFlip() {
+  // Every old object is a copy now, with no young objects to point to.
+  // The large ones are not, but they were scanned in place.
+  rememberedSet()->clear();
+  gcSweepLarge();
 
 #ifndef kSanyaGCDebug
   intptr_t tmpSpace = heapFromSpace();
   heapFromSpace()   = heapToSpace();
   heapToSpace()     = tmpSpace;
+
+  // The pairs of the next to-space are garbage, and so are the copies
+  // that their forwarding words point to.
+  tmpSpace        = pairFromSpace();
+  pairFromSpace() = pairToSpace();
+  pairToSpace()   = tmpSpace;
+  madvise(reinterpret_cast<void *>(pairToSpace() + heapMaxSize()),
+          heapMaxSize() / 2, MADV_DONTNEED);
 #else
-  free((void *) heapBase());
+  unmapHeapSpace(heapBase(), heapMaxSize());
   heapBase() = heapFromSpace() = heapToSpace();
+  unmapHeapSpace(pairFromSpace(), pairSpaceSize(heapMaxSize()));
+  pairFromSpace() = pairToSpace();
 #endif
-  heapPtr()         = heapCopyPtr();
-  heapLimit()       = heapFromSpace() + heapSize();
+}
+
+void ThreadState::gcSweepLarge() {
+  LargeObjectSpace *los = largeObjects();
+  intptr_t numFreed = 0;
+
+  auto live = los->objects.begin();
+  for (GcHeader *h : los->objects) {
+    if (h->markAt<GcHeader::kMarked>()) {
+      h->setMarkAt<GcHeader::kMarked, false>();
+      *live++ = h;
+    }
+    else {
+      intptr_t size = Util::align<12>(h->size);
+      unmapHeapSpace(reinterpret_cast<intptr_t>(h), size);
+      los->size -= size;
+      ++numFreed;
+    }
+  }
+  los->objects.erase(live, los->objects.end());
+  los->allocated = 0;
+  los->isMajorDue = false;
+
+  if (Option::global().kLogInfo && numFreed) {
+    dprintf(2, "[gcSweepLarge] %ld freed, %ld left (%ld)\n",
+            numFreed, static_cast<intptr_t>(los->objects.size()), los->size);
+  }
+}
+
+intptr_t ThreadState::gcMinorsLeft() {
+  intptr_t room = oldSpaceFree() - nurseriesSize();
+  return std::max<intptr_t>(
+      1, room / std::max<intptr_t>(incrementalGc()->promotedRate, 1));
+}
+
+bool ThreadState::gcIsIncrementalDue(intptr_t budget) {
+  IncrementalGc *incr = incrementalGc();
+  if (!incr->promotedRate) {
+    // The old space is not filling up.
+    return false;
+  }
+  // Slices that scan what a budget allows, besides what the minors
+  // promote, and twice as many minors for the slack.
+  intptr_t live = heapSize() - oldSpaceFree(),
+           perSlice = std::max<intptr_t>(1, incr->scanRate * budget),
+           numSlices = live / perSlice + 1;
+  return gcMinorsLeft() <= 2 * numSlices;
+}
+
+void ThreadState::gcStartIncremental() {
+  IncrementalGc *incr = incrementalGc();
+  incr->toScan = heapSize() - oldSpaceFree();
+#ifdef kSanyaGCDebug
+  heapToSpace() = mapHeapSpace(heapMaxSize());
+  pairToSpace() = mapHeapSpace(pairSpaceSize(heapMaxSize()));
+#endif
+  incr->isActive = true;
+  incr->scanPtr = incr->copyPtr = heapToSpace();
+  incr->pairScanPtr = incr->pairCopyPtr = pairToSpace();
+  incr->promotedPtr = heapCopyPtr();
+  incr->pairPromotedPtr = pairCopyPtr();
+
+  gcSwapCopyPtrs();
+  incr->isSlicing = true;
+
+  // Only copies what the roots point to: they are updated at the flip.
+  forEachRoot([&](Object **loc) {
+    Object *ptr = *loc;
+    gcScavenge(&ptr);
+  });
+
+  incr->isSlicing = false;
+  gcSwapCopyPtrs();
+}
+
+void ThreadState::gcSwapCopyPtrs() {
+  IncrementalGc *incr = incrementalGc();
+  std::swap(heapCopyPtr(), incr->copyPtr);
+  std::swap(pairCopyPtr(), incr->pairCopyPtr);
+}
+
+bool ThreadState::gcSlice(intptr_t deadline, intptr_t promoted) {
+  IncrementalGc *incr = incrementalGc();
+  // Keeps pace with the minors, so that the cycle is done before they
+  // fill the old space and force the flip: what this one promoted, and
+  // what is left shared among the minors that are left.
+  incr->toScan += promoted;
+  intptr_t minBytes = promoted +
+                      (incr->toScan - promoted) / gcMinorsLeft();
+  gcSwapCopyPtrs();
+  incr->isSlicing = true;
+
+  // Where the minor gcs promote to, for now.
+  while (incr->promotedPtr < incr->copyPtr) {
+    GcHeader *h = reinterpret_cast<GcHeader *>(incr->promotedPtr);
+    incr->promotedPtr += h->objectSize();
+    if (!h->markAt<GcHeader::kCopied>()) {
+      auto tag = static_cast<RawObject::Tag>(h->copiedTag());
+      Object *ptr = h->toRawObject()->tagWith(tag);
+      gcScavenge(&ptr);
+    }
+  }
+  while (incr->pairPromotedPtr < incr->pairCopyPtr) {
+    Object *pair = RawObject::from(incr->pairPromotedPtr)->tagAsPair();
+    incr->pairPromotedPtr += kPairSize;
+    gcScavenge(&pair);
+  }
+  for (Object *copy : incr->rescan) {
+    copy->gcScavenge(this);
+  }
+  incr->rescan.clear();
+
+  intptr_t scanStart = incr->scanPtr + incr->pairScanPtr,
+           timeStart = nowUs();
+  bool isDone = gcScanCopies(&incr->scanPtr, &incr->pairScanPtr, deadline,
+                             minBytes);
+  intptr_t scanned = incr->scanPtr + incr->pairScanPtr - scanStart,
+           elapsed = nowUs() - timeStart;
+  if (elapsed > 0 && scanned > 0) {
+    incr->scanRate = std::max<intptr_t>(
+        1, (incr->scanRate + scanned / elapsed) / 2);
+  }
+
+  incr->isSlicing = false;
+  gcSwapCopyPtrs();
+
+  // Never less than what is copied and not scanned yet.
+  intptr_t unscanned = incr->copyPtr - incr->scanPtr +
+                       incr->pairCopyPtr - incr->pairScanPtr;
+  incr->toScan = std::max(incr->toScan - scanned, unscanned);
 
   if (Option::global().kLogInfo) {
-    dprintf(2, "[gcCollect] (%ld/%ld)\n",
-                heapSize() - (heapLimit() - heapPtr()),
-                heapSize());
+    dprintf(2, "[gcSlice] %ld copied, %ld to scan, %ld scanned of %ld "
+               "due in %ld us\n",
+            incr->copyPtr - heapToSpace() +
+                incr->pairCopyPtr - pairToSpace(),
+            unscanned, scanned, minBytes, elapsed);
   }
+  return isDone;
+}
 
-  if (heapLimit() - heapPtr() < (intptr_t) lastAllocReq()) {
-    dprintf(2, "gcCollect: heap exhausted by req %ld\n", lastAllocReq());
-    exit(1);
+void ThreadState::gcFinishIncremental() {
+  IncrementalGc *incr = incrementalGc();
+  heapCopyPtr() = incr->copyPtr;
+  pairCopyPtr() = incr->pairCopyPtr;
+
+  // The stores since the last minor gc. The nursery is copied along,
+  // as in a major gc.
+  for (Object *obj : *rememberedSet()) {
+    gcUpdateCopy(obj);
+  }
+  gcScavengeRoots();
+  for (Object *copy : incr->rescan) {
+    copy->gcScavenge(this);
   }
+  for (Object *closure : incr->deferredCode) {
+    closure->gcScavengeCode(this);
+  }
+  for (Object *obj : largeObjects()->deferred) {
+    obj->gcScavenge(this);
+  }
+  largeObjects()->deferred.clear();
+  gcScanCopies(&incr->scanPtr, &incr->pairScanPtr);
+
+  incr->rescan.clear();
+  incr->deferredCode.clear();
+  incr->isActive = false;
+  gcFlip();
 }
 
-// @See Runtime::collectAndAlloc
-void ThreadState::gcScavengeSchemeStack() {
-  FrameDescr fd = lastFrameDescr();
-  intptr_t stackPtr = lastStackPtr();
-  intptr_t stackTop = firstStackPtr();
+void ThreadState::gcUpdateCopy(Object *obj) {
+  if (obj->isPair()) {
+    Object *copy = *pairForwardOf(reinterpret_cast<intptr_t>(obj->raw()));
+    if (copy) {
+      memcpy(copy->raw(), obj->raw(), kPairSize);
+      incrementalGc()->rescan.push_back(copy);
+    }
+    return;
+  }
 
-  if (stackPtr == stackTop) {
+  GcHeader *h = GcHeader::fromRawObject(obj->raw());
+  if (!h->markAt<GcHeader::kCopied>()) {
+    // Not copied yet, and so will be as it is then.
     return;
   }
+  GcHeader *copy = h->copiedTo();
+  memcpy(copy->toRawObject(), h->toRawObject(),
+         copy->size - sizeof(GcHeader));
+  incrementalGc()->rescan.push_back(
+      copy->toRawObject()->tagWith(obj->getTag()));
+}
 
-  //dprintf(2, "[ScavScm] lastScmSp = %p, retaddr = %p\n",
-  //        (void **) stackPtr,
-  //        ((void **) stackPtr)[-1]);
+bool ThreadState::gcDeferCode(Object *closure) {
+  IncrementalGc *incr = incrementalGc();
+  if (!incr->isSlicing) {
+    return false;
+  }
+  incr->deferredCode.push_back(closure);
+  return true;
+}
 
-  while (true) {
-    for (intptr_t i = 0; i < fd.frameSize; ++i) {
-      if (fd.isPtr(i)) {
-        Object **loc = reinterpret_cast<Object **>(stackPtr + i * 8);
-        //Util::logObj("ScavengeScm Before", *loc);
+intptr_t ThreadState::nowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-        //if ((*loc)->isHeapAllocated()) {
-        //  GcHeader *h = GcHeader::fromRawObject((*loc)->raw());
-        //  dprintf(2, "[GcHeader] size = %d, copied = %d\n",
-        //          h->size, h->markAt<GcHeader::kCopied>());
-        //}
+void ThreadState::resizeOldSpace() {
+  intptr_t live = heapSize() - oldSpaceFree(),
+           oldSize = heapSize(),
+           maxSize = heapMaxSize(),
+           size = oldSize;
+
+  // Keeps the live objects between an eighth and half of it, and room
+  // for the next nurseries, so that majors get rarer as the live set
+  // grows.
+  while (size < maxSize &&
+         (live > size / 2 || live + nurseriesSize() > size)) {
+    size *= 2;
+  }
+  while (size / 2 >= kInitialHeapSize && live < size / 8) {
+    size /= 2;
+  }
+  heapSize() = std::min(size, maxSize);
 
-        gcScavenge(loc);
-        //Util::logObj("ScavengeScm After", *loc);
-      }
+  if (heapSize() < oldSize) {
+    // Gives back what is no longer used. Either old space can take up
+    // to all of heapSize.
+    intptr_t spaces[] = {
+      heapFromSpace(), pairFromSpace(),
+#ifndef kSanyaGCDebug
+      heapToSpace(), pairToSpace()
+#endif
+    };
+    for (intptr_t space : spaces) {
+      madvise(reinterpret_cast<void *>(space + heapSize()),
+              oldSize - heapSize(), MADV_DONTNEED);
     }
+  }
+
+  if (Option::global().kLogInfo && heapSize() != oldSize) {
+    dprintf(2, "[resizeOldSpace] %ld -> %ld, %ld live\n",
+            oldSize, heapSize(), live);
+  }
+}
 
-    stackPtr += (1 + fd.frameSize) * 8;
-    if (stackPtr == stackTop) {
-      break;
+void ThreadState::resetNursery() {
+#ifdef kSanyaGCDebug
+  // Fresh ones, so that what still points to the old ones breaks.
+  free((void *) nurseryBase());
+  nurseryBase() = (intptr_t) malloc(nurserySize());
+  free((void *) pairNurseryBase());
+  pairNurseryBase() = (intptr_t) calloc(1, pairSpaceSize(pairNurserySize()));
+#else
+  // The forwarding words of the pairs that were copied.
+  memset(pairForwardOf(pairNurseryBase()), 0,
+         (pairPtr() - pairNurseryBase()) / 2);
+#endif
+  intptr_t free = oldSpaceFree();
+  pairPtr()   = pairNurseryBase();
+  pairLimit() = pairNurseryBase() +
+                std::min(pairNurserySize(), free);
+  free -= pairLimit() - pairPtr();
+  heapPtr()   = nurseryBase();
+  heapLimit() = nurseryBase() +
+                std::min(nurserySize(), free);
+}
+
+void ThreadState::gcWriteBarrier(Object *obj) {
+  // Pairs have no bit, and are seldom stored into.
+  if (obj->isPair() ||
+      !GcHeader::fromRawObject(obj->raw())->
+          markAt<GcHeader::kRemembered>()) {
+    gcRemember(obj);
+  }
+}
+
+void ThreadState::gcRemember(Object *obj) {
+  assert(obj->isHeapAllocated() && !isImmortal(obj));
+  if (obj->isPair()) {
+    if (!isPairInNursery(reinterpret_cast<intptr_t>(obj->raw()))) {
+      rememberedSet()->push_back(obj);
     }
-    assert(stackPtr < stackTop);
-    fd = *reinterpret_cast<FrameDescr *>(stackPtr - 16);
+    return;
+  }
+
+  GcHeader *h = GcHeader::fromRawObject(obj->raw());
+
+  // Young objects are scavenged anyway. The bit saves the next stores
+  // into them a call here, and is cleared when they are promoted.
+  h->setMarkAt<GcHeader::kRemembered, true>();
+  if (!isInNursery(h)) {
+    rememberedSet()->push_back(obj);
+  }
+}
+
+// Code is never freed, so neither are these.
+static std::set<StackMap> *internedStackMaps;
+static std::unordered_map<intptr_t, const StackMap *> *stackMapsByPc;
+
+const StackMap *StackMap::intern(const StackMap &map) {
+  if (!internedStackMaps) {
+    internedStackMaps = new std::set<StackMap>();
+  }
+  return &*internedStackMaps->insert(map).first;
+}
+
+void StackMap::record(intptr_t pc, const StackMap *map) {
+  if (!stackMapsByPc) {
+    stackMapsByPc = new std::unordered_map<intptr_t, const StackMap *>();
+  }
+  (*stackMapsByPc)[pc] = map;
+}
+
+const StackMap *StackMap::lookup(intptr_t pc) {
+  if (!stackMapsByPc) {
+    return NULL;
   }
+  auto it = stackMapsByPc->find(pc);
+  return it != stackMapsByPc->end() ? it->second : NULL;
 }
 
 
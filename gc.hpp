@@ -5,20 +5,39 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <assert.h>
+#include <setjmp.h>
+
+#include <vector>
 
 #include "util.hpp"
 
 class Handle;
 class RawObject;
 class Object;
-class FrameDescr;
+class StackMap;
 class ThreadState;
 
-// Pads object, stores gc-related info
+extern "C" {
+  // @See asmentry.s
+  extern void Scheme_stackBarrier();
+  // What it calls. @See ThreadState::gcMoveStackBarrier
+  intptr_t Scheme_moveStackBarrier(ThreadState *ts);
+}
+
+// Pads object, stores gc-related info. One word: once the object is
+// copied, all of it but the mark bits is the address of the copy. Not
+// its first field, as an incremental gc keeps using the originals.
 class GcHeader {
  public:
   enum {
-    kCopied
+    kCopied,
+    // In the remembered set, or young and so in no need to be. Emitted
+    // code tests it inline: @See CGFunction::emitWriteBarrier
+    kRemembered,
+    // In the large object space, where nothing is ever copied, and
+    // reached by the current major gc.
+    kLarge,
+    kMarked
   };
 
   static GcHeader *fromRawObject(RawObject *wat) {
@@ -31,6 +50,28 @@ class GcHeader {
         reinterpret_cast<intptr_t>(this) + sizeof(*this));
   }
 
+  // Only once kCopied is set.
+  GcHeader *copiedTo() const {
+    return reinterpret_cast<GcHeader *>(word & ~kMarkBits);
+  }
+
+  // The header that the original had, with copy's address instead of
+  // the size. Keeps kRemembered: the write barrier still tests it on the
+  // originals of an incremental gc.
+  uintptr_t forwardingTo(GcHeader *copy) const {
+    return reinterpret_cast<uintptr_t>(copy) |
+           (mark & (1U << kRemembered)) | (1U << kCopied);
+  }
+
+  void setCopiedTo(GcHeader *copy) {
+    word = forwardingTo(copy);
+  }
+
+  // Also for originals that are copied already.
+  uint32_t objectSize() const {
+    return (mark & (1U << kCopied)) ? copiedTo()->size : size;
+  }
+
   template <int n>
   bool markAt() {
     return (1UL << n) & mark;
@@ -46,22 +87,121 @@ class GcHeader {
     }
   }
 
-  uint32_t mark;
+  // The pointer tag, kept in the mark of the copies so that the scan
+  // knows what they are. Nothing else has it.
+  intptr_t copiedTag() const {
+    return mark >> kTagShift;
+  }
 
-  // Including gcheader
-  uint32_t size;
+  void setCopiedTag(intptr_t tag) {
+    mark = (mark & ((1U << kTagShift) - 1)) | (tag << kTagShift);
+  }
 
-  GcHeader *copiedTo;
+  enum {
+    kTagShift = 8,
+    // Below the alignment of the objects.
+    kMarkBits = 7
+  };
+
+  union {
+    struct {
+      uint32_t mark;
+
+      // Including gcheader
+      uint32_t size;
+    };
+    uintptr_t word;
+  };
 
   friend class ThreadState;
 };
 
+// A major gc that is done a slice at a time, with Scheme code running
+// in between (Option::kGcPauseBudget). It replicates: the copies are
+// only used from the flip on, and until then the originals are. Stores
+// into the originals are caught by the write barrier, and their copies
+// made again. @See ThreadState::gcSlice
+struct IncrementalGc {
+  IncrementalGc()
+    : isActive(false)
+    , isSlicing(false)
+    , scanPtr(0)
+    , copyPtr(0)
+    , promotedPtr(0)
+    , pairScanPtr(0)
+    , pairCopyPtr(0)
+    , pairPromotedPtr(0)
+    , toScan(0)
+    , promotedRate(0)
+    , scanRate(kInitialScanRate)
+    , numPauses(0)
+    , numOverBudget(0)
+    , maxPause(0)
+  { }
+
+  bool isActive;
+  // In a slice, and not at the flip.
+  bool isSlicing;
+  // The copies in [scanPtr, copyPtr) of the to-space are not scanned.
+  intptr_t scanPtr, copyPtr;
+  // What the minor gcs promoted before that is copied already, live or
+  // not, so that the flip does not have to.
+  intptr_t promotedPtr;
+  // The same, in the pair spaces.
+  intptr_t pairScanPtr, pairCopyPtr, pairPromotedPtr;
+  // Copies whose originals were stored into, so to be scanned again.
+  std::vector<Object *> rescan;
+  // Copied closures. Their code is shared with the originals', so its
+  // constants are only scavenged at the flip.
+  std::vector<Object *> deferredCode;
+
+  // Bytes left to scan, at most: what was live at the start and what
+  // the minors promoted since, less what the slices scanned.
+  intptr_t toScan;
+  // Bytes that a minor gc promotes, and that a slice scans per us.
+  // Running averages, for the pacing. @See ThreadState::gcSlice
+  intptr_t promotedRate, scanRate;
+  // Until the first slice measures it. Low, so that the first cycle
+  // starts early rather than late.
+  static const intptr_t kInitialScanRate = 100;
+
+  // Of every gcCollect, in us.
+  intptr_t numPauses, numOverBudget, maxPause;
+  // The minors are not sliced, and a slice scans at least what the last
+  // one promoted, so pauses go over the budget. Past this many times
+  // it, the exit report says so.
+  static const intptr_t kMaxPauseFactor = 4;
+};
+
+// Objects of kLargeObjectSize or more, and the pinned ones, each in its
+// own mapping. They never move: a major gc marks the ones it reaches,
+// scans them in place and unmaps the others at the flip. The minor gcs
+// treat them as old. @See ThreadState::gcAllocLarge
+struct LargeObjectSpace {
+  LargeObjectSpace()
+    : size(0)
+    , allocated(0)
+    , isMajorDue(false)
+  { }
+
+  std::vector<GcHeader *> objects;
+  // Mapped, and since the last major gc.
+  intptr_t size, allocated;
+  // Set once allocated is over heapSize, so that the next gc is major.
+  bool isMajorDue;
+  // Marked and yet to be scanned.
+  std::vector<Object *> grey;
+  // Scanned by an incremental gc's slices, which only copy their
+  // referents, so scanned again in place at the flip.
+  std::vector<Object *> deferred;
+};
+
 // Stores all the of runtime information
 // Like capability in Haskell, ikpcb in Ikarus, etc etc..
 class ThreadState {
  public:
   enum {
-    kLastFrameDescrOffset,
+    kLastStackMapOffset,
     kFirstStackPtrOffset,
     kLastStackPtrOffset,
     kHeapPtrOffset,
@@ -74,9 +214,81 @@ class ThreadState {
     kLastAllocReqOffset,
     kHandleHeadOffset,
     kSymbolInternTableOffset,
+    // Where Scheme_asmEntry left the C stack
+    kCStackPtrOffset,
+    kStackBaseOffset,
+    kStackSizeOffset,
+    kNurseryBaseOffset,
+    kNurserySizeOffset,
+    kRememberedSetOffset,
+    kGcIsMinorOffset,
+    // Where the Scheme code unwinds to on errors that can be recovered
+    // from. NULL when not running it.
+    kErrorJmpBufOffset,
+    kHeapMaxSizeOffset,
+    kIncrementalGcOffset,
+    // Pairs, in their own spaces. Emitted code keeps pairPtr and
+    // pairLimit in registers.
+    kPairPtrOffset,
+    kPairLimitOffset,
+    kPairNurseryBaseOffset,
+    kPairNurserySizeOffset,
+    kPairFromSpaceOffset,
+    kPairToSpaceOffset,
+    kPairCopyPtrOffset,
+    kLargeObjectsOffset,
+    kImmortalBaseOffset,
+    kImmortalPtrOffset,
+    // The return address slot where Scheme_stackBarrier is, 0 if none,
+    // and the return address that it replaced.
+    kStackBarrierOffset,
+    kStackBarrierRetAddrOffset,
     kLastOffset
   };
 
+  // Scheme code runs on its own stack, [stackBase, stackBase +
+  // stackSize), with a no-access guard at the bottom. Prologues probe
+  // below %rsp, so an overflow faults there and the stack is grown, up to
+  // Option::kStackSize. @See Runtime::handleStackOvf
+  //
+  // Frames are only written by the code that runs in them. After a gc,
+  // the return address of the youngest frame is replaced by
+  // Scheme_stackBarrier, and returning through it moves it to the next
+  // frame. So the frames above the barrier have not run since the last
+  // gc, which left them pointing to old objects only, and the minor gcs
+  // skip them. @See gcSetStackBarrier
+  enum {
+    kStackGuardSize = 64 * 1024,
+    kInitialStackSize = 64 * 1024
+  };
+
+  // Objects are allocated in the nursery, [nurseryBase, nurseryBase +
+  // nurserySize), with heapPtr and heapLimit. A minor gc promotes the
+  // live ones to the old space, which is a semispace of heapSize that
+  // is filled up to heapCopyPtr, and only a major gc copies that. The
+  // semispaces are reserved at heapMaxSize.
+  //
+  // Pairs have no header and spaces of their own: a nursery from
+  // pairNurseryBase, bumped with pairPtr and pairLimit, and semispaces
+  // filled up to pairCopyPtr. heapSize bounds both old spaces together.
+  // Each pair space is followed by a word per pair, where a gc keeps
+  // the pair's copy: @See pairForwardOf
+  enum {
+    kDefaultNurserySize = 64 * 1024,
+    kPairSize = 16,
+    // Objects from there on go to the large object space.
+    kLargeObjectSize = 8 * 1024,
+    // For the constants of the compiled code and the interned symbols,
+    // which are never freed, and which the gc never copies nor scans.
+    kImmortalSpaceSize = 64 * 1024 * 1024,
+    // The old space grows from there up to Option::kHeapSize, and
+    // shrinks back as the live set does.
+    kInitialHeapSize = 256 * 1024
+  };
+
+  // Old objects that may point to young ones.
+  typedef std::vector<Object *> RememberedSet;
+
   static ThreadState &global() {
     if (!global_) {
       initGlobalState();
@@ -105,7 +317,10 @@ class ThreadState {
 
   // Only used by compiler code.
   void *gcAlloc(size_t size) {
-    assert(Util::isAligned<4>(size));
+    assert(Util::isAligned<3>(size));
+    if (size >= kLargeObjectSize) {
+      return gcAllocLarge(size);
+    }
     intptr_t res = heapPtr();
     size += sizeof(GcHeader);
     heapPtr() += size;
@@ -121,21 +336,176 @@ class ThreadState {
     }
   }
 
+  // No header, and so no size.
+  void *gcAllocPair() {
+    intptr_t res = pairPtr();
+    pairPtr() += kPairSize;
+    if (pairPtr() <= pairLimit()) {
+      return reinterpret_cast<void *>(res);
+    }
+    else {
+      return gcAllocPairSlow();
+    }
+  }
+
   void *gcAllocSlow(size_t);
+  void *gcAllocPairSlow();
+  // In the immortal space, from immortalBase up to immortalPtr. Only for
+  // what points to nothing but immortal objects, and is never stored
+  // into. Never gcs.
+  void *gcAllocImmortal(size_t size);
+  void *gcAllocImmortalPair();
+  // In the large object space, and so never moved: also for the objects
+  // that C code keeps pointers into. Old from the start, so the caller
+  // has to remember them once their fields are stored.
+  void *gcAllocLarge(size_t size);
+  // Unwinds if there is still no room for the lastAllocReq.
+  void gcEnsureRoom(intptr_t room);
   void gcCollect();
+  void gcCollectMinor();
+  void gcCollectMajor();
+  // The to-space becomes the old space.
+  void gcFlip();
+  // Unmaps the large objects that were not marked, and unmarks the others.
+  void gcSweepLarge();
   void gcScavenge(Object **);
-  void gcScavengeSchemeStack();
+  void gcScavengePair(Object **);
+  // Marks a large object and queues it for the scan.
+  void gcMarkLarge(Object *);
+  // Scavenges copies of its fields, leaving the object as it is.
+  void gcScavengeThrough(Object *);
+  // Cheney scan: scavenges the copies from scanPtr up to heapCopyPtr,
+  // and from pairScanPtr up to pairCopyPtr, which grow as they get their
+  // referents copied. Stops at the deadline (from nowUs) if there is
+  // one, but not before minBytes are scanned, and leaves the scan
+  // pointers where it got. True if it is done.
+  bool gcScanCopies(intptr_t *scanPtr, intptr_t *pairScanPtr,
+                    intptr_t deadline = 0, intptr_t minBytes = 0);
+  void gcScavengeRoots();
+  // Calls f(loc) for each root: the handles, the pointers in the Scheme
+  // frames and the symbol intern table. Only in the frames below the
+  // stack barrier if youngFramesOnly.
+  template <typename F>
+  void forEachRoot(F f, bool youngFramesOnly = false);
+
+  // Takes the barrier out, and puts it above the youngest frame. After
+  // each gc.
+  void gcResetStackBarrier();
+  // At the return address in slot.
+  void gcSetStackBarrier(intptr_t slot);
+  // When Scheme_stackBarrier is returned to: moves the barrier to the
+  // frame returned to, and returns the address to go on at.
+  intptr_t gcMoveStackBarrier();
+
+  // True if an incremental major gc has to start now to be done, in
+  // slices of about the budget, before the minors fill the old space.
+  bool gcIsIncrementalDue(intptr_t budget);
+  // Incremental major gc, after a minor one, so with an empty nursery.
+  void gcStartIncremental();
+  // Between where the minor gcs promote to and where the slices copy to.
+  void gcSwapCopyPtrs();
+  // Scans copies until the deadline, and at least as many as keep pace
+  // with the minor gcs: promoted is what the last one promoted. True
+  // once there are none left.
+  bool gcSlice(intptr_t deadline, intptr_t promoted);
+  // How many more minor gcs the old space can take, at the rate that
+  // they promote. At least 1.
+  intptr_t gcMinorsLeft();
+  // Stops the world to update the roots and copy what is left.
+  void gcFinishIncremental();
+  // The copy of obj is made again, after a store into obj.
+  void gcUpdateCopy(Object *obj);
+  // Called by Object::gcScavenge for the closures that it copies. True
+  // if their code is to be scavenged later.
+  bool gcDeferCode(Object *closure);
+  // For the pause budget.
+  static intptr_t nowUs();
+
+  // Bounds the nursery by what the old space can take.
+  void resetNursery();
+  // After a major gc, by how much of the old space survived it.
+  void resizeOldSpace();
+
+  // To be called after storing a pointer into obj, which may be old.
+  void gcWriteBarrier(Object *obj);
+  void gcRemember(Object *obj);
+
+  // Calls f(stackPtr, map) for each Scheme frame, from the most recent
+  // one, until f returns false.
+  template <typename F>
+  void walkSchemeStack(F f);
+
+  // Moves the frames to a stack twice as large. False if it is as
+  // large as it can be already.
+  bool growStack(intptr_t *stackPtr);
+  void mapStack(intptr_t size);
+
+  intptr_t stackTop() {
+    return stackBase() + stackSize();
+  }
 
+  bool isInStackGuard(intptr_t addr) {
+    return stackBase() <= addr && addr < stackBase() + kStackGuardSize;
+  }
+
+  // All of its reservation: parallel copying can go past heapSize.
+  // Or where it stays, for the large objects that are marked already.
   bool isInToSpace(GcHeader *h) {
     auto raw = reinterpret_cast<intptr_t>(h);
-    return heapToSpace() <= raw && raw < heapToSpace() + heapSize();
+    if (heapToSpace() <= raw && raw < heapToSpace() + heapMaxSize()) {
+      return true;
+    }
+    return h->markAt<GcHeader::kLarge>() && h->markAt<GcHeader::kMarked>();
+  }
+
+  // Only for heap objects: a fixnum may look like one.
+  bool isImmortal(Object *obj) {
+    // Tagged, but still inside the object.
+    auto raw = reinterpret_cast<intptr_t>(obj);
+    return immortalBase() <= raw && raw < immortalPtr();
+  }
+
+  bool isInNursery(GcHeader *h) {
+    auto raw = reinterpret_cast<intptr_t>(h);
+    return nurseryBase() <= raw && raw < nurseryBase() + nurserySize();
+  }
+
+  bool isPairInToSpace(intptr_t pair) {
+    return pairToSpace() <= pair && pair < pairToSpace() + heapMaxSize();
+  }
+
+  bool isPairInNursery(intptr_t pair) {
+    return pairNurseryBase() <= pair &&
+           pair < pairNurseryBase() + pairNurserySize();
+  }
+
+  // Where the copy of a pair in the nursery or the from-space goes. NULL
+  // until it is copied.
+  Object **pairForwardOf(intptr_t pair) {
+    intptr_t base = pairFromSpace(),
+             size = heapMaxSize();
+    if (isPairInNursery(pair)) {
+      base = pairNurseryBase();
+      size = pairNurserySize();
+    }
+    return reinterpret_cast<Object **>(base + size + (pair - base) / 2);
+  }
+
+  // What a minor gc may promote.
+  intptr_t nurseriesSize() {
+    return nurserySize() + pairNurserySize();
+  }
+
+  intptr_t oldSpaceFree() {
+    return heapFromSpace() + heapSize() - heapCopyPtr() -
+           (pairCopyPtr() - pairFromSpace());
   }
 
 #define MK_ATTR(name, offset, type) \
   type &name() { return at<offset ## Offset * sizeof(void *), type>(); }
 
 #define ATTR_LIST(V)                                                          \
-  V(lastFrameDescr,            kLastFrameDescr,            FrameDescr)        \
+  V(lastStackMap,              kLastStackMap,              const StackMap *)  \
   V(firstStackPtr,             kFirstStackPtr,             intptr_t)          \
   V(lastStackPtr,              kLastStackPtr,              intptr_t)          \
   V(heapPtr,                   kHeapPtr,                   intptr_t)          \
@@ -148,6 +518,28 @@ class ThreadState {
   V(lastAllocReq,              kLastAllocReq,              size_t)            \
   V(handleHead,                kHandleHead,                Handle *)          \
   V(symbolInternTable,         kSymbolInternTable,         Object *)          \
+  V(cStackPtr,                 kCStackPtr,                 intptr_t)          \
+  V(stackBase,                 kStackBase,                 intptr_t)          \
+  V(stackSize,                 kStackSize,                 intptr_t)          \
+  V(nurseryBase,               kNurseryBase,               intptr_t)          \
+  V(nurserySize,               kNurserySize,               intptr_t)          \
+  V(rememberedSet,             kRememberedSet,             RememberedSet *)   \
+  V(gcIsMinor,                 kGcIsMinor,                 bool)              \
+  V(errorJmpBuf,               kErrorJmpBuf,               jmp_buf *)         \
+  V(heapMaxSize,               kHeapMaxSize,               intptr_t)          \
+  V(incrementalGc,             kIncrementalGc,             IncrementalGc *)   \
+  V(pairPtr,                   kPairPtr,                   intptr_t)          \
+  V(pairLimit,                 kPairLimit,                 intptr_t)          \
+  V(pairNurseryBase,           kPairNurseryBase,           intptr_t)          \
+  V(pairNurserySize,           kPairNurserySize,           intptr_t)          \
+  V(pairFromSpace,             kPairFromSpace,             intptr_t)          \
+  V(pairToSpace,               kPairToSpace,               intptr_t)          \
+  V(pairCopyPtr,               kPairCopyPtr,               intptr_t)          \
+  V(largeObjects,              kLargeObjects,              LargeObjectSpace *) \
+  V(immortalBase,              kImmortalBase,              intptr_t)          \
+  V(immortalPtr,               kImmortalPtr,               intptr_t)          \
+  V(stackBarrier,              kStackBarrier,              intptr_t)          \
+  V(stackBarrierRetAddr,       kStackBarrierRetAddr,       intptr_t)          \
   // Append
 
   ATTR_LIST(MK_ATTR);
@@ -159,38 +551,90 @@ class ThreadState {
   static ThreadState *global_;
 };
 
-// Generated by codegen for each callsite.
-// Currently only contains the size of the frame and the place
-// of the pointers
-struct FrameDescr {
-  uint16_t frameSize;
-  char ptrBitMap[6];
+// Generated by codegen for each callsite, and for each point where the
+// code enters the runtime. Contains the size of the frame and the place
+// of the pointers.
+//
+// Calls don't pass them around: the map of a call site is looked up by
+// its return address, which the callee has right above its own frame.
+class StackMap {
+ public:
+  StackMap(intptr_t frameSize)
+    : frameSize_(frameSize)
+    , ptrBitMap((frameSize + 63) / 64, 0)
+  { }
 
-  FrameDescr() {
-    *this = unpack(0);
+  intptr_t frameSize() const {
+    return frameSize_;
   }
 
-  bool isPtr(intptr_t ix) {
-    int nthByte = ix >> 3;
-    int nthBit = ix & 7;
-    return (ptrBitMap[nthByte] >> nthBit) & 1L;
+  bool isPtr(intptr_t ix) const {
+    return (ptrBitMap[ix >> 6] >> (ix & 63)) & 1;
   }
 
   void setIsPtr(intptr_t ix) {
-    int nthByte = ix >> 3;
-    int nthBit = ix & 7;
-    ptrBitMap[nthByte] |= (1L << nthBit);
+    ptrBitMap[ix >> 6] |= 1UL << (ix & 63);
   }
 
-  intptr_t pack() {
-    return *reinterpret_cast<intptr_t *>(this);
+  // Calls f(ix) for each pointer slot, lowest first.
+  template <typename F>
+  void forEachPtr(F f) const {
+    for (size_t w = 0; w < ptrBitMap.size(); ++w) {
+      // Skips to the next set bit, then clears it.
+      for (uint64_t bits = ptrBitMap[w]; bits; bits &= bits - 1) {
+        f(w * 64 + __builtin_ctzl(bits));
+      }
+    }
   }
 
-  static FrameDescr unpack(intptr_t val) {
-    return *reinterpret_cast<FrameDescr *>(&val);
+  bool operator<(const StackMap &other) const {
+    return frameSize_ < other.frameSize_ ||
+           (frameSize_ == other.frameSize_ && ptrBitMap < other.ptrBitMap);
   }
+
+  // A copy that lives as long as the code: the same maps are shared.
+  static const StackMap *intern(const StackMap &map);
+
+  // Makes map the one of the frame at pc: the return address of a call,
+  // or a stack probe.
+  static void record(intptr_t pc, const StackMap *map);
+  // NULL if there is none.
+  static const StackMap *lookup(intptr_t pc);
+
+ private:
+  intptr_t frameSize_;
+  std::vector<uint64_t> ptrBitMap;
 };
 
+// Frames are laid out as
+//   [slots ... | retAddr | caller's slots ... | retAddr | ...]
+//   ^ lastStackPtr                                          ^ firstStackPtr
+template <typename F>
+void ThreadState::walkSchemeStack(F f) {
+  const StackMap *map = lastStackMap();
+  intptr_t stackPtr = lastStackPtr();
+  intptr_t stackTop = firstStackPtr();
+
+  while (stackPtr != stackTop) {
+    assert(stackPtr < stackTop);
+    if (!f(stackPtr, map)) {
+      break;
+    }
+
+    // Find prev stack
+    intptr_t retAddr = reinterpret_cast<intptr_t *>(stackPtr)[
+        map->frameSize()];
+    if (retAddr == reinterpret_cast<intptr_t>(&Scheme_stackBarrier)) {
+      retAddr = stackBarrierRetAddr();
+    }
+    stackPtr += (1 + map->frameSize()) * sizeof(void *);
+    if (stackPtr != stackTop) {
+      map = StackMap::lookup(retAddr);
+      assert(map && "No stack map for the return");
+    }
+  }
+}
+
 // Used by C++-compiled code (but not by native code) to handle gc.
 class Handle {
  public:
@@ -266,4 +710,25 @@ class Handle {
   friend class ThreadState;
 };
 
+// @See Runtime::collectAndAlloc
+template <typename F>
+void ThreadState::forEachRoot(F f, bool youngFramesOnly) {
+  // C++ roots
+  for (Handle *iter = handleHead()->next;
+       iter != handleHead(); iter = iter->next) {
+    f(&iter->ptr);
+  }
+
+  walkSchemeStack([&](intptr_t stackPtr, const StackMap *map) -> bool {
+    map->forEachPtr([&](intptr_t i) {
+      f(reinterpret_cast<Object **>(stackPtr + i * 8));
+    });
+    return !youngFramesOnly || !stackBarrier() ||
+           stackPtr + map->frameSize() * 8 < stackBarrier();
+  });
+
+  // Symbol intern table
+  f(&symbolInternTable());
+}
+
 #endif
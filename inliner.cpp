@@ -0,0 +1,351 @@
+#include <assert.h>
+
+#include <algorithm>
+#include <string>
+
+#include "inliner.hpp"
+#include "codegen2.hpp"
+
+Inliner::Inliner(CGModule *module, intptr_t budget)
+  : module(module)
+  , budget(budget)
+{ }
+
+void Inliner::run(CGFunction *f) {
+  scope = Util::newAssocList();
+  for (intptr_t i = 0; i < f->arity; ++i) {
+    Handle arg = Util::arrayAt(f->argArray, i);
+    scope = Util::assocInsert(scope, arg, Object::newTrue(), Util::kPtrEq);
+  }
+
+  intptr_t len = Util::arrayLength(f->lamBody);
+  for (intptr_t i = 2; i < len; ++i) {
+    collectDefines(Util::arrayAt(f->lamBody, i));
+  }
+
+  inlining.push_back(f);
+  for (intptr_t i = 2; i < len; ++i) {
+    Handle x = rewrite(Util::arrayAt(f->lamBody, i));
+    Util::arraySet(f->lamBody, i, x);
+  }
+  inlining.pop_back();
+}
+
+Object *Inliner::rewrite(const Handle &expr) {
+  if (!expr->isPair()) {
+    return expr;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t len = Util::arrayLength(xs);
+  Handle head = Util::arrayAt(xs, 0);
+
+  if (head == module->symQuote || head == module->symLambda) {
+    return expr;
+  }
+
+  intptr_t start = head->isSymbol() ? 1 : 0;
+  if (head == module->symDefine || head == module->symSete) {
+    // Skip the name
+    start = 2;
+  }
+  else if (head == module->symLet && len >= 2) {
+    Handle bindings = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(xs, 1), bindings);
+    for (intptr_t i = 0; i < Util::arrayLength(bindings); ++i) {
+      Handle binding = Util::arrayAt(bindings, i);
+      Handle name = binding->raw()->car();
+      scope = Util::assocInsert(scope, name, Object::newTrue(),
+                                Util::kPtrEq);
+      Handle init = binding->raw()->cdr()->raw()->car();
+      init = rewrite(init);
+      Handle tail = Object::newPair(init, Object::newNil());
+      binding = Object::newPair(name, tail);
+      Util::arraySet(bindings, i, binding);
+    }
+    Handle newBindings = Util::arrayToList(bindings);
+    Util::arraySet(xs, 1, newBindings);
+    start = 2;
+  }
+
+  for (intptr_t i = start; i < len; ++i) {
+    Handle x = rewrite(Util::arrayAt(xs, i));
+    Util::arraySet(xs, i, x);
+  }
+
+  Handle result;
+  if (head == module->symIf && (result = foldIf(xs))) {
+    return result;
+  }
+  else if ((result = foldPredicate(xs))) {
+    return result;
+  }
+  else if ((result = tryInline(xs))) {
+    return result;
+  }
+  return Util::arrayToList(xs);
+}
+
+Object *Inliner::tryInline(const Handle &xs) {
+  Handle head = Util::arrayAt(xs, 0);
+  if (budget <= 0 || !head->isSymbol() || isLocal(head)) {
+    return NULL;
+  }
+
+  intptr_t argc = Util::arrayLength(xs) - 1;
+  CGFunction *callee = module->lookupKnownFunction(head);
+  if (!callee || callee->arity != argc ||
+      std::find(inlining.begin(), inlining.end(), callee) !=
+          inlining.end()) {
+    return NULL;
+  }
+
+  Handle body = Util::arrayToList(callee->lamBody, 2);
+  if (sizeOf(body) > budget ||
+      mentions(body, head) ||
+      mentions(body, module->symDefine) ||
+      mentions(body, module->symLambda) ||
+      mentionsLocal(body, callee->argArray)) {
+    return NULL;
+  }
+  for (intptr_t i = 1; i <= argc; ++i) {
+    // Would leave a frame slot under the bindings.
+    if (mentions(Util::arrayAt(xs, i), module->symDefine)) {
+      return NULL;
+    }
+  }
+
+  // Substituting a variable that the callee assigns would assign ours.
+  bool assigns = mentions(body, module->symSete);
+
+  Handle subst = Util::newAssocList();
+  Handle bindings = Util::newGrowableArray();
+  for (intptr_t i = 0; i < argc; ++i) {
+    Handle param = Util::arrayAt(callee->argArray, i);
+    Handle arg = Util::arrayAt(xs, i + 1);
+    if (!assigns && isTrivial(arg)) {
+      subst = Util::assocInsert(subst, param, arg, Util::kPtrEq);
+    }
+    else {
+      Handle fresh = newLocal(param);
+      subst = Util::assocInsert(subst, param, fresh, Util::kPtrEq);
+      Handle tail = Object::newPair(arg, Object::newNil());
+      Handle binding = Object::newPair(fresh, tail);
+      Util::arrayAppend(bindings, binding);
+    }
+  }
+
+  body = substitute(body, subst);
+
+  // The spliced body may contain more calls to inline and constants to
+  // fold, now that the arguments are known.
+  Handle exprs = Util::newGrowableArray();
+  Util::listToArray(body, exprs);
+  inlining.push_back(callee);
+  for (intptr_t i = 0; i < Util::arrayLength(exprs); ++i) {
+    Handle x = rewrite(Util::arrayAt(exprs, i));
+    Util::arraySet(exprs, i, x);
+  }
+  inlining.pop_back();
+  body = Util::arrayToList(exprs);
+
+  if (Util::arrayLength(bindings)) {
+    Handle newBindings = Util::arrayToList(bindings);
+    Handle tail = Object::newPair(newBindings, body);
+    return Object::newPair(module->symLet, tail);
+  }
+  else if (Util::arrayLength(exprs) == 1) {
+    return Util::arrayAt(exprs, 0);
+  }
+  else {
+    return Object::newPair(module->symBegin, body);
+  }
+}
+
+Object *Inliner::foldIf(const Handle &xs) {
+  Handle pred;
+  if (Util::arrayLength(xs) != 4 ||
+      !isConstant(Util::arrayAt(xs, 1), &pred)) {
+    return NULL;
+  }
+  return Util::arrayAt(xs, pred->isFalse() ? 3 : 2);
+}
+
+Object *Inliner::foldPredicate(const Handle &xs) {
+  Handle head = Util::arrayAt(xs, 0);
+  Handle val;
+  if (Util::arrayLength(xs) != 2 || !isConstant(Util::arrayAt(xs, 1), &val)) {
+    return NULL;
+  }
+
+#define MK_FOLD(_unused, typeName)                                      \
+  if (head == module->symPrim ## typeName ## p) {                       \
+    return Object::newBool(val->getTag() == RawObject::k ## typeName ## Tag); \
+  }
+PRIM_TAG_PREDICATES(MK_FOLD)
+#undef MK_FOLD
+
+#define MK_FOLD(_unused, objName)                                       \
+  if (head == module->symPrim ## objName ## p) {                        \
+    return Object::newBool(val->is ## objName());                       \
+  }
+PRIM_SINGLETON_PREDICATES(MK_FOLD)
+#undef MK_FOLD
+
+  return NULL;
+}
+
+Object *Inliner::substitute(const Handle &expr, const Handle &subst) {
+  if (expr->isSymbol()) {
+    bool ok;
+    Handle to = Util::assocLookup(subst, expr, Util::kPtrEq, &ok);
+    return ok ? to.getPtr() : expr.getPtr();
+  }
+  else if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return expr;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t len = Util::arrayLength(xs);
+  Handle innerSubst = subst;
+  intptr_t start = 0;
+
+  if (Util::arrayAt(xs, 0) == module->symLet && len >= 2) {
+    Handle bindings = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(xs, 1), bindings);
+    for (intptr_t i = 0; i < Util::arrayLength(bindings); ++i) {
+      Handle binding = Util::arrayAt(bindings, i);
+      Handle name = binding->raw()->car();
+      Handle init = binding->raw()->cdr()->raw()->car();
+      // Bindings are sequential, see CGFunction::tryLet.
+      init = substitute(init, innerSubst);
+      Handle fresh = newLocal(name);
+      innerSubst = Util::assocInsert(innerSubst, name, fresh, Util::kPtrEq);
+      Handle tail = Object::newPair(init, Object::newNil());
+      binding = Object::newPair(fresh, tail);
+      Util::arraySet(bindings, i, binding);
+    }
+    Handle newBindings = Util::arrayToList(bindings);
+    Util::arraySet(xs, 1, newBindings);
+    start = 2;
+  }
+
+  for (intptr_t i = start; i < len; ++i) {
+    Handle x = substitute(Util::arrayAt(xs, i), innerSubst);
+    Util::arraySet(xs, i, x);
+  }
+  return Util::arrayToList(xs);
+}
+
+Object *Inliner::newLocal(const Handle &name) {
+  // Not interned: cannot clash with any other name.
+  std::string str = name->rawSymbol();
+  Handle fresh = Object::newSymbolFromC(str.c_str());
+  scope = Util::assocInsert(scope, fresh, Object::newTrue(), Util::kPtrEq);
+  return fresh;
+}
+
+bool Inliner::isTrivial(const Handle &expr) {
+  Handle val;
+  if (isConstant(expr, &val)) {
+    return true;
+  }
+  else if (expr->isSymbol()) {
+    // Only our own code assigns our locals. Immutable globals never
+    // change.
+    return isLocal(expr) || module->lookupKnownFunction(expr);
+  }
+  return false;
+}
+
+bool Inliner::isConstant(const Handle &expr, Handle *out) {
+  if (expr->isFixnum() || expr->isTrue() || expr->isFalse()) {
+    *out = expr;
+    return true;
+  }
+  else if (expr->isPair() && expr->raw()->car() == module->symQuote) {
+    Handle rest = expr->raw()->cdr();
+    if (rest->isPair() && rest->raw()->cdr()->isNil()) {
+      *out = rest->raw()->car();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Inliner::isLocal(const Handle &name) {
+  bool ok;
+  Util::assocLookup(scope, name, Util::kPtrEq, &ok);
+  return ok;
+}
+
+void Inliner::collectDefines(const Handle &expr) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  if (Util::arrayAt(xs, 0) == module->symDefine &&
+      Util::arrayLength(xs) == 3) {
+    Handle name = Util::arrayAt(xs, 1);
+    scope = Util::assocInsert(scope, name, Object::newTrue(), Util::kPtrEq);
+  }
+  for (intptr_t i = 0; i < Util::arrayLength(xs); ++i) {
+    collectDefines(Util::arrayAt(xs, i));
+  }
+}
+
+bool Inliner::mentions(const Handle &expr, const Handle &name) {
+  if (expr->isSymbol()) {
+    return expr == name;
+  }
+  else if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return false;
+  }
+
+  for (Handle iter = expr; iter->isPair(); iter = iter->raw()->cdr()) {
+    if (mentions(iter->raw()->car(), name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Inliner::mentionsLocal(const Handle &expr, const Handle &params) {
+  if (expr->isSymbol()) {
+    if (!isLocal(expr)) {
+      return false;
+    }
+    for (intptr_t i = 0; i < Util::arrayLength(params); ++i) {
+      if (Util::arrayAt(params, i) == expr) {
+        return false;
+      }
+    }
+    return true;
+  }
+  else if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return false;
+  }
+
+  for (Handle iter = expr; iter->isPair(); iter = iter->raw()->cdr()) {
+    if (mentionsLocal(iter->raw()->car(), params)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+intptr_t Inliner::sizeOf(const Handle &expr) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote) {
+    return 1;
+  }
+
+  intptr_t size = 0;
+  for (Handle iter = expr; iter->isPair(); iter = iter->raw()->cdr()) {
+    size += sizeOf(iter->raw()->car());
+  }
+  return size;
+}
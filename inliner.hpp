@@ -0,0 +1,63 @@
+#ifndef INLINER_HPP
+#define INLINER_HPP
+
+#include <vector>
+
+#include "gc.hpp"
+#include "object.hpp"
+#include "util.hpp"
+
+class CGModule;
+class CGFunction;
+
+// Splices small non-recursive global functions into their call sites
+// and folds ifs on constants. Works on the s-expressions, before
+// CGFunction::compileFunction.
+//
+// Constant and variable arguments are substituted into the callee's
+// body. The others are bound to fresh names by a (let# ...) so they are
+// still evaluated exactly once.
+class Inliner {
+ public:
+  // Bodies larger than budget are not inlined. 0 only folds.
+  Inliner(CGModule *module, intptr_t budget);
+
+  // Rewrites the body of f in place.
+  void run(CGFunction *f);
+
+ private:
+  Object *rewrite(const Handle &expr);
+  // These return NULL if there is nothing to do.
+  Object *tryInline(const Handle &xs);
+  Object *foldIf(const Handle &xs);
+  Object *foldPredicate(const Handle &xs);
+
+  // Replaces the names in subst. Binders of let# are renamed as well,
+  // so the same body can be spliced twice into a function.
+  Object *substitute(const Handle &expr, const Handle &subst);
+  Object *newLocal(const Handle &name);
+
+  // Constants and variables that cannot change while the inlined body
+  // runs.
+  bool isTrivial(const Handle &expr);
+  // Sets *out to the value of a constant expression.
+  bool isConstant(const Handle &expr, Handle *out);
+  bool isLocal(const Handle &name);
+
+  void collectDefines(const Handle &expr);
+  bool mentions(const Handle &expr, const Handle &name);
+  // True if a free name of expr would be captured by our locals.
+  bool mentionsLocal(const Handle &expr, const Handle &params);
+  intptr_t sizeOf(const Handle &expr);
+
+  CGModule *module;
+  intptr_t budget;
+
+  // Assoc list of the locals of the function being rewritten
+  Handle scope;
+
+  // Functions whose bodies are being spliced. Stops recursion.
+  std::vector<CGFunction *> inlining;
+};
+
+#endif
@@ -0,0 +1,1010 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+
+#include "ir.hpp"
+#include "codegen2.hpp"
+#include "runtime.hpp"
+
+bool IRInstr::isPure() const {
+  switch (op) {
+  case kConst:
+  case kAdd:
+  case kSub:
+  // Pairs and closures are immutable.
+  case kLoad:
+  case kThisClosure:
+    return true;
+  case kLoadGlobal:
+    return callee != NULL;
+  default:
+    // Flags have exactly one user and must stay next to it.
+    return false;
+  }
+}
+
+bool IRInstr::isRemovable() const {
+  switch (op) {
+  case kConst:
+  case kArg:
+  case kPhi:
+  case kLoadGlobal:
+  case kAdd:
+  case kSub:
+  case kLt:
+  case kTagIs:
+  case kIsConst:
+  case kBool:
+  case kLoad:
+  case kCons:
+  case kMakeClosure:
+  case kThisClosure:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool IRInstr::isTerminator() const {
+  switch (op) {
+  case kJump:
+  case kBranch:
+  case kReturn:
+  case kTailCall:
+  case kTailCallKnown:
+  case kError:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool IRInstr::isCall() const {
+  switch (op) {
+  case kCons:
+  case kMakeClosure:
+  case kCall:
+  case kCallKnown:
+  case kDisplay:
+  case kNewLine:
+  case kTrace:
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char *IRInstr::name() const {
+  switch (op) {
+#define MK_NAME(name) case k ## name: return #name;
+IR_OPCODES(MK_NAME)
+#undef MK_NAME
+  default:
+    assert(0);
+  }
+}
+
+IRFunction::IRFunction(CGFunction *owner)
+  : owner(owner)
+  , consts(Util::newGrowableArray())
+{ }
+
+intptr_t IRFunction::newBlock() {
+  IRBlock b;
+  b.dead = false;
+  blocks.push_back(b);
+  return blocks.size() - 1;
+}
+
+intptr_t IRFunction::emit(intptr_t block, IRInstr::Opcode op,
+                          IRInstr::Type type,
+                          const std::vector<intptr_t> &args,
+                          intptr_t aux) {
+  IRInstr instr;
+  instr.op = op;
+  instr.type = type;
+  instr.block = block;
+  instr.args = args;
+  instr.aux = aux;
+  instr.callee = NULL;
+  instr.dead = false;
+  instrs.push_back(instr);
+
+  intptr_t id = instrs.size() - 1;
+  blocks[block].instrs.push_back(id);
+  return id;
+}
+
+void IRFunction::addEdge(intptr_t from, intptr_t to) {
+  blocks[from].succs.push_back(to);
+  blocks[to].preds.push_back(from);
+}
+
+intptr_t IRFunction::addConst(const Handle &x) {
+  intptr_t len = Util::arrayLength(consts);
+  for (intptr_t i = 0; i < len; ++i) {
+    if (Util::arrayAt(consts, i) == x) {
+      return i;
+    }
+  }
+  Util::arrayAppend(consts, x);
+  return len;
+}
+
+std::vector<intptr_t> IRFunction::reversePostorder() {
+  std::vector<intptr_t> order;
+  std::vector<bool> visited(blocks.size(), false);
+  // (block, next successor to visit)
+  std::vector<std::pair<intptr_t, intptr_t> > stack;
+
+  visited[kEntry] = true;
+  stack.push_back(std::make_pair(kEntry, 0));
+  while (!stack.empty()) {
+    intptr_t b = stack.back().first;
+    intptr_t &next = stack.back().second;
+    // Successors are visited backwards so that succs[0] ends up first.
+    intptr_t numSuccs = blocks[b].succs.size();
+    if (next < numSuccs) {
+      intptr_t s = blocks[b].succs[numSuccs - 1 - next++];
+      if (!visited[s]) {
+        visited[s] = true;
+        stack.push_back(std::make_pair(s, 0));
+      }
+    }
+    else {
+      order.push_back(b);
+      stack.pop_back();
+    }
+  }
+
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+std::vector<intptr_t> IRFunction::computeDominators() {
+  // Cooper, Harvey and Kennedy: "A Simple, Fast Dominance Algorithm".
+  std::vector<intptr_t> order = reversePostorder();
+  std::vector<intptr_t> rpoIndex(blocks.size(), -1);
+  for (size_t i = 0; i < order.size(); ++i) {
+    rpoIndex[order[i]] = i;
+  }
+
+  std::vector<intptr_t> idom(blocks.size(), -1);
+  idom[kEntry] = kEntry;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); ++i) {
+      intptr_t b = order[i];
+      intptr_t newIdom = -1;
+      for (auto p : blocks[b].preds) {
+        if (idom[p] == -1) {
+          continue;
+        }
+        if (newIdom == -1) {
+          newIdom = p;
+          continue;
+        }
+        intptr_t x = p, y = newIdom;
+        while (x != y) {
+          while (rpoIndex[x] > rpoIndex[y]) {
+            x = idom[x];
+          }
+          while (rpoIndex[y] > rpoIndex[x]) {
+            y = idom[y];
+          }
+        }
+        newIdom = x;
+      }
+      if (idom[b] != newIdom) {
+        idom[b] = newIdom;
+        changed = true;
+      }
+    }
+  }
+  return idom;
+}
+
+void IRFunction::replaceUses(intptr_t from, intptr_t to) {
+  for (auto &instr : instrs) {
+    if (instr.dead) {
+      continue;
+    }
+    for (auto &arg : instr.args) {
+      if (arg == from) {
+        arg = to;
+      }
+    }
+  }
+}
+
+void IRFunction::removeUnreachable() {
+  std::vector<bool> reachable(blocks.size(), false);
+  for (auto b : reversePostorder()) {
+    reachable[b] = true;
+  }
+
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    IRBlock &block = blocks[b];
+    if (!reachable[b]) {
+      block.dead = true;
+      for (auto i : block.instrs) {
+        instrs[i].dead = true;
+      }
+      block.instrs.clear();
+      block.preds.clear();
+      block.succs.clear();
+      continue;
+    }
+
+    // Drop the edges from dead blocks, together with the phi inputs
+    // that came along them.
+    for (intptr_t j = block.preds.size() - 1; j >= 0; --j) {
+      if (reachable[block.preds[j]]) {
+        continue;
+      }
+      block.preds.erase(block.preds.begin() + j);
+      for (auto i : block.instrs) {
+        if (instrs[i].op == IRInstr::kPhi) {
+          instrs[i].args.erase(instrs[i].args.begin() + j);
+        }
+      }
+    }
+  }
+}
+
+void IRFunction::removeTrivialPhis() {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto &instr : instrs) {
+      if (instr.dead || instr.op != IRInstr::kPhi) {
+        continue;
+      }
+
+      // A phi whose inputs are all the same value (or itself).
+      intptr_t self = &instr - &instrs[0];
+      intptr_t same = -1;
+      bool trivial = true;
+      for (auto arg : instr.args) {
+        if (arg == self || arg == same) {
+          continue;
+        }
+        if (same != -1) {
+          trivial = false;
+          break;
+        }
+        same = arg;
+      }
+      if (!trivial || same < 0) {
+        continue;
+      }
+
+      replaceUses(self, same);
+      instr.dead = true;
+      std::vector<intptr_t> &is = blocks[instr.block].instrs;
+      is.erase(std::find(is.begin(), is.end(), self));
+      changed = true;
+    }
+  }
+}
+
+void IRFunction::eliminateCommonSubexprs() {
+  std::vector<intptr_t> idom = computeDominators();
+  std::vector<std::vector<intptr_t> > children(blocks.size());
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    if (!blocks[b].dead && idom[b] != -1 && (intptr_t) b != kEntry) {
+      children[idom[b]].push_back(b);
+    }
+  }
+
+  // Walks the dominator tree. An expression is available in the blocks
+  // that are dominated by the block that computes it.
+  typedef std::vector<intptr_t> Key;
+  std::map<Key, intptr_t> available;
+  // (block, next child to visit, keys added by the block)
+  struct Frame {
+    intptr_t block;
+    size_t next;
+    std::vector<Key> added;
+  };
+  std::vector<Frame> stack;
+  stack.push_back(Frame { kEntry, 0, std::vector<Key>() });
+
+  bool visiting = true;
+  while (!stack.empty()) {
+    Frame &frame = stack.back();
+    if (visiting) {
+      std::vector<intptr_t> kept;
+      for (auto i : blocks[frame.block].instrs) {
+        IRInstr &instr = instrs[i];
+        if (!instr.isPure()) {
+          kept.push_back(i);
+          continue;
+        }
+
+        Key key;
+        key.push_back(instr.op);
+        key.push_back(instr.aux);
+        key.insert(key.end(), instr.args.begin(), instr.args.end());
+        auto found = available.find(key);
+        if (found != available.end()) {
+          replaceUses(i, found->second);
+          instr.dead = true;
+        }
+        else {
+          available[key] = i;
+          frame.added.push_back(key);
+          kept.push_back(i);
+        }
+      }
+      blocks[frame.block].instrs = kept;
+    }
+
+    if (frame.next < children[frame.block].size()) {
+      intptr_t child = children[frame.block][frame.next++];
+      stack.push_back(Frame { child, 0, std::vector<Key>() });
+      visiting = true;
+    }
+    else {
+      for (auto &key : frame.added) {
+        available.erase(key);
+      }
+      stack.pop_back();
+      visiting = false;
+    }
+  }
+}
+
+void IRFunction::scalarReplaceConses() {
+  intptr_t carOffset = RawObject::kCarOffset - RawObject::kPairTag,
+           cdrOffset = RawObject::kCdrOffset - RawObject::kPairTag;
+  // Loads of loads, as in (car# (cdr# x)), take a few rounds.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto &block : blocks) {
+      std::vector<intptr_t> kept;
+      for (auto i : block.instrs) {
+        IRInstr &instr = instrs[i];
+        if (instr.op != IRInstr::kLoad || instr.args[0] < 0 ||
+            (instr.aux != carOffset && instr.aux != cdrOffset)) {
+          kept.push_back(i);
+          continue;
+        }
+
+        const IRInstr &ptr = instrs[instr.args[0]];
+        if (ptr.op == IRInstr::kCons) {
+          // Pairs are immutable.
+          replaceUses(i, ptr.args[instr.aux == carOffset ? 0 : 1]);
+          instr.dead = true;
+          changed = true;
+          continue;
+        }
+        if (ptr.op == IRInstr::kConst && constAt(ptr.aux)->isPair()) {
+          // Quoted, and so immortal.
+          Object *pair = constAt(ptr.aux);
+          instr.op = IRInstr::kConst;
+          instr.aux = addConst(instr.aux == carOffset ? pair->raw()->car()
+                                                      : pair->raw()->cdr());
+          instr.args.clear();
+          changed = true;
+        }
+        kept.push_back(i);
+      }
+      block.instrs = kept;
+    }
+  }
+}
+
+void IRFunction::eliminateDeadCode() {
+  std::vector<bool> used(instrs.size(), false);
+  std::vector<intptr_t> worklist;
+
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    if (!instrs[i].dead && !instrs[i].isRemovable()) {
+      used[i] = true;
+      worklist.push_back(i);
+    }
+  }
+  while (!worklist.empty()) {
+    intptr_t i = worklist.back();
+    worklist.pop_back();
+    for (auto arg : instrs[i].args) {
+      if (arg >= 0 && !used[arg]) {
+        used[arg] = true;
+        worklist.push_back(arg);
+      }
+    }
+  }
+
+  for (auto &block : blocks) {
+    std::vector<intptr_t> kept;
+    for (auto i : block.instrs) {
+      if (used[i]) {
+        kept.push_back(i);
+      }
+      else {
+        instrs[i].dead = true;
+      }
+    }
+    block.instrs = kept;
+  }
+}
+
+void IRFunction::hoistGlobalLoads() {
+  // The only loops are self tail calls, which jump back to the header.
+  // The entry block is then the preheader.
+  std::vector<bool> inLoop(blocks.size(), false);
+  std::vector<intptr_t> worklist;
+  for (auto p : blocks[kHeader].preds) {
+    if (p != kEntry && !inLoop[p]) {
+      inLoop[p] = true;
+      worklist.push_back(p);
+    }
+  }
+  if (worklist.empty()) {
+    return;
+  }
+  inLoop[kHeader] = true;
+  while (!worklist.empty()) {
+    intptr_t b = worklist.back();
+    worklist.pop_back();
+    for (auto p : blocks[b].preds) {
+      if (!inLoop[p]) {
+        inLoop[p] = true;
+        worklist.push_back(p);
+      }
+    }
+  }
+
+  // Globals that the loop might change. A call might assign any of them.
+  bool hasCall = false;
+  std::vector<intptr_t> stored;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    if (!inLoop[b]) {
+      continue;
+    }
+    for (auto i : blocks[b].instrs) {
+      const IRInstr &instr = instrs[i];
+      if (instr.op == IRInstr::kCall || instr.op == IRInstr::kCallKnown) {
+        hasCall = true;
+      }
+      else if (instr.op == IRInstr::kStoreGlobal) {
+        stored.push_back(instr.aux);
+      }
+    }
+  }
+
+  std::vector<intptr_t> hoisted;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    if (!inLoop[b]) {
+      continue;
+    }
+    std::vector<intptr_t> kept;
+    for (auto i : blocks[b].instrs) {
+      const IRInstr &instr = instrs[i];
+      bool invariant = instr.op == IRInstr::kLoadGlobal &&
+          (instr.callee || (!hasCall &&
+              std::find(stored.begin(), stored.end(), instr.aux) ==
+                  stored.end()));
+      if (invariant) {
+        hoisted.push_back(i);
+      }
+      else {
+        kept.push_back(i);
+      }
+    }
+    blocks[b].instrs = kept;
+  }
+
+  // Before the entry's jump to the header.
+  std::vector<intptr_t> &entry = blocks[kEntry].instrs;
+  for (auto i : hoisted) {
+    instrs[i].block = kEntry;
+    entry.insert(entry.end() - 1, i);
+  }
+}
+
+void IRFunction::optimize() {
+  removeUnreachable();
+  removeTrivialPhis();
+  // Before CSE, so that the hoisted loads of the same global are merged.
+  hoistGlobalLoads();
+  eliminateCommonSubexprs();
+  scalarReplaceConses();
+  eliminateDeadCode();
+  // Dead code might have been the only thing that kept a phi apart.
+  removeTrivialPhis();
+
+  if (Option::global().kLogInfo) {
+    display();
+  }
+}
+
+void IRFunction::display(int fd) {
+  dprintf(fd, "IRFunction ");
+  owner->name->displayDetail(fd);
+  dprintf(fd, "\n");
+
+  for (auto b : reversePostorder()) {
+    dprintf(fd, "b%ld:", b);
+    for (auto p : blocks[b].preds) {
+      dprintf(fd, " <- b%ld", p);
+    }
+    dprintf(fd, "\n");
+
+    for (auto i : blocks[b].instrs) {
+      const IRInstr &instr = instrs[i];
+      dprintf(fd, "  v%ld = %s", i, instr.name());
+      for (auto arg : instr.args) {
+        if (arg >= 0) {
+          dprintf(fd, " v%ld", arg);
+        }
+        else {
+          dprintf(fd, " undef");
+        }
+      }
+      if (instr.op == IRInstr::kConst || instr.op == IRInstr::kIsConst) {
+        dprintf(fd, " ");
+        constAt(instr.aux)->displayDetail(fd);
+      }
+      else if (instr.aux) {
+        dprintf(fd, " #%ld", instr.aux);
+      }
+      if (instr.callee) {
+        dprintf(fd, " ");
+        instr.callee->name->displayDetail(fd);
+      }
+      dprintf(fd, "\n");
+    }
+    for (auto s : blocks[b].succs) {
+      dprintf(fd, "  -> b%ld\n", s);
+    }
+  }
+}
+
+IRBuilder::IRBuilder(CGFunction *f, IRFunction *ir)
+  : func(f)
+  , module(f->parent)
+  , ir(ir)
+  , current(-1)
+  , failed(false)
+  , vars(Util::newGrowableArray())
+{ }
+
+bool IRBuilder::build() {
+  if (func->arity > 5) {
+    return false;
+  }
+
+  for (intptr_t i = 0; i < func->arity; ++i) {
+    Util::arrayAppend(vars, Util::arrayAt(func->argArray, i));
+  }
+  intptr_t len = Util::arrayLength(func->lamBody);
+  for (intptr_t i = 2; i < len; ++i) {
+    collectVars(Util::arrayAt(func->lamBody, i));
+  }
+  env.assign(Util::arrayLength(vars), -1);
+
+  intptr_t entry = ir->newBlock(),
+           header = ir->newBlock();
+  assert(entry == IRFunction::kEntry && header == IRFunction::kHeader);
+
+  current = entry;
+  std::vector<intptr_t> args;
+  for (intptr_t i = 0; i < func->arity; ++i) {
+    args.push_back(emit(IRInstr::kArg, IRInstr::kTagged,
+                        std::vector<intptr_t>(), i));
+  }
+  emit(IRInstr::kJump, IRInstr::kNoValue);
+  ir->addEdge(entry, header);
+
+  // Self tail calls add their arguments to these phis.
+  current = header;
+  for (intptr_t i = 0; i < func->arity; ++i) {
+    env[i] = emit(IRInstr::kPhi, IRInstr::kTagged,
+                  std::vector<intptr_t>(1, args[i]));
+  }
+
+  intptr_t result = lowerBody(func->lamBody, 2,
+                              Option::global().kTailCallOpt);
+  terminate(IRInstr::kReturn, std::vector<intptr_t>(1, result));
+  if (failed) {
+    return false;
+  }
+
+  // A local that is defined in only one branch of an if but used after
+  // the join is fine in the frame-based compiler, but has no ssa value.
+  ir->removeUnreachable();
+  ir->removeTrivialPhis();
+  ir->eliminateDeadCode();
+  for (intptr_t i = 0; i < ir->numInstrs(); ++i) {
+    const IRInstr &instr = ir->instr(i);
+    if (instr.dead || instr.op != IRInstr::kPhi) {
+      continue;
+    }
+    for (auto arg : instr.args) {
+      if (arg == kUndefined) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+intptr_t IRBuilder::lower(const Handle &expr, bool isTail) {
+  switch (expr->getTag()) {
+  case RawObject::kFixnumTag:
+    return emitConst(expr);
+
+  case RawObject::kSymbolTag:
+    return lowerVar(expr);
+
+  case RawObject::kSingletonTag:
+    if (expr->isTrue() || expr->isFalse()) {
+      return emitConst(expr);
+    }
+    failed = true;
+    return emitConst(Object::newVoid());
+
+  case RawObject::kPairTag:
+    break;
+
+  default:
+    failed = true;
+    return emitConst(Object::newVoid());
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t len = Util::arrayLength(xs);
+  Handle head = Util::arrayAt(xs, 0);
+
+  if (head == module->symIf && len == 4) {
+    return lowerIf(xs, isTail);
+  }
+  else if (head == module->symDefine && len == 3) {
+    intptr_t val = lower(Util::arrayAt(xs, 2), false);
+    env[lookupVar(Util::arrayAt(xs, 1))] = val;
+    return emitConst(Object::newVoid());
+  }
+  else if (head == module->symSete && len == 3) {
+    Handle name = Util::arrayAt(xs, 1);
+    intptr_t val = lower(Util::arrayAt(xs, 2), false);
+    intptr_t ix = lookupVar(name);
+    if (ix != -1 && env[ix] != -1) {
+      env[ix] = val;
+    }
+    else {
+      intptr_t globalIx = module->lookupGlobal(name);
+      if (globalIx == -1) {
+        failed = true;
+      }
+      emit(IRInstr::kStoreGlobal, IRInstr::kNoValue,
+           std::vector<intptr_t>(1, val), globalIx);
+    }
+    return emitConst(Object::newVoid());
+  }
+  else if (head == module->symBegin && len >= 2) {
+    return lowerBody(xs, 1, isTail);
+  }
+  else if (head == module->symQuote && len == 2) {
+    return emitConst(Object::newImmortal(Util::arrayAt(xs, 1)));
+  }
+  else if (head == module->symLet && len >= 3) {
+    return lowerLet(xs, isTail);
+  }
+  else if (head == module->symLambda) {
+    failed = true;
+    return emitConst(Object::newVoid());
+  }
+
+  intptr_t result = lowerPrimOp(xs, isTail);
+  if (result != -1) {
+    return result;
+  }
+  return lowerCall(xs, isTail);
+}
+
+intptr_t IRBuilder::lowerBody(const Handle &xs, intptr_t start,
+                              bool isTail) {
+  intptr_t len = Util::arrayLength(xs), result = -1;
+  for (intptr_t i = start; i < len; ++i) {
+    result = lower(Util::arrayAt(xs, i), isTail && i == len - 1);
+  }
+  if (result == -1) {
+    failed = true;
+    result = emitConst(Object::newVoid());
+  }
+  return result;
+}
+
+intptr_t IRBuilder::lowerIf(const Handle &xs, bool isTail) {
+  intptr_t cond = lower(Util::arrayAt(xs, 1), false);
+  intptr_t thenBlock = ir->newBlock(),
+           elseBlock = ir->newBlock();
+  emit(IRInstr::kBranch, IRInstr::kNoValue,
+       std::vector<intptr_t>(1, cond));
+  ir->addEdge(current, thenBlock);
+  ir->addEdge(current, elseBlock);
+
+  std::vector<intptr_t> envAtCond = env;
+
+  current = thenBlock;
+  intptr_t thenVal = lower(Util::arrayAt(xs, 2), isTail);
+  intptr_t thenEnd = current;
+  std::vector<intptr_t> thenEnv = env;
+
+  env = envAtCond;
+  current = elseBlock;
+  intptr_t elseVal = lower(Util::arrayAt(xs, 3), isTail);
+  intptr_t elseEnd = current;
+
+  // Jumps from the branches that end with a terminator are in unreachable
+  // blocks, and so are removed together with their phi inputs.
+  intptr_t join = ir->newBlock();
+  current = thenEnd;
+  emit(IRInstr::kJump, IRInstr::kNoValue);
+  ir->addEdge(thenEnd, join);
+  current = elseEnd;
+  emit(IRInstr::kJump, IRInstr::kNoValue);
+  ir->addEdge(elseEnd, join);
+
+  current = join;
+  std::vector<intptr_t> inputs(2);
+  for (size_t i = 0; i < env.size(); ++i) {
+    if (thenEnv[i] == env[i]) {
+      continue;
+    }
+    inputs[0] = thenEnv[i] == -1 ? kUndefined : thenEnv[i];
+    inputs[1] = env[i] == -1 ? kUndefined : env[i];
+    env[i] = emit(IRInstr::kPhi, IRInstr::kTagged, inputs);
+  }
+
+  inputs[0] = thenVal;
+  inputs[1] = elseVal;
+  return emit(IRInstr::kPhi, IRInstr::kTagged, inputs);
+}
+
+intptr_t IRBuilder::lowerLet(const Handle &xs, bool isTail) {
+  for (Handle iter = Util::arrayAt(xs, 1); iter->isPair();
+       iter = iter->raw()->cdr()) {
+    Handle binding = iter->raw()->car();
+    Handle name = binding->raw()->car();
+    intptr_t val = lower(binding->raw()->cdr()->raw()->car(), false);
+    env[lookupVar(name)] = val;
+  }
+  return lowerBody(xs, 2, isTail);
+}
+
+intptr_t IRBuilder::lowerCall(const Handle &xs, bool isTail) {
+  intptr_t argc = Util::arrayLength(xs) - 1;
+  if (argc > 5) {
+    failed = true;
+    return emitConst(Object::newVoid());
+  }
+
+  Handle head = Util::arrayAt(xs, 0);
+  CGFunction *callee = NULL;
+  if (head->isSymbol()) {
+    intptr_t ix = lookupVar(head);
+    if (ix == -1 || env[ix] == -1) {
+      callee = module->lookupKnownFunction(head);
+    }
+  }
+  if (callee && callee->arity != argc) {
+    callee = NULL;
+  }
+
+  std::vector<intptr_t> args;
+  if (!callee) {
+    args.push_back(lower(head, false));
+  }
+  for (intptr_t i = 1; i <= argc; ++i) {
+    args.push_back(lower(Util::arrayAt(xs, i), false));
+  }
+
+  if (callee == func && isTail) {
+    // The loop's back edge.
+    std::vector<intptr_t> &phis = ir->block(IRFunction::kHeader).instrs;
+    for (intptr_t i = 0; i < argc; ++i) {
+      ir->instr(phis[i]).args.push_back(args[i]);
+    }
+    emit(IRInstr::kJump, IRInstr::kNoValue);
+    ir->addEdge(current, IRFunction::kHeader);
+    current = ir->newBlock();
+    return emitConst(Object::newVoid());
+  }
+  else if (isTail) {
+    terminate(callee ? IRInstr::kTailCallKnown : IRInstr::kTailCall,
+              args, callee);
+    return emitConst(Object::newVoid());
+  }
+
+  intptr_t result = emit(callee ? IRInstr::kCallKnown : IRInstr::kCall,
+                         IRInstr::kTagged, args);
+  ir->instr(result).callee = callee;
+  return result;
+}
+
+intptr_t IRBuilder::lowerPrimOp(const Handle &xs, bool isTail) {
+  intptr_t len = Util::arrayLength(xs);
+  Handle opName = Util::arrayAt(xs, 0);
+
+  std::vector<intptr_t> args;
+  auto lowerArgs = [&]() {
+    for (intptr_t i = 1; i < len; ++i) {
+      args.push_back(lower(Util::arrayAt(xs, i), false));
+    }
+  };
+
+  if (opName == module->symPrimAdd && len == 3) {
+    lowerArgs();
+    return emit(IRInstr::kAdd, IRInstr::kTagged, args);
+  }
+  else if (opName == module->symPrimSub && len == 3) {
+    lowerArgs();
+    return emit(IRInstr::kSub, IRInstr::kTagged, args);
+  }
+  else if (opName == module->symPrimLt && len == 3) {
+    lowerArgs();
+    intptr_t flag = emit(IRInstr::kLt, IRInstr::kFlag, args);
+    return emit(IRInstr::kBool, IRInstr::kTagged,
+                std::vector<intptr_t>(1, flag));
+  }
+  else if (opName == module->symPrimCons && len == 3) {
+    lowerArgs();
+    return emit(IRInstr::kCons, IRInstr::kTagged, args);
+  }
+  else if (opName == module->symPrimMakeClosure && len >= 2) {
+    // (make-closure# f v ...)
+    for (intptr_t i = 2; i < len; ++i) {
+      args.push_back(lower(Util::arrayAt(xs, i), false));
+    }
+    intptr_t result = emit(IRInstr::kMakeClosure, IRInstr::kTagged, args);
+    ir->instr(result).callee =
+        module->lookupKnownFunction(Util::arrayAt(xs, 1));
+    return result;
+  }
+  else if (opName == module->symPrimClosureRef && len == 2) {
+    intptr_t self = emit(IRInstr::kThisClosure, IRInstr::kTagged);
+    return emit(IRInstr::kLoad, IRInstr::kTagged,
+                std::vector<intptr_t>(1, self),
+                RawObject::kCloPayloadOffset - RawObject::kClosureTag +
+                kPtrSize * Util::arrayAt(xs, 1)->fromFixnum());
+  }
+  else if (opName == module->symPrimThisClosure && len == 1) {
+    return emit(IRInstr::kThisClosure, IRInstr::kTagged);
+  }
+
+#define MK_IMPL(_unused, klsName, attrName)                             \
+  else if (opName == module->symPrim ## attrName && len == 2) {         \
+    lowerArgs();                                                        \
+    return emit(IRInstr::kLoad, IRInstr::kTagged, args,                 \
+                RawObject::k ## attrName ## Offset -                    \
+                RawObject::k ## klsName ## Tag);                        \
+  }
+PRIM_ATTR_ACCESSORS(MK_IMPL)
+#undef MK_IMPL
+
+#define MK_IMPL(_unused, typeName)                                      \
+  else if (opName == module->symPrim ## typeName ## p && len == 2) {    \
+    lowerArgs();                                                        \
+    intptr_t flag = emit(IRInstr::kTagIs, IRInstr::kFlag, args,         \
+                         RawObject::k ## typeName ## Tag);              \
+    return emit(IRInstr::kBool, IRInstr::kTagged,                       \
+                std::vector<intptr_t>(1, flag));                        \
+  }
+PRIM_TAG_PREDICATES(MK_IMPL)
+#undef MK_IMPL
+
+#define MK_IMPL(_unused, objName)                                       \
+  else if (opName == module->symPrim ## objName ## p && len == 2) {     \
+    lowerArgs();                                                        \
+    intptr_t flag = emit(IRInstr::kIsConst, IRInstr::kFlag, args,       \
+                         ir->addConst(Object::new ## objName()));       \
+    return emit(IRInstr::kBool, IRInstr::kTagged,                       \
+                std::vector<intptr_t>(1, flag));                        \
+  }
+PRIM_SINGLETON_PREDICATES(MK_IMPL)
+#undef MK_IMPL
+
+  else if (opName == module->symPrimTrace && len == 3) {
+    args.push_back(lower(Util::arrayAt(xs, 1), false));
+    emit(IRInstr::kTrace, IRInstr::kNoValue, args);
+    return lower(Util::arrayAt(xs, 2), isTail);
+  }
+  else if (opName == module->symPrimDisplay && len == 2) {
+    lowerArgs();
+    emit(IRInstr::kDisplay, IRInstr::kNoValue, args);
+    return emitConst(Object::newVoid());
+  }
+  else if (opName == module->symPrimNewLine && len == 1) {
+    emit(IRInstr::kNewLine, IRInstr::kNoValue);
+    return emitConst(Object::newVoid());
+  }
+  else if (opName == module->symPrimError && len == 2) {
+    lowerArgs();
+    terminate(IRInstr::kError, args);
+    return emitConst(Object::newVoid());
+  }
+  return -1;
+}
+
+intptr_t IRBuilder::lowerVar(const Handle &name) {
+  intptr_t ix = lookupVar(name);
+  if (ix != -1 && env[ix] != -1) {
+    return env[ix];
+  }
+
+  intptr_t globalIx = module->lookupGlobal(name);
+  if (globalIx == -1) {
+    // Let the frame-based compiler report it.
+    failed = true;
+    return emitConst(Object::newVoid());
+  }
+  intptr_t val = emit(IRInstr::kLoadGlobal, IRInstr::kTagged,
+                      std::vector<intptr_t>(), globalIx);
+  ir->instr(val).callee = module->lookupKnownFunction(name);
+  return val;
+}
+
+intptr_t IRBuilder::emit(IRInstr::Opcode op, IRInstr::Type type,
+                         const std::vector<intptr_t> &args,
+                         intptr_t aux) {
+  return ir->emit(current, op, type, args, aux);
+}
+
+intptr_t IRBuilder::emitConst(const Handle &x) {
+  return emit(IRInstr::kConst, IRInstr::kTagged, std::vector<intptr_t>(),
+              ir->addConst(x));
+}
+
+void IRBuilder::terminate(IRInstr::Opcode op,
+                          const std::vector<intptr_t> &args,
+                          CGFunction *callee) {
+  intptr_t i = emit(op, IRInstr::kNoValue, args);
+  ir->instr(i).callee = callee;
+  current = ir->newBlock();
+}
+
+intptr_t IRBuilder::lookupVar(const Handle &name) {
+  for (intptr_t i = 0, len = Util::arrayLength(vars); i < len; ++i) {
+    if (Util::arrayAt(vars, i) == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void IRBuilder::collectVars(const Handle &expr) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote ||
+      expr->raw()->car() == module->symLambda) {
+    return;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  Handle head = Util::arrayAt(xs, 0);
+  if (head == module->symDefine && Util::arrayLength(xs) == 3 &&
+      lookupVar(Util::arrayAt(xs, 1)) == -1) {
+    Util::arrayAppend(vars, Util::arrayAt(xs, 1));
+  }
+  else if (head == module->symLet && Util::arrayLength(xs) >= 2) {
+    for (Handle iter = Util::arrayAt(xs, 1); iter->isPair();
+         iter = iter->raw()->cdr()) {
+      Handle name = iter->raw()->car()->raw()->car();
+      if (lookupVar(name) == -1) {
+        Util::arrayAppend(vars, name);
+      }
+    }
+  }
+
+  for (intptr_t i = 0; i < Util::arrayLength(xs); ++i) {
+    collectVars(Util::arrayAt(xs, i));
+  }
+}
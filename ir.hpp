@@ -0,0 +1,187 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <vector>
+
+#include "gc.hpp"
+#include "object.hpp"
+#include "util.hpp"
+
+class CGModule;
+class CGFunction;
+
+// SSA intermediate representation between the s-expressions and the
+// assembler. @See CODEGEN_NOTES.md
+
+#define IR_OPCODES(V)                                                   \
+  /* Values */                                                          \
+  V(Const)         /* aux: index into consts */                         \
+  V(Arg)           /* aux: argument index */                            \
+  V(Phi)           /* one input per predecessor */                      \
+  V(LoadGlobal)    /* aux: global index. callee: set if never changes */\
+  V(StoreGlobal)   /* (val), aux: global index */                       \
+  V(Add)           /* (lhs rhs), tagged fixnums */                      \
+  V(Sub)                                                                \
+  V(Lt)            /* (lhs rhs) -> flag */                              \
+  V(TagIs)         /* (val) -> flag, aux: tag */                        \
+  V(IsConst)       /* (val) -> flag, aux: index into consts */          \
+  V(Bool)          /* (flag) -> #t or #f */                             \
+  V(Load)          /* (ptr), aux: offset, includes the tag */           \
+  V(Cons)          /* (car cdr) */                                      \
+  V(MakeClosure)   /* (payload...), callee: the function */             \
+  V(ThisClosure)                                                        \
+  V(Call)          /* (closure args...) */                              \
+  V(CallKnown)     /* (args...), callee */                              \
+  V(Display)       /* (val) */                                          \
+  V(NewLine)                                                            \
+  V(Trace)         /* (val) */                                          \
+  /* Terminators */                                                     \
+  V(Jump)                                                               \
+  V(Branch)        /* (cond), to succs[0] unless cond is #f */          \
+  V(Return)        /* (val) */                                          \
+  V(TailCall)      /* (closure args...) */                              \
+  V(TailCallKnown) /* (args...), callee */                              \
+  V(Error)         /* (val) */
+
+struct IRInstr {
+  enum Opcode {
+#define MK_ENUM(name) k ## name,
+    IR_OPCODES(MK_ENUM)
+#undef MK_ENUM
+    kNumOpcodes
+  };
+
+  enum Type {
+    // Scheme object, seen by the gc
+    kTagged,
+    // Condition flags, consumed by the next instruction
+    kFlag,
+    // Produces nothing
+    kNoValue
+  };
+
+  Opcode op;
+  Type type;
+  intptr_t block;
+  std::vector<intptr_t> args;
+  intptr_t aux;
+  CGFunction *callee;
+  bool dead;
+
+  // Same args give the same result, so they can be shared.
+  bool isPure() const;
+  // Can be removed if nobody uses the result.
+  bool isRemovable() const;
+  bool isTerminator() const;
+  // Clobbers the registers. Also a gc point for Call, CallKnown, Cons and
+  // MakeClosure.
+  bool isCall() const;
+  const char *name() const;
+};
+
+struct IRBlock {
+  std::vector<intptr_t> instrs;
+  std::vector<intptr_t> preds, succs;
+  bool dead;
+};
+
+class IRFunction {
+ public:
+  IRFunction(CGFunction *owner);
+
+  intptr_t newBlock();
+  intptr_t emit(intptr_t block, IRInstr::Opcode op, IRInstr::Type type,
+                const std::vector<intptr_t> &args = std::vector<intptr_t>(),
+                intptr_t aux = 0);
+  // Makes `to` a successor of `from`.
+  void addEdge(intptr_t from, intptr_t to);
+  intptr_t addConst(const Handle &x);
+
+  IRInstr &instr(intptr_t i) { return instrs[i]; }
+  IRBlock &block(intptr_t i) { return blocks[i]; }
+  intptr_t numInstrs() const { return instrs.size(); }
+  intptr_t numBlocks() const { return blocks.size(); }
+  Object *constAt(intptr_t i) { return Util::arrayAt(consts, i); }
+  intptr_t terminatorOf(intptr_t b) { return blocks[b].instrs.back(); }
+
+  // Optimizations. Each of them keeps the function in SSA form.
+  void removeUnreachable();
+  void removeTrivialPhis();
+  void eliminateCommonSubexprs();
+  // car# and cdr# of a cons in this function use its operands instead,
+  // and those of a quoted pair become constants. A cons that is then
+  // unused never escaped, and is left to DCE.
+  void scalarReplaceConses();
+  void eliminateDeadCode();
+  void hoistGlobalLoads();
+  void optimize();
+
+  void replaceUses(intptr_t from, intptr_t to);
+  // Reachable blocks, then-branches first. Also used as the code layout.
+  std::vector<intptr_t> reversePostorder();
+  // Immediate dominators, indexed by block. The entry's is itself.
+  std::vector<intptr_t> computeDominators();
+
+  void display(int fd = 2);
+
+  // Entry jumps to header. Self tail calls jump to header as well.
+  enum { kEntry = 0, kHeader = 1 };
+
+ private:
+  CGFunction *owner;
+  std::vector<IRInstr> instrs;
+  std::vector<IRBlock> blocks;
+
+  // Growable array of the objects used by kConst.
+  Handle consts;
+
+  friend class IRBuilder;
+  friend class IRGen;
+};
+
+// Lowers the body of a CGFunction.
+class IRBuilder {
+ public:
+  IRBuilder(CGFunction *f, IRFunction *ir);
+
+  // False if the body uses something that we don't handle. The caller
+  // should compile it without the ir then.
+  bool build();
+
+ private:
+  intptr_t lower(const Handle &expr, bool isTail);
+  intptr_t lowerBody(const Handle &xs, intptr_t start, bool isTail);
+  intptr_t lowerIf(const Handle &xs, bool isTail);
+  intptr_t lowerLet(const Handle &xs, bool isTail);
+  intptr_t lowerCall(const Handle &xs, bool isTail);
+  // -1 if xs is not a primitive.
+  intptr_t lowerPrimOp(const Handle &xs, bool isTail);
+  intptr_t lowerVar(const Handle &name);
+
+  intptr_t emit(IRInstr::Opcode op, IRInstr::Type type,
+                const std::vector<intptr_t> &args = std::vector<intptr_t>(),
+                intptr_t aux = 0);
+  intptr_t emitConst(const Handle &x);
+  // Ends the current block. Code after it goes to an unreachable block.
+  void terminate(IRInstr::Opcode op, const std::vector<intptr_t> &args,
+                 CGFunction *callee = NULL);
+
+  intptr_t lookupVar(const Handle &name);
+  void collectVars(const Handle &expr);
+
+  CGFunction *func;
+  CGModule *module;
+  IRFunction *ir;
+  intptr_t current;
+  bool failed;
+
+  // Growable array of local names
+  Handle vars;
+  // Indexed as vars. The current ssa value of each local, or -1 if the
+  // name is not defined yet and so refers to the global.
+  std::vector<intptr_t> env;
+  // Undefined phi inputs: locals that are defined in only one branch.
+  enum { kUndefined = -2 };
+};
+
+#endif
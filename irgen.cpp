@@ -0,0 +1,1075 @@
+#include <assert.h>
+
+#include <algorithm>
+
+#include "irgen.hpp"
+#include "codegen2.hpp"
+#include "runtime.hpp"
+
+using namespace AsmJit;
+
+// The allocatable registers, callee-saved ones in the C ABI first so that
+// they are tried first. %rax is only used by parallel moves.
+static const GpReg kRegs[11] = {
+  rbx, r15, rbp, rsi, rdx, rcx, r8, r9, rdi, r10, rax
+};
+static const intptr_t kNumAllocRegs = 10,
+                      kNumCalleeSavedRegs = 3,
+                      kRaxIx = 10;
+// Indices into kRegs of kArgRegsWithClosure.
+static const intptr_t kArgRegIxs[6] = { 8, 3, 4, 5, 6, 7 };
+
+static bool isSameReg(const GpReg &a, const GpReg &b) {
+  return a.getRegCode() == b.getRegCode();
+}
+
+// Short-hand
+#define __ xasm.
+
+IRGen::IRGen(CGFunction *f, IRFunction *ir)
+  : cgf(f)
+  , ir(ir)
+  , xasm(f->xasm)
+  , numSlots(0)
+  , frameSize(0)
+{ }
+
+bool IRGen::allocate() {
+  layout = ir->reversePostorder();
+  findFusedBools();
+  findAllocGroups();
+  computeLiveness();
+  if (!assignRegisters()) {
+    return false;
+  }
+  assignSlots();
+  return true;
+}
+
+void IRGen::findFusedBools() {
+  intptr_t numValues = ir->numInstrs();
+  std::vector<intptr_t> numUses(numValues, 0);
+  for (intptr_t i = 0; i < numValues; ++i) {
+    if (!ir->instr(i).dead) {
+      for (auto arg : ir->instr(i).args) {
+        ++numUses[arg];
+      }
+    }
+  }
+
+  // Flag, Bool and Branch have to be next to each other, so that the
+  // flag's operands are still live at the branch.
+  fused.assign(numValues, false);
+  for (auto b : layout) {
+    std::vector<intptr_t> is;
+    for (auto i : ir->block(b).instrs) {
+      if (!ir->instr(i).dead) {
+        is.push_back(i);
+      }
+    }
+    intptr_t n = is.size();
+    if (n < 3) {
+      continue;
+    }
+    const IRInstr &branch = ir->instr(is[n - 1]);
+    intptr_t v = is[n - 2];
+    if (branch.op == IRInstr::kBranch && branch.args[0] == v &&
+        ir->instr(v).op == IRInstr::kBool && numUses[v] == 1 &&
+        ir->instr(v).args[0] == is[n - 3]) {
+      fused[v] = true;
+    }
+  }
+}
+
+void IRGen::findAllocGroups() {
+  // Far less than a nursery, so that a gc always makes enough room.
+  static const intptr_t kMaxAllocGroupSize = 64 * ThreadState::kPairSize;
+  intptr_t numValues = ir->numInstrs();
+  allocSizes.assign(numValues, 0);
+  allocOffsets.assign(numValues, 0);
+
+  std::vector<intptr_t> group;
+  auto endGroup = [&]() {
+    if (!group.empty()) {
+      intptr_t size = allocSizes[group[0]];
+      for (auto i : group) {
+        allocOffsets[i] -= size;
+      }
+      group.clear();
+    }
+  };
+
+  for (auto b : layout) {
+    for (auto i : ir->block(b).instrs) {
+      const IRInstr &instr = ir->instr(i);
+      if (instr.dead) {
+        continue;
+      }
+      if (instr.op == IRInstr::kCons) {
+        if (!group.empty() &&
+            allocSizes[group[0]] + ThreadState::kPairSize >
+                kMaxAllocGroupSize) {
+          endGroup();
+        }
+        intptr_t first = group.empty() ? i : group[0];
+        allocOffsets[i] = allocSizes[first];
+        allocSizes[first] += ThreadState::kPairSize;
+        group.push_back(i);
+      }
+      else if (instr.isCall()) {
+        // The callee may gc, or cons itself.
+        endGroup();
+      }
+    }
+    endGroup();
+  }
+}
+
+bool IRGen::isLeaf() {
+  for (intptr_t i = 0; i < ir->numInstrs(); ++i) {
+    const IRInstr &instr = ir->instr(i);
+    if (instr.dead) {
+      continue;
+    }
+    switch (instr.op) {
+    case IRInstr::kCall:
+    case IRInstr::kCallKnown:
+    case IRInstr::kTailCall:
+    case IRInstr::kTailCallKnown:
+      return false;
+    default:
+      break;
+    }
+  }
+  // A frame this large needs a probe of its own.
+  return frameSize * kPtrSize < kStackProbeDistance / 2;
+}
+
+bool IRGen::isAllocatable(intptr_t v) {
+  if (v < 0) {
+    return false;
+  }
+  const IRInstr &instr = ir->instr(v);
+  return !instr.dead && !fused[v] && instr.op != IRInstr::kConst &&
+         instr.type == IRInstr::kTagged;
+}
+
+intptr_t IRGen::argIndexOf(intptr_t v) {
+  const IRInstr &instr = ir->instr(v);
+  if (instr.op == IRInstr::kArg) {
+    return instr.aux;
+  }
+  else if (instr.op == IRInstr::kPhi && instr.block == IRFunction::kHeader &&
+           ir->instr(instr.args[0]).op == IRInstr::kArg) {
+    // The entry is the first predecessor of the header.
+    return ir->instr(instr.args[0]).aux;
+  }
+  return -1;
+}
+
+void IRGen::computeLiveness() {
+  intptr_t numValues = ir->numInstrs();
+  interference.assign(numValues, std::vector<intptr_t>());
+  liveAcross.assign(numValues, std::vector<intptr_t>());
+
+  // Errors store the current arguments to their home slots, so that the
+  // stack trace shows them. They are live until there.
+  argPhis.clear();
+  for (auto i : ir->block(IRFunction::kHeader).instrs) {
+    if (ir->instr(i).op == IRInstr::kPhi && argIndexOf(i) != -1) {
+      argPhis.push_back(i);
+    }
+  }
+
+  // Walks the block backwards from its live-out set. Phi inputs are used
+  // at the end of the predecessors, not in the block itself.
+  auto transfer = [&](intptr_t b, std::vector<bool> &live, bool record) {
+    const std::vector<intptr_t> &is = ir->block(b).instrs;
+    std::vector<intptr_t> phis;
+
+    for (intptr_t k = is.size() - 1; k >= 0; --k) {
+      intptr_t i = is[k];
+      const IRInstr &instr = ir->instr(i);
+      if (instr.op == IRInstr::kPhi) {
+        phis.push_back(i);
+        continue;
+      }
+
+      if (isAllocatable(i)) {
+        live[i] = false;
+        if (record) {
+          for (intptr_t v = 0; v < numValues; ++v) {
+            if (live[v]) {
+              interference[i].push_back(v);
+              interference[v].push_back(i);
+            }
+          }
+        }
+      }
+
+      // Only the first cons of a group may gc.
+      if (record && instr.isCall() &&
+          (instr.op != IRInstr::kCons || allocSizes[i])) {
+        for (intptr_t v = 0; v < numValues; ++v) {
+          if (live[v]) {
+            liveAcross[i].push_back(v);
+          }
+        }
+        // The gc might move the car and the cdr, or the payload.
+        if (instr.op == IRInstr::kCons ||
+            instr.op == IRInstr::kMakeClosure) {
+          for (auto arg : instr.args) {
+            if (isAllocatable(arg) && !live[arg]) {
+              liveAcross[i].push_back(arg);
+            }
+          }
+        }
+      }
+
+      // A flag is computed together with its user, so the flag's
+      // operands are live until there.
+      for (auto arg : instr.args) {
+        if (isAllocatable(arg)) {
+          live[arg] = true;
+        }
+      }
+      if (instr.op == IRInstr::kError) {
+        for (auto p : argPhis) {
+          live[p] = true;
+        }
+      }
+    }
+
+    // Phis are defined all at once.
+    for (auto p : phis) {
+      if (!record) {
+        continue;
+      }
+      for (intptr_t v = 0; v < numValues; ++v) {
+        if (live[v] && v != p) {
+          interference[p].push_back(v);
+          interference[v].push_back(p);
+        }
+      }
+      for (auto q : phis) {
+        if (q != p) {
+          interference[p].push_back(q);
+        }
+      }
+    }
+    for (auto p : phis) {
+      live[p] = false;
+    }
+  };
+
+  std::vector<std::vector<bool> > liveIn(ir->numBlocks(),
+                                         std::vector<bool>(numValues));
+  std::vector<std::vector<bool> > liveOut = liveIn;
+
+  auto computeLiveOut = [&](intptr_t b) {
+    std::vector<bool> out(numValues, false);
+    for (auto s : ir->block(b).succs) {
+      for (intptr_t v = 0; v < numValues; ++v) {
+        if (liveIn[s][v]) {
+          out[v] = true;
+        }
+      }
+      const IRBlock &succ = ir->block(s);
+      intptr_t predIx = std::find(succ.preds.begin(), succ.preds.end(), b) -
+                        succ.preds.begin();
+      for (auto i : succ.instrs) {
+        const IRInstr &phi = ir->instr(i);
+        if (phi.op == IRInstr::kPhi && isAllocatable(phi.args[predIx])) {
+          out[phi.args[predIx]] = true;
+        }
+      }
+    }
+    return out;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (intptr_t k = layout.size() - 1; k >= 0; --k) {
+      intptr_t b = layout[k];
+      liveOut[b] = computeLiveOut(b);
+      std::vector<bool> live = liveOut[b];
+      transfer(b, live, false);
+      if (live != liveIn[b]) {
+        liveIn[b] = live;
+        changed = true;
+      }
+    }
+  }
+
+  for (auto b : layout) {
+    std::vector<bool> live = liveOut[b];
+    transfer(b, live, true);
+  }
+}
+
+bool IRGen::assignRegisters() {
+  intptr_t numValues = ir->numInstrs();
+  regs.assign(numValues, -1);
+
+  // Values that flow into a phi try to use the phi's register, and call
+  // arguments their argument register, so that the moves go away.
+  std::vector<intptr_t> phiUser(numValues, -1),
+                        argRegHint(numValues, -1);
+  for (intptr_t v = 0; v < numValues; ++v) {
+    const IRInstr &instr = ir->instr(v);
+    if (instr.dead) {
+      continue;
+    }
+    if (instr.op == IRInstr::kPhi) {
+      for (auto arg : instr.args) {
+        if (isAllocatable(arg) && phiUser[arg] == -1) {
+          phiUser[arg] = v;
+        }
+      }
+    }
+    else if (instr.op == IRInstr::kCall || instr.op == IRInstr::kTailCall ||
+             instr.op == IRInstr::kCallKnown ||
+             instr.op == IRInstr::kTailCallKnown) {
+      bool withClosure = !instr.callee;
+      for (size_t k = 0; k < instr.args.size(); ++k) {
+        intptr_t arg = instr.args[k];
+        if (isAllocatable(arg) && argRegHint[arg] == -1) {
+          argRegHint[arg] = kArgRegIxs[k + !withClosure];
+        }
+      }
+    }
+  }
+
+  // Arguments arrive in their registers.
+  for (intptr_t v = 0; v < numValues; ++v) {
+    if (isAllocatable(v) && ir->instr(v).op == IRInstr::kArg) {
+      regs[v] = kArgRegIxs[1 + ir->instr(v).aux];
+    }
+  }
+
+  for (intptr_t v = 0; v < numValues; ++v) {
+    if (!isAllocatable(v) || regs[v] != -1) {
+      continue;
+    }
+
+    intptr_t taken = 0;
+    for (auto u : interference[v]) {
+      if (regs[u] != -1) {
+        taken |= 1 << regs[u];
+      }
+    }
+
+    intptr_t hint = -1;
+    const IRInstr &instr = ir->instr(v);
+    if (argIndexOf(v) != -1) {
+      hint = kArgRegIxs[1 + argIndexOf(v)];
+    }
+    else if (instr.op == IRInstr::kPhi) {
+      for (auto arg : instr.args) {
+        if (isAllocatable(arg) && regs[arg] != -1) {
+          hint = regs[arg];
+          break;
+        }
+      }
+    }
+    else if (phiUser[v] != -1) {
+      hint = regs[phiUser[v]];
+    }
+    else {
+      hint = argRegHint[v];
+    }
+
+    if (hint != -1 && !(taken & (1 << hint))) {
+      regs[v] = hint;
+      continue;
+    }
+    for (intptr_t r = 0; r < kNumAllocRegs; ++r) {
+      if (!(taken & (1 << r))) {
+        regs[v] = r;
+        break;
+      }
+    }
+    if (regs[v] == -1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void IRGen::assignSlots() {
+  intptr_t numValues = ir->numInstrs();
+  slots.assign(numValues, -1);
+
+  std::vector<bool> needsSlot(numValues, false);
+  for (auto &vs : liveAcross) {
+    for (auto v : vs) {
+      needsSlot[v] = true;
+    }
+  }
+
+  // Spill slots are numbered from %rsp. Arguments are saved to their
+  // home slots instead, encoded as -2 - argIndex.
+  for (intptr_t v = 0; v < numValues; ++v) {
+    if (!needsSlot[v]) {
+      continue;
+    }
+
+    std::vector<intptr_t> taken;
+    for (auto u : interference[v]) {
+      if (slots[u] != -1) {
+        taken.push_back(slots[u]);
+      }
+    }
+
+    intptr_t argIx = argIndexOf(v);
+    if (argIx != -1 &&
+        std::find(taken.begin(), taken.end(), -2 - argIx) == taken.end()) {
+      slots[v] = -2 - argIx;
+      continue;
+    }
+    intptr_t s = 0;
+    while (std::find(taken.begin(), taken.end(), s) != taken.end()) {
+      ++s;
+    }
+    slots[v] = s;
+    numSlots = std::max(numSlots, s + 1);
+  }
+
+  frameSize = numSlots + cgf->arity + 1;
+}
+
+intptr_t IRGen::slotOf(intptr_t v) {
+  intptr_t s = slots[v];
+  assert(s != -1);
+  return s >= 0 ? s : argSlot(-2 - s);
+}
+
+const StackMap *IRGen::makeStackMap(intptr_t i) {
+  StackMap map(frameSize);
+  map.setIsPtr(frameSize - 1);
+  for (intptr_t k = 0; k < cgf->arity; ++k) {
+    map.setIsPtr(argSlot(k));
+  }
+  if (i != -1) {
+    for (auto v : liveAcross[i]) {
+      if (ir->instr(v).type == IRInstr::kTagged) {
+        map.setIsPtr(slotOf(v));
+      }
+    }
+  }
+  return StackMap::intern(map);
+}
+
+void IRGen::emitBody() {
+  // The prologue has pushed the closure and the arguments.
+  if (numSlots) {
+    __ sub(rsp, numSlots * kPtrSize);
+  }
+
+  labels.clear();
+  for (intptr_t b = 0; b < ir->numBlocks(); ++b) {
+    labels.push_back(__ newLabel());
+  }
+
+  for (size_t k = 0; k < layout.size(); ++k) {
+    intptr_t b = layout[k];
+    intptr_t next = k + 1 < layout.size() ? layout[k + 1] : -1;
+    __ bind(labels[b]);
+    for (auto i : ir->block(b).instrs) {
+      emitInstr(i, next);
+    }
+  }
+
+  for (auto &cc : callChecks) {
+    // Not a closure(%rdi = func, rsi = threadstate)
+    __ bind(cc.notAClosure);
+    cgf->syncThreadState(cc.map);
+    __ mov(rsi, kThreadState);
+    cgf->callRuntime(reinterpret_cast<void *>(&Runtime::handleNotAClosure));
+
+    // Wrong arg count(%rdi = func, %rsi = actual argc, rdx = threadstate)
+    __ bind(cc.argCountMismatch);
+    cgf->syncThreadState(cc.map);
+    __ mov(rsi, cc.argc);
+    __ mov(rdx, kThreadState);
+    cgf->callRuntime(
+        reinterpret_cast<void *>(&Runtime::handleArgCountMismatch));
+  }
+}
+
+void IRGen::emitInstr(intptr_t i, intptr_t nextBlock) {
+  const IRInstr &instr = ir->instr(i);
+  const std::vector<intptr_t> &args = instr.args;
+  intptr_t imm;
+
+  switch (instr.op) {
+  case IRInstr::kConst:
+  case IRInstr::kArg:
+  case IRInstr::kPhi:
+  // Emitted by their users
+  case IRInstr::kLt:
+  case IRInstr::kTagIs:
+  case IRInstr::kIsConst:
+    break;
+
+  case IRInstr::kLoadGlobal:
+  {
+    const GpReg &dst = regOf(i);
+    cgf->movObject(dst, cgf->parent->moduleGlobalVector);
+    __ mov(dst, qword_ptr(dst, RawObject::kVectorElemOffset -
+                               RawObject::kVectorTag +
+                               kPtrSize * instr.aux));
+    break;
+  }
+
+  case IRInstr::kStoreGlobal:
+  {
+    const GpReg &val = use(args[0], rax);
+    cgf->movObject(kScratchReg, cgf->parent->moduleGlobalVector);
+    __ mov(qword_ptr(kScratchReg, RawObject::kVectorElemOffset -
+                                  RawObject::kVectorTag +
+                                  kPtrSize * instr.aux),
+           val);
+    // Even for a fixnum, which can't be young: an incremental gc may
+    // have copied the vector already.
+    cgf->emitWriteBarrier(kScratchReg, RawObject::kVectorTag);
+    break;
+  }
+
+  case IRInstr::kAdd:
+  {
+    const GpReg &dst = regOf(i);
+    intptr_t constIx =
+        ir->instr(args[1]).op == IRInstr::kConst &&
+        cgf->isSmallFixnum(ir->constAt(ir->instr(args[1]).aux), &imm) ? 1 :
+        ir->instr(args[0]).op == IRInstr::kConst &&
+        cgf->isSmallFixnum(ir->constAt(ir->instr(args[0]).aux), &imm) ? 0 :
+        -1;
+    if (constIx != -1) {
+      // The tags cancel out: add the untagged constant instead.
+      const GpReg &src = use(args[1 - constIx], rax);
+      if (isSameReg(dst, src)) {
+        __ add(dst, imm);
+      }
+      else {
+        __ lea(dst, qword_ptr(src, imm));
+      }
+      break;
+    }
+    // One of the tags has to go.
+    const GpReg &lhs = use(args[0], rax);
+    const GpReg &rhs = use(args[1], kScratchReg);
+    __ lea(dst, qword_ptr(lhs, rhs, 0, -RawObject::kFixnumTag));
+    break;
+  }
+
+  case IRInstr::kSub:
+  {
+    const GpReg &dst = regOf(i);
+    if (ir->instr(args[1]).op == IRInstr::kConst &&
+        cgf->isSmallFixnum(ir->constAt(ir->instr(args[1]).aux), &imm)) {
+      const GpReg &src = use(args[0], rax);
+      if (!isSameReg(dst, src) && -imm == static_cast<int32_t>(-imm)) {
+        __ lea(dst, qword_ptr(src, -imm));
+      }
+      else {
+        moveReg(dst, src);
+        __ sub(dst, imm);
+      }
+      break;
+    }
+    const GpReg &lhs = use(args[0], rax);
+    const GpReg &rhs = use(args[1], kScratchReg);
+    if (isSameReg(dst, rhs) && !isSameReg(lhs, rhs)) {
+      moveReg(rax, lhs);
+      __ sub(rax, rhs);
+      __ add(rax, RawObject::kFixnumTag);
+      __ mov(dst, rax);
+    }
+    else {
+      moveReg(dst, lhs);
+      __ sub(dst, rhs);
+      __ add(dst, RawObject::kFixnumTag);
+    }
+    break;
+  }
+
+  case IRInstr::kBool:
+    emitBool(i);
+    break;
+
+  case IRInstr::kLoad:
+  {
+    const GpReg &dst = regOf(i);
+    const GpReg &ptr = use(args[0], rax);
+    __ mov(dst, qword_ptr(ptr, instr.aux));
+    break;
+  }
+
+  case IRInstr::kCons:
+    emitCons(i);
+    break;
+
+  case IRInstr::kMakeClosure:
+    emitMakeClosure(i);
+    break;
+
+  case IRInstr::kThisClosure:
+    __ mov(regOf(i), qword_ptr(rsp, (frameSize - 1) * kPtrSize));
+    break;
+
+  case IRInstr::kCall:
+  case IRInstr::kCallKnown:
+    emitCall(i);
+    break;
+
+  case IRInstr::kDisplay:
+  case IRInstr::kNewLine:
+  case IRInstr::kTrace:
+    emitCCall(i);
+    break;
+
+  case IRInstr::kJump:
+    emitJump(instr.block, ir->block(instr.block).succs[0], nextBlock);
+    break;
+
+  case IRInstr::kBranch:
+  {
+    const IRBlock &block = ir->block(instr.block);
+    intptr_t thenBlock = block.succs[0],
+             elseBlock = block.succs[1];
+    CondCode cond;
+    if (fused[args[0]]) {
+      cond = emitCompare(ir->instr(args[0]).args[0]);
+    }
+    else {
+      __ cmp(use(args[0], rax), Object::newFalse()->as<intptr_t>());
+      cond = kCondNotEqual;
+    }
+    if (nextBlock == elseBlock) {
+      cgf->jumpIf(cond, labels[thenBlock]);
+    }
+    else {
+      cgf->jumpIf(negateCond(cond), labels[elseBlock]);
+      if (nextBlock != thenBlock) {
+        __ jmp(labels[thenBlock]);
+      }
+    }
+    break;
+  }
+
+  case IRInstr::kReturn:
+    moveReg(rax, use(args[0], rax));
+    __ add(rsp, frameSize * kPtrSize);
+    __ ret();
+    break;
+
+  case IRInstr::kTailCall:
+  case IRInstr::kTailCallKnown:
+    emitTailCall(i);
+    break;
+
+  case IRInstr::kError:
+  {
+    // (error# anything)
+    moveReg(rdi, use(args[0], rdi));
+    for (auto p : argPhis) {
+      __ mov(qword_ptr(rsp, argSlot(argIndexOf(p)) * kPtrSize), regOf(p));
+    }
+    cgf->syncThreadState(makeStackMap(-1));
+    __ mov(rsi, kThreadState);
+    cgf->callRuntime((void *) &Runtime::handleUserError);
+    break;
+  }
+
+  default:
+    assert(0 && "Unknown ir instruction");
+  }
+}
+
+void IRGen::emitBool(intptr_t i) {
+  if (fused[i]) {
+    // The branch emits the compare.
+    return;
+  }
+  // Compares first: dst might be one of the operands.
+  CondCode cond = emitCompare(ir->instr(i).args[0]);
+  const GpReg &dst = regOf(i);
+  __ mov(kScratchReg, Object::newTrue()->as<intptr_t>());
+  __ mov(dst, Object::newFalse()->as<intptr_t>());
+  cgf->cmovIf(cond, dst, kScratchReg);
+}
+
+CondCode IRGen::emitCompare(intptr_t f) {
+  const IRInstr &flag = ir->instr(f);
+  intptr_t imm;
+
+  switch (flag.op) {
+  case IRInstr::kLt:
+    if (isImmediateConst(flag.args[1], &imm)) {
+      __ cmp(use(flag.args[0], rax), imm);
+      return kCondLess;
+    }
+    else if (isImmediateConst(flag.args[0], &imm)) {
+      __ cmp(use(flag.args[1], rax), imm);
+      return kCondGreater;
+    }
+    __ cmp(use(flag.args[0], rax), use(flag.args[1], kScratchReg));
+    return kCondLess;
+
+  case IRInstr::kTagIs:
+    moveReg(rax, use(flag.args[0], rax));
+    __ and_(eax, RawObject::kTagMask);
+    __ cmp(eax, flag.aux);
+    return kCondEqual;
+
+  case IRInstr::kIsConst:
+    __ cmp(use(flag.args[0], rax), ir->constAt(flag.aux)->as<intptr_t>());
+    return kCondEqual;
+
+  default:
+    assert(0 && "Not a flag");
+  }
+}
+
+bool IRGen::isImmediateConst(intptr_t v, intptr_t *imm) {
+  const IRInstr &instr = ir->instr(v);
+  return instr.op == IRInstr::kConst &&
+         cgf->isImmediate(ir->constAt(instr.aux), imm);
+}
+
+void IRGen::emitCons(intptr_t i) {
+  const IRInstr &instr = ir->instr(i);
+  // In the pair nursery, with no header. The first cons of a group bumps
+  // pairPtr for all of them.
+  intptr_t allocSize = allocSizes[i];
+  assert(static_cast<intptr_t>(RawObject::kSizeOfPair) ==
+         ThreadState::kPairSize);
+
+  if (allocSize) {
+    auto labelAllocOk = __ newLabel();
+
+#ifndef kSanyaGCDebug
+    // Try alloc
+    __ lea(kScratchReg, qword_ptr(kPairPtr, allocSize));
+    __ cmp(kScratchReg, kPairLimit);
+    __ jle(labelAllocOk);
+#endif
+
+    // Alloc failed: Do GC. The cars, cdrs and the other live values need
+    // to be visible to (and be updated by) the gc.
+    saveLive(i, false);
+    cgf->syncThreadState(makeStackMap(i));
+    __ mov(rax, allocSize);
+    __ mov(qword_ptr(kThreadState,
+          kPtrSize * ThreadState::kLastAllocReqOffset),
+          rax);
+
+    __ mov(rdi, kThreadState);
+    cgf->callRuntime(reinterpret_cast<void *>(&Runtime::collectAndAlloc));
+    // Extract new pairPtr and pairLimit
+    __ mov(kPairPtr,
+        qword_ptr(kThreadState, kPtrSize * ThreadState::kPairPtrOffset));
+    __ mov(kPairLimit,
+        qword_ptr(kThreadState, kPtrSize * ThreadState::kPairLimitOffset));
+    reloadLive(i, false);
+    // And retry
+    __ lea(kScratchReg, qword_ptr(kPairPtr, allocSize));
+
+    // Alloc ok: write new pairPtr back
+    __ bind(labelAllocOk);
+    __ mov(kPairPtr, kScratchReg);
+  }
+
+  // Fill content
+  intptr_t pair = allocOffsets[i];
+  __ mov(qword_ptr(kPairPtr, pair + RawObject::kCdrOffset),
+         use(instr.args[1], rax));
+  __ mov(qword_ptr(kPairPtr, pair + RawObject::kCarOffset),
+         use(instr.args[0], rax));
+
+  // Tag
+  __ lea(regOf(i), qword_ptr(kPairPtr, pair + RawObject::kPairTag));
+}
+
+void IRGen::emitMakeClosure(intptr_t i) {
+  const IRInstr &instr = ir->instr(i);
+  // In the object nursery. The runtime bumps heapPtr itself, so storing
+  // it again after the slow path changes nothing.
+  intptr_t numPayload = instr.args.size(),
+           size = sizeof(GcHeader) + RawObject::kCloPayloadOffset +
+                  kPtrSize * numPayload;
+  assert(instr.callee && instr.callee->numPayload == numPayload);
+  assert(size < ThreadState::kLargeObjectSize);
+  Mem heapPtr = qword_ptr(kThreadState,
+                          kPtrSize * ThreadState::kHeapPtrOffset);
+  auto labelAllocOk = __ newLabel();
+
+#ifndef kSanyaGCDebug
+  // Try alloc
+  __ mov(kScratchReg, heapPtr);
+  __ lea(rax, qword_ptr(kScratchReg, size));
+  __ cmp(rax, qword_ptr(kThreadState,
+                        kPtrSize * ThreadState::kHeapLimitOffset));
+  __ jbe(labelAllocOk);
+#endif
+
+  // Alloc failed: the payload is updated by the gc as well.
+  saveLive(i, false);
+  cgf->syncThreadState(makeStackMap(i));
+  __ mov(rax, size);
+  __ mov(qword_ptr(kThreadState,
+        kPtrSize * ThreadState::kLastAllocReqOffset),
+        rax);
+  __ mov(rdi, kThreadState);
+  __ mov(rsi, RawObject::kClosureTag);
+  cgf->callRuntime(reinterpret_cast<void *>(&Runtime::allocObject));
+  __ mov(kScratchReg, rax);
+  reloadLive(i, false);
+  __ lea(rax, qword_ptr(kScratchReg, size));
+
+  __ bind(labelAllocOk);
+  __ mov(heapPtr, rax);
+  // The mark is 0.
+  __ mov(rax, size << 32);
+  __ mov(qword_ptr(kScratchReg, 0), rax);
+
+  // The callee may not be compiled yet: its info is in its closure.
+  cgf->movObject(rax, instr.callee->closure);
+  __ mov(rax, qword_ptr(rax, RawObject::kCloInfoOffset -
+                             RawObject::kClosureTag));
+  __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                RawObject::kCloInfoOffset), rax);
+  for (intptr_t k = 0; k < numPayload; ++k) {
+    __ mov(qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                  RawObject::kCloPayloadOffset +
+                                  kPtrSize * k),
+           use(instr.args[k], rax));
+  }
+
+  __ lea(regOf(i), qword_ptr(kScratchReg, sizeof(GcHeader) +
+                                          RawObject::kClosureTag));
+}
+
+void IRGen::emitCall(intptr_t i) {
+  const IRInstr &instr = ir->instr(i);
+  bool isKnown = instr.op == IRInstr::kCallKnown;
+
+  // Saves before the moves: they clobber the registers.
+  saveLive(i, false);
+  moveArgs(instr.args, !isKnown);
+  const StackMap *map = makeStackMap(i);
+
+  if (isKnown) {
+    // The global is never assigned so the closure is a constant.
+    cgf->movObject(kClosureReg, instr.callee->closure);
+
+    // The real target is patched in by patchDirectCalls.
+    CGFunction::DirectCall dc;
+    dc.callee = instr.callee;
+    dc.stub = __ newLabel();
+    __ call(dc.stub);
+    dc.relOffset = __ getOffset() - 4;
+    cgf->directCalls.push_back(dc);
+  }
+  else {
+    emitClosureCheck(instr.args.size() - 1, map);
+    __ call(rax);
+  }
+  cgf->recordStackMap(__ getOffset(), map);
+
+  moveReg(regOf(i), rax);
+  reloadLive(i, false);
+}
+
+void IRGen::emitCCall(intptr_t i) {
+  const IRInstr &instr = ir->instr(i);
+
+  // Only the caller-saved registers are clobbered, and there is no gc.
+  saveLive(i, true);
+  switch (instr.op) {
+  case IRInstr::kTrace:
+    moveReg(rdi, use(instr.args[0], rdi));
+    cgf->callRuntime(reinterpret_cast<void *>(&Runtime::traceObject));
+    break;
+
+  case IRInstr::kDisplay:
+    // Stdout
+    moveReg(rdi, use(instr.args[0], rdi));
+    __ mov(esi, 1);
+    cgf->callRuntime((void *) &Object::displayDetail);
+    break;
+
+  case IRInstr::kNewLine:
+    __ mov(edi, 1);
+    cgf->callRuntime((void *) &Runtime::printNewLine);
+    break;
+
+  default:
+    assert(0);
+  }
+  reloadLive(i, true);
+}
+
+void IRGen::emitTailCall(intptr_t i) {
+  const IRInstr &instr = ir->instr(i);
+  bool isKnown = instr.op == IRInstr::kTailCallKnown;
+
+  moveArgs(instr.args, !isKnown);
+
+  if (isKnown) {
+    cgf->movObject(kClosureReg, instr.callee->closure);
+  }
+  else {
+    emitClosureCheck(instr.args.size() - 1, makeStackMap(-1));
+  }
+
+  __ add(rsp, frameSize * kPtrSize);
+
+  if (isKnown) {
+    CGFunction::DirectCall dc;
+    dc.callee = instr.callee;
+    dc.stub = __ newLabel();
+    __ jmp(dc.stub);
+    dc.relOffset = __ getOffset() - 4;
+    cgf->directCalls.push_back(dc);
+  }
+  else {
+    __ jmp(rax);
+  }
+}
+
+void IRGen::emitJump(intptr_t from, intptr_t to, intptr_t nextBlock) {
+  const IRBlock &succ = ir->block(to);
+  intptr_t predIx = std::find(succ.preds.begin(), succ.preds.end(), from) -
+                    succ.preds.begin();
+
+  std::vector<std::pair<intptr_t, intptr_t> > moves;
+  for (auto i : succ.instrs) {
+    const IRInstr &phi = ir->instr(i);
+    if (phi.op == IRInstr::kPhi) {
+      moves.push_back(std::make_pair(regs[i], phi.args[predIx]));
+    }
+  }
+  moveParallel(moves);
+
+  if (to != nextBlock) {
+    __ jmp(labels[to]);
+  }
+}
+
+void IRGen::emitClosureCheck(intptr_t argc, const StackMap *map) {
+  CallCheck cc;
+  cc.notAClosure = __ newLabel();
+  cc.argCountMismatch = __ newLabel();
+  cc.argc = argc;
+  cc.map = map;
+
+  // Check closure type
+  __ mov(rax, rdi);
+  __ and_(eax, RawObject::kTagMask);
+  __ cmp(eax, RawObject::kClosureTag);
+  __ jne(cc.notAClosure);
+
+  // Check arg count
+  __ mov(rax, qword_ptr(rdi, -RawObject::kClosureTag));
+  __ mov(rax, qword_ptr(rax, RawObject::kFuncArityOffset));
+  __ cmp(rax, argc);
+  __ jne(cc.argCountMismatch);
+
+  // Extract the code pointer
+  __ mov(rax, qword_ptr(rdi, -RawObject::kClosureTag));
+  __ lea(rax, qword_ptr(rax, RawObject::kFuncCodeOffset));
+
+  callChecks.push_back(cc);
+}
+
+void IRGen::moveArgs(const std::vector<intptr_t> &args, bool withClosure) {
+  std::vector<std::pair<intptr_t, intptr_t> > moves;
+  for (size_t k = 0; k < args.size(); ++k) {
+    moves.push_back(std::make_pair(kArgRegIxs[k + !withClosure], args[k]));
+  }
+  moveParallel(moves);
+}
+
+void IRGen::moveParallel(std::vector<std::pair<intptr_t, intptr_t> > moves) {
+  // (dst, src) as register indices. Constants do not read any register,
+  // so they go last.
+  std::vector<std::pair<intptr_t, intptr_t> > regMoves, constMoves;
+  for (auto &m : moves) {
+    if (ir->instr(m.second).op == IRInstr::kConst) {
+      constMoves.push_back(m);
+    }
+    else if (m.first != regs[m.second]) {
+      regMoves.push_back(std::make_pair(m.first, regs[m.second]));
+    }
+  }
+
+  while (!regMoves.empty()) {
+    bool progress = false;
+    for (size_t k = 0; k < regMoves.size(); ++k) {
+      intptr_t dst = regMoves[k].first;
+      bool isRead = false;
+      for (auto &m : regMoves) {
+        isRead |= m.second == dst;
+      }
+      if (!isRead) {
+        __ mov(kRegs[dst], kRegs[regMoves[k].second]);
+        regMoves.erase(regMoves.begin() + k);
+        progress = true;
+        break;
+      }
+    }
+    if (!progress) {
+      // Only cycles are left. Break one by moving its source away.
+      intptr_t src = regMoves[0].second;
+      __ mov(rax, kRegs[src]);
+      for (auto &m : regMoves) {
+        if (m.second == src) {
+          m.second = kRaxIx;
+        }
+      }
+    }
+  }
+
+  for (auto &m : constMoves) {
+    use(m.second, kRegs[m.first]);
+  }
+}
+
+const GpReg &IRGen::use(intptr_t v, const GpReg &scratch) {
+  const IRInstr &instr = ir->instr(v);
+  if (instr.op == IRInstr::kConst) {
+    cgf->movObject(scratch, ir->constAt(instr.aux));
+    return scratch;
+  }
+  return regOf(v);
+}
+
+const GpReg &IRGen::regOf(intptr_t v) {
+  assert(regs[v] != -1);
+  return kRegs[regs[v]];
+}
+
+void IRGen::moveReg(const GpReg &dst, const GpReg &src) {
+  if (!isSameReg(dst, src)) {
+    __ mov(dst, src);
+  }
+}
+
+void IRGen::saveLive(intptr_t i, bool isCCall) {
+  for (auto v : liveAcross[i]) {
+    if (!isCCall || regs[v] >= kNumCalleeSavedRegs) {
+      __ mov(qword_ptr(rsp, slotOf(v) * kPtrSize), regOf(v));
+    }
+  }
+}
+
+void IRGen::reloadLive(intptr_t i, bool isCCall) {
+  for (auto v : liveAcross[i]) {
+    if (!isCCall || regs[v] >= kNumCalleeSavedRegs) {
+      __ mov(regOf(v), qword_ptr(rsp, slotOf(v) * kPtrSize));
+    }
+  }
+}
@@ -0,0 +1,120 @@
+#ifndef IRGEN_HPP
+#define IRGEN_HPP
+
+#include <vector>
+
+#include <asmjit/asmjit.h>
+
+#include "codegen2.hpp"
+#include "gc.hpp"
+#include "ir.hpp"
+
+class CGFunction;
+
+// Emits an IRFunction with its owner's assembler, after the prologue
+// and the stack check that CGFunction::compileFunction emits.
+//
+// Values live in registers. The ones that are live across a call or a
+// gc also get a frame slot, and are saved there only around it. The
+// frame has a fixed size. @See CODEGEN_NOTES.md
+class IRGen {
+ public:
+  IRGen(CGFunction *f, IRFunction *ir);
+
+  // Assigns registers and frame slots. False if we run out of
+  // registers, and the function should be compiled without the ir then.
+  bool allocate();
+  void emitBody();
+  // Makes no Scheme calls, so that the caller's stack probe covers us.
+  bool isLeaf();
+
+ private:
+  // Bools that are only tested by the branch right after them. The
+  // branch jumps on the flags then, and they never get a register.
+  void findFusedBools();
+  // Conses in a block that no call separates share one heap-limit
+  // check, done by the first of them, and so one gc point.
+  void findAllocGroups();
+  // Fills liveAcross and the interference graph.
+  void computeLiveness();
+  bool assignRegisters();
+  void assignSlots();
+
+  void emitInstr(intptr_t i, intptr_t nextBlock);
+  void emitBool(intptr_t i);
+  // Compares the operands of flag f. Returns the condition under which
+  // the flag is set.
+  CondCode emitCompare(intptr_t f);
+  void emitCons(intptr_t i);
+  void emitMakeClosure(intptr_t i);
+  void emitCall(intptr_t i);
+  void emitCCall(intptr_t i);
+  void emitTailCall(intptr_t i);
+  void emitJump(intptr_t from, intptr_t to, intptr_t nextBlock);
+  // Checks that %rdi is a closure taking argc arguments.
+  void emitClosureCheck(intptr_t argc, const StackMap *map);
+
+  // Holds the arguments in kArgRegsWithClosure, with the closure first
+  // if there is one.
+  void moveArgs(const std::vector<intptr_t> &args, bool withClosure);
+  // Parallel moves of values into registers: (register index, value).
+  void moveParallel(std::vector<std::pair<intptr_t, intptr_t> > moves);
+
+  // The register that holds v. Constants are loaded into scratch.
+  const AsmJit::GpReg &use(intptr_t v, const AsmJit::GpReg &scratch);
+  const AsmJit::GpReg &regOf(intptr_t v);
+  void moveReg(const AsmJit::GpReg &dst, const AsmJit::GpReg &src);
+
+  // Saves and reloads the values that live across a call. Only the
+  // caller-saved registers if isCCall.
+  void saveLive(intptr_t i, bool isCCall);
+  void reloadLive(intptr_t i, bool isCCall);
+
+  // Frame slots, in words from %rsp.
+  intptr_t slotOf(intptr_t v);
+  intptr_t argSlot(intptr_t i) { return frameSize - 2 - i; }
+  // Stack map at instruction i. -1 for a point where no values but the
+  // arguments and the closure are live.
+  const StackMap *makeStackMap(intptr_t i);
+
+  // Is a constant that fits in an imm32 as it is.
+  bool isImmediateConst(intptr_t v, intptr_t *imm);
+  // Lives in a register.
+  bool isAllocatable(intptr_t v);
+  // Index of the argument for Args and the header phis that they flow
+  // into. -1 otherwise.
+  intptr_t argIndexOf(intptr_t v);
+
+  CGFunction *cgf;
+  IRFunction *ir;
+  AsmJit::X86Assembler &xasm;
+
+  // Indexed by value
+  std::vector<intptr_t> regs, slots;
+  std::vector<bool> fused;
+  std::vector<std::vector<intptr_t> > interference;
+  // Indexed by instruction: values to save around calls.
+  std::vector<std::vector<intptr_t> > liveAcross;
+  // Indexed by instruction. The bytes that the first cons of a group
+  // reserves (0 for the others), and where each cons's pair is from
+  // pairPtr after that.
+  std::vector<intptr_t> allocSizes, allocOffsets;
+
+  // Header phis of the arguments
+  std::vector<intptr_t> argPhis;
+
+  std::vector<intptr_t> layout;
+  std::vector<AsmJit::Label> labels;
+
+  intptr_t numSlots, frameSize;
+
+  // Calls of unknown closures fail out of line.
+  struct CallCheck {
+    AsmJit::Label notAClosure, argCountMismatch;
+    intptr_t argc;
+    const StackMap *map;
+  };
+  std::vector<CallCheck> callChecks;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -19,7 +20,7 @@ Flags flag;
 
 extern "C" {
   extern Object *Scheme_asmEntry(
-      Object *, void *, intptr_t, intptr_t, ThreadState *);
+      Object *, void *, intptr_t, intptr_t, ThreadState *, intptr_t);
 }
 
 Object *callScheme_0(Object *clo) {
@@ -33,7 +34,20 @@ Object *callScheme_0(Object *clo) {
     Util::logObj("CallScheme", clo);
   }
 
-  return Scheme_asmEntry(clo, entry, ts->heapPtr(), ts->heapLimit(), ts);
+  // Left by an earlier call, whose frames are gone.
+  ts->stackBarrier() = 0;
+
+  // NULL on the errors that the runtime recovers from.
+  jmp_buf errorJmpBuf;
+  if (setjmp(errorJmpBuf)) {
+    ts->errorJmpBuf() = NULL;
+    return NULL;
+  }
+  ts->errorJmpBuf() = &errorJmpBuf;
+  Object *result = Scheme_asmEntry(clo, entry, ts->pairPtr(),
+                                   ts->pairLimit(), ts, ts->stackTop());
+  ts->errorJmpBuf() = NULL;
+  return result;
 }
 
 void readAll(FILE *f, std::string *xs) {
@@ -46,7 +60,9 @@ void readAll(FILE *f, std::string *xs) {
 
 Object *getMainClo(int argc, char **argv) {
   FILE *fin;
-  CGModule cg;
+  // Lives as long as the program: it compiles the functions on their
+  // first calls.
+  CGModule *cg = new CGModule;
   Handle ast;
 
   {
@@ -76,7 +92,7 @@ Object *getMainClo(int argc, char **argv) {
 
   //ast->displayDetail(2);
 
-  Object *mainClo = cg.genModule(ast);
+  Object *mainClo = cg->genModule(ast);
   return mainClo;
   //ThreadState::global().display(2);
 
@@ -89,9 +105,10 @@ int main(int argc, char **argv) {
 
   //ThreadState::global().display(2);
   Option::init();
+  Runtime::installStackOvfHandler();
 
-  callScheme_0(getMainClo(argc, argv));
+  Object *result = callScheme_0(getMainClo(argc, argv));
   ThreadState::global().destroy();
-  return 0;
+  return result ? 0 : 1;
 }
 
@@ -1,6 +1,5 @@
 #include "object.hpp"
 #include "gc.hpp"
-#include <valgrind/memcheck.h>
 
 void Object::printToFd(int fd) {
   RawObject *raw = unTag<RawObject>();
@@ -122,6 +121,54 @@ void Object::displayListDetail(int fd) {
   }
 }
 
+Object *Object::newImmortal(Object *x) {
+  ThreadState &ts = ThreadState::global();
+  if (!x->isHeapAllocated() || ts.isImmortal(x)) {
+    return x;
+  }
+
+  switch (x->getTag()) {
+  case RawObject::kSymbolTag:
+  {
+    size_t len = strlen(x->rawSymbol());
+    RawObject *sym = reinterpret_cast<RawObject *>(
+        ts.gcAllocImmortal(Util::align<3>(len + 1)));
+    memcpy(sym, x->rawSymbol(), len + 1);
+    return sym->tagAsSymbol();
+  }
+
+  case RawObject::kPairTag:
+  {
+    // Along the cdrs, as quoted lists may be long.
+    Object *result;
+    Object **tail = &result;
+    for (; x->isPair() && !ts.isImmortal(x); x = x->raw()->cdr()) {
+      RawObject *pair = reinterpret_cast<RawObject *>(
+          ts.gcAllocImmortalPair());
+      pair->car() = newImmortal(x->raw()->car());
+      *tail = pair->tagAsPair();
+      tail = &pair->cdr();
+    }
+    *tail = newImmortal(x);
+    return result;
+  }
+
+  case RawObject::kVectorTag:
+  {
+    intptr_t len = x->raw()->vectorSize();
+    Object *vec = newImmortalVector(len, newNil());
+    for (intptr_t i = 0; i < len; ++i) {
+      vec->raw()->vectorAt(i) = newImmortal(x->raw()->vectorAt(i));
+    }
+    return vec;
+  }
+
+  default:
+    assert(0 && "Object::newImmortal: not a constant");
+    return x;
+  }
+}
+
 void Object::gcScavenge(ThreadState *ts) {
   switch (getTag()) {
     case RawObject::kPairTag:
@@ -148,39 +195,9 @@ void Object::gcScavenge(ThreadState *ts) {
       for (intptr_t i = 0; i < info->funcNumPayload(); ++i) {
         ts->gcScavenge(payload + i);
       }
-      ts->gcScavenge(&info->funcName());
-      ts->gcScavenge(&info->funcConstOffset());
-
-      // Scavenge const ptrs in code
-      // @See codegen2.cpp
-      //Util::logObj("scavenge code", info->funcConstOffset());
-      intptr_t len = info->funcConstOffset()->raw()->vectorSize();
-      for (intptr_t i = 0; i < len; ++i) {
-        intptr_t offset = info->funcConstOffset()->
-                          raw()->vectorAt(i)->fromFixnum();
-        intptr_t ptrLoc = info->funcCodeAs<intptr_t>() + offset;
-
-        //Object *oldPtrVal = *(Object **) ptrLoc;
-
-        ts->gcScavenge(reinterpret_cast<Object **>(ptrLoc));
-
-        //dprintf(2, "[ScavCodeReloc] %s[%ld] (which is %p) %p => %p ",
-        //        info->funcName()->rawSymbol(),
-        //        offset,
-        //        (void *) ptrLoc,
-        //        *(Object **) ptrLoc,
-        //        oldPtrVal);
-
-        //(*(Object **) ptrLoc)->displayDetail(2);
-        //dprintf(2, "\n");
+      if (!ts->gcDeferCode(this)) {
+        gcScavengeCode(ts);
       }
-
-      // And instructs valgrind to discard out-of-date jitted codes
-      // Must do this since we have changed our code
-      VALGRIND_DISCARD_TRANSLATIONS(
-          info->funcCodeAs<char *>(),
-          info->funcCodeAs<char *>() + info->funcSize() -
-          RawObject::kFuncCodeOffset);
       break;
     }
     case RawObject::kVectorTag:
@@ -196,3 +213,33 @@ void Object::gcScavenge(ThreadState *ts) {
   }
 }
 
+void Object::gcScavengeCode(ThreadState *ts) {
+  // funcName and funcConstOffset are immortal, and so are the constants
+  // that are not in funcConstOffset: @See CGFunction::compileFunction
+  RawObject *info = raw()->cloInfo();
+
+  // Scavenge the constant pool after the code. It is data: the
+  // instructions themselves are never changed.
+  // @See codegen2.cpp
+  //Util::logObj("scavenge code", info->funcConstOffset());
+  intptr_t len = info->funcConstOffset()->raw()->vectorSize();
+  for (intptr_t i = 0; i < len; ++i) {
+    intptr_t offset = info->funcConstOffset()->
+                      raw()->vectorAt(i)->fromFixnum();
+    intptr_t ptrLoc = info->funcCodeAs<intptr_t>() + offset;
+
+    //Object *oldPtrVal = *(Object **) ptrLoc;
+
+    ts->gcScavenge(reinterpret_cast<Object **>(ptrLoc));
+
+    //dprintf(2, "[ScavCodeReloc] %s[%ld] (which is %p) %p => %p ",
+    //        info->funcName()->rawSymbol(),
+    //        offset,
+    //        (void *) ptrLoc,
+    //        *(Object **) ptrLoc,
+    //        oldPtrVal);
+
+    //(*(Object **) ptrLoc)->displayDetail(2);
+    //dprintf(2, "\n");
+  }
+}
@@ -40,7 +40,9 @@ class RawObject : public Base<RawObject> {
 
   enum {
     kTagShift                   = 0x4,
-    kTagMask                    = 0xf,
+    // Objects are 8-byte aligned. Fixnums and singletons still shift
+    // by kTagShift.
+    kTagMask                    = 0x7,
 
     kSizeOfPair                 = 0x10,
     kCarOffset                  = 0x0,
@@ -137,7 +139,8 @@ TAG_LIST(MK_TAG_AS)
 class Object : public Base<Object> {
  public:
   static Object *newPair(const Handle &car, const Handle &cdr) {
-    RawObject *pair = alloc<RawObject>(RawObject::kSizeOfPair);
+    RawObject *pair = RawObject::from(reinterpret_cast<intptr_t>(
+        ThreadState::global().gcAllocPair()));
     pair->car() = car.getPtr();
     pair->cdr() = cdr.getPtr();
     //dprintf(2, "[Object::newPair] %p\n", pair);
@@ -161,18 +164,20 @@ class Object : public Base<Object> {
     else {
       //ThreadState::global().symbolInternTable() = 
 
+      // Lives as long as the table, which is forever.
+      Handle sym = newImmortal(tmp.getPtr());
       Object *newInternTable =
         Util::assocInsert(ThreadState::global().symbolInternTable(),
-            tmp, Object::newNil(), Util::kPtrEq);
+            sym, Object::newNil(), Util::kPtrEq);
       ThreadState::global().symbolInternTable() = newInternTable;
-      return tmp.getPtr();
+      return sym.getPtr();
     }
   }
 
   static Object *newSymbolFromC(const char *src) {
     RawObject *raw;
     size_t len = strlen(src);
-    raw = alloc<RawObject>(Util::align<RawObject::kTagShift>(len + 1));
+    raw = alloc<RawObject>(Util::align<3>(len + 1));
     memcpy(raw, src, len + 1);
     return raw->tagAsSymbol();
   }
@@ -208,32 +213,58 @@ SINGLETONS(CHECK_SINGLETON)
     return func;
   }
 
-  static Object *newClosure(RawObject *info) {
-    size_t size;
-
+  // Without info, a function's own closure, made before its code. The
+  // payload is nil until (make-closure# ...) copies it.
+  static Object *newClosure(RawObject *info, intptr_t numPayload = 0) {
     if (info) {
-      size = sizeof(Object *) * (1 + info->funcNumPayload());
-    }
-    else {
-      // No info, should be a supercombinator
-      size = sizeof(Object *);
+      numPayload = info->funcNumPayload();
     }
+    size_t size = sizeof(Object *) * (1 + numPayload);
 
-    size = Util::align<4>(size);
-   
     RawObject *clo = alloc<RawObject>(size);
     clo->cloInfo() = info;
+    for (intptr_t i = 0; i < numPayload; ++i) {
+      clo->cloPayload()[i] = newNil();
+    }
     return clo->tagAsClosure();
   }
 
   static Object *newVector(intptr_t size, Object *fill) {
-    size_t actualSize = Util::align<4>(sizeof(Object *) * (1 + size));
-    RawObject *vector = alloc<RawObject>(actualSize);
+    size_t actualSize = sizeof(Object *) * (1 + size);
+    return initVector(alloc<RawObject>(actualSize), size, fill);
+  }
+
+  // Never moved by the gc, so &vectorElem() can be handed to C code for
+  // as long as the vector is alive.
+  static Object *newPinnedVector(intptr_t size, Object *fill) {
+    size_t actualSize = sizeof(Object *) * (1 + size);
+    return initVector(reinterpret_cast<RawObject *>(
+        ThreadState::global().gcAllocLarge(actualSize)), size, fill);
+  }
+
+  static Object *newImmortalVector(intptr_t size, Object *fill) {
+    size_t actualSize = sizeof(Object *) * (1 + size);
+    return initVector(reinterpret_cast<RawObject *>(
+        ThreadState::global().gcAllocImmortal(actualSize)), size, fill);
+  }
+
+  // A copy of a constant (pairs, symbols and vectors of them) in the
+  // immortal space, or the constant itself if it is there already or
+  // not in the heap. Never gcs.
+  static Object *newImmortal(Object *x);
+
+  static Object *initVector(RawObject *vector, intptr_t size,
+                            Object *fill) {
     vector->vectorSize() = size;
     for (intptr_t i = 0; i < size; ++i) {
       vector->vectorAt(i) = fill;
     }
-    return vector->tagAsVector();
+    Object *result = vector->tagAsVector();
+    if (GcHeader::fromRawObject(vector)->markAt<GcHeader::kLarge>()) {
+      // Old from the start: filling it was a store into it.
+      ThreadState::global().gcRemember(result);
+    }
+    return result;
   }
 
   // Not allocated from the scheme heap
@@ -278,12 +309,13 @@ SINGLETONS(CHECK_SINGLETON)
   }
 
   RawObject::Tag getTag() {
-    return (RawObject::Tag) (as<intptr_t>() & 0xf);
+    return (RawObject::Tag) (as<intptr_t>() & RawObject::kTagMask);
   }
 
   template <typename T>
   T *unTag() {
-    return reinterpret_cast<T *>(as<intptr_t>() & ~0xfUL);
+    return reinterpret_cast<T *>(as<intptr_t>() &
+                                 ~static_cast<intptr_t>(RawObject::kTagMask));
   }
 
   RawObject *raw() {
@@ -311,6 +343,8 @@ SINGLETONS(CHECK_SINGLETON)
 
   // Gc support
   void gcScavenge(ThreadState *);
+  // The constants in a closure's code, and its info.
+  void gcScavengeCode(ThreadState *);
 };
 
 #endif
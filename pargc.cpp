@@ -0,0 +1,362 @@
+#include <string.h>
+
+#include <thread>
+
+#include "pargc.hpp"
+#include "object.hpp"
+#include "runtime.hpp"
+
+GcWorkDeque::Buffer::Buffer(intptr_t size)
+  : size(size)
+  , items(size)
+{ }
+
+GcWorkDeque::GcWorkDeque()
+  : top(0)
+  , bottom(0)
+  , buffer(new Buffer(1024))
+{ }
+
+GcWorkDeque::~GcWorkDeque() {
+  reset();
+  delete buffer.load();
+}
+
+void GcWorkDeque::push(Object *copy) {
+  intptr_t b = bottom.load(std::memory_order_relaxed),
+           t = top.load(std::memory_order_acquire);
+  if (b - t > buffer.load(std::memory_order_relaxed)->size - 1) {
+    grow(t, b);
+  }
+  buffer.load(std::memory_order_relaxed)->put(b, copy);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+Object *GcWorkDeque::take() {
+  intptr_t b = bottom.load(std::memory_order_relaxed) - 1;
+  Buffer *a = buffer.load(std::memory_order_relaxed);
+  bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  intptr_t t = top.load(std::memory_order_relaxed);
+
+  if (t > b) {
+    // Empty
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return NULL;
+  }
+
+  Object *copy = a->get(b);
+  if (t == b) {
+    // The last one: races with the thieves.
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      copy = NULL;
+    }
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+  return copy;
+}
+
+Object *GcWorkDeque::steal() {
+  intptr_t t = top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  intptr_t b = bottom.load(std::memory_order_acquire);
+
+  if (t >= b) {
+    return NULL;
+  }
+  Object *copy = buffer.load(std::memory_order_acquire)->get(t);
+  if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                   std::memory_order_relaxed)) {
+    return NULL;
+  }
+  return copy;
+}
+
+bool GcWorkDeque::isEmpty() const {
+  return bottom.load(std::memory_order_relaxed) <=
+         top.load(std::memory_order_relaxed);
+}
+
+void GcWorkDeque::reset() {
+  top = bottom = 0;
+  for (auto old : retired) {
+    delete old;
+  }
+  retired.clear();
+}
+
+void GcWorkDeque::grow(intptr_t t, intptr_t b) {
+  Buffer *old = buffer.load(std::memory_order_relaxed);
+  Buffer *a = new Buffer(old->size * 2);
+  for (intptr_t i = t; i < b; ++i) {
+    a->put(i, old->get(i));
+  }
+  retired.push_back(old);
+  buffer.store(a, std::memory_order_release);
+}
+
+static thread_local GcWorker *currentWorker = NULL;
+
+GcWorker::GcWorker(ParallelGc *gc, intptr_t id)
+  : gc(gc)
+  , id(id)
+  , chunkPtr(0)
+  , chunkLimit(0)
+  , pairChunkPtr(0)
+  , pairChunkLimit(0)
+{ }
+
+GcWorker *GcWorker::current() {
+  return currentWorker;
+}
+
+void GcWorker::scavenge(Object **loc) {
+  Object *ptr = *loc;
+  if (ptr->isPair()) {
+    scavengePair(loc);
+    return;
+  }
+  RawObject::Tag ptrTag = ptr->getTag();
+  GcHeader *h = GcHeader::fromRawObject(ptr->raw());
+
+  if (gc->ts->isInToSpace(h)) {
+    return;
+  }
+
+  GcHeader seen;
+  seen.word = __atomic_load_n(&h->word, __ATOMIC_ACQUIRE);
+  GcHeader *newH;
+  if (seen.markAt<GcHeader::kLarge>()) {
+    // Not copied: the worker that marks it scans it.
+    uint32_t marked = 1U << GcHeader::kMarked;
+    if (!(__atomic_fetch_or(&h->mark, marked, __ATOMIC_ACQ_REL) & marked)) {
+      grey.push(ptr);
+    }
+    return;
+  }
+  else if (seen.markAt<GcHeader::kCopied>()) {
+    newH = seen.copiedTo();
+  }
+  else {
+    // Copy first and then claim it. The workers that lose give their
+    // copy back, which is the last thing in their chunk.
+    GcHeader *copy = allocCopy(seen.size);
+    memcpy(copy, h, seen.size);
+    copy->word = seen.word;
+    copy->setMarkAt<GcHeader::kRemembered, false>();
+    copy->setCopiedTag(ptrTag);
+
+    if (__atomic_compare_exchange_n(&h->word, &seen.word,
+                                    seen.forwardingTo(copy), false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      newH = copy;
+      grey.push(copy->toRawObject()->tagWith(ptrTag));
+    }
+    else {
+      // Only ever changes to a forwarding one.
+      undoCopy(copy);
+      newH = seen.copiedTo();
+    }
+  }
+  *loc = newH->toRawObject()->tagWith(ptrTag);
+}
+
+void GcWorker::scavengePair(Object **loc) {
+  ThreadState *ts = gc->ts;
+  intptr_t pair = reinterpret_cast<intptr_t>((*loc)->raw());
+  if (ts->isPairInToSpace(pair)) {
+    return;
+  }
+
+  // The same race, on the forwarding word instead of a header.
+  Object **forward = ts->pairForwardOf(pair);
+  Object *seen = __atomic_load_n(forward, __ATOMIC_ACQUIRE);
+  if (!seen) {
+    intptr_t copy = allocPairCopy();
+    memcpy(reinterpret_cast<void *>(copy), reinterpret_cast<void *>(pair),
+           ThreadState::kPairSize);
+    Object *tagged = RawObject::from(copy)->tagAsPair();
+
+    if (__atomic_compare_exchange_n(forward, &seen, tagged, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      seen = tagged;
+      grey.push(tagged);
+    }
+    else {
+      pairChunkPtr -= ThreadState::kPairSize;
+    }
+  }
+  *loc = seen;
+}
+
+void GcWorker::work() {
+  currentWorker = this;
+
+  const std::vector<Object **> &roots = *gc->roots;
+  intptr_t numRoots = roots.size(),
+           numWorkers = gc->workers.size();
+  for (intptr_t i = id * numRoots / numWorkers,
+                end = (id + 1) * numRoots / numWorkers; i < end; ++i) {
+    Object *ptr = *roots[i];
+    if (ptr && ptr->isHeapAllocated() && !gc->ts->isImmortal(ptr)) {
+      scavenge(roots[i]);
+    }
+  }
+
+  do {
+    while (Object *copy = grey.take()) {
+      scan(copy);
+    }
+  } while (stealOrFinish());
+
+  currentWorker = NULL;
+}
+
+void GcWorker::scan(Object *copy) {
+  copy->gcScavenge(gc->ts);
+}
+
+bool GcWorker::stealOrFinish() {
+  // Only the workers that are not idle push, so once all of them are,
+  // every deque stays empty.
+  intptr_t numWorkers = gc->workers.size();
+  gc->numIdle.fetch_add(1);
+  while (gc->numIdle.load() < numWorkers) {
+    for (intptr_t i = 1; i < numWorkers; ++i) {
+      GcWorker *victim = gc->workers[(id + i) % numWorkers];
+      if (victim->grey.isEmpty()) {
+        continue;
+      }
+      gc->numIdle.fetch_sub(1);
+      if (Object *copy = victim->grey.steal()) {
+        scan(copy);
+        return true;
+      }
+      gc->numIdle.fetch_add(1);
+    }
+    std::this_thread::yield();
+  }
+  return false;
+}
+
+GcHeader *GcWorker::allocCopy(size_t size) {
+  intptr_t *copyPtr = &gc->ts->heapCopyPtr();
+
+  if (chunkPtr + static_cast<intptr_t>(size) > chunkLimit) {
+    if (size > ParallelGc::kChunkSize / 4) {
+      // Gets its own, so that the chunks stay mostly full.
+      return reinterpret_cast<GcHeader *>(
+          __atomic_fetch_add(copyPtr, size, __ATOMIC_RELAXED));
+    }
+    chunkPtr = __atomic_fetch_add(copyPtr, ParallelGc::kChunkSize,
+                                  __ATOMIC_RELAXED);
+    chunkLimit = chunkPtr + ParallelGc::kChunkSize;
+  }
+
+  GcHeader *h = reinterpret_cast<GcHeader *>(chunkPtr);
+  chunkPtr += size;
+  return h;
+}
+
+void GcWorker::undoCopy(GcHeader *h) {
+  auto raw = reinterpret_cast<intptr_t>(h);
+  if (raw + h->size == chunkPtr) {
+    chunkPtr = raw;
+  }
+}
+
+intptr_t GcWorker::allocPairCopy() {
+  if (pairChunkPtr == pairChunkLimit) {
+    pairChunkPtr = __atomic_fetch_add(&gc->ts->pairCopyPtr(),
+                                      ParallelGc::kChunkSize,
+                                      __ATOMIC_RELAXED);
+    pairChunkLimit = pairChunkPtr + ParallelGc::kChunkSize;
+  }
+  intptr_t copy = pairChunkPtr;
+  pairChunkPtr += ThreadState::kPairSize;
+  return copy;
+}
+
+ParallelGc &ParallelGc::global() {
+  // Never freed: the threads live as long as the process.
+  static ParallelGc *gc = new ParallelGc(Option::global().kGcThreads);
+  return *gc;
+}
+
+ParallelGc::ParallelGc(intptr_t numWorkers)
+  : ts(NULL)
+  , roots(NULL)
+  , numIdle(0)
+  , epoch(0)
+  , numRunning(0)
+{
+  for (intptr_t i = 0; i < numWorkers; ++i) {
+    workers.push_back(new GcWorker(this, i));
+  }
+  // This thread is the first worker.
+  for (intptr_t i = 1; i < numWorkers; ++i) {
+    std::thread(&ParallelGc::threadMain, this, i).detach();
+  }
+}
+
+bool ParallelGc::shouldRun(ThreadState *ts) {
+  intptr_t numWorkers = workers.size(),
+           maxLive = ts->heapCopyPtr() - ts->heapFromSpace() +
+                     ts->heapPtr() - ts->nurseryBase() +
+                     ts->pairCopyPtr() - ts->pairFromSpace() +
+                     ts->pairPtr() - ts->pairNurseryBase();
+  // A chunk is retired with less than a quarter of it left.
+  return numWorkers > 1 &&
+         maxLive >= kMinLiveSize &&
+         ts->heapSize() + ts->heapSize() / 3 + numWorkers * kChunkSize <=
+             ts->heapMaxSize();
+}
+
+void ParallelGc::run(ThreadState *ts, const std::vector<Object **> &roots) {
+  this->ts = ts;
+  this->roots = &roots;
+  numIdle = 0;
+  for (auto worker : workers) {
+    worker->chunkPtr = worker->chunkLimit = 0;
+    worker->pairChunkPtr = worker->pairChunkLimit = 0;
+    worker->grey.reset();
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    ++epoch;
+    numRunning = workers.size() - 1;
+  }
+  wake.notify_all();
+
+  workers[0]->work();
+
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&] { return numRunning == 0; });
+
+  if (Option::global().kLogInfo) {
+    dprintf(2, "[ParallelGc] %ld workers, %ld roots\n",
+            static_cast<intptr_t>(workers.size()),
+            static_cast<intptr_t>(roots.size()));
+  }
+}
+
+void ParallelGc::threadMain(intptr_t id) {
+  intptr_t lastEpoch = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&] { return epoch != lastEpoch; });
+      lastEpoch = epoch;
+    }
+
+    workers[id]->work();
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (--numRunning == 0) {
+      done.notify_one();
+    }
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef PARGC_HPP
+#define PARGC_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "gc.hpp"
+
+class Object;
+
+// Copies that are yet to be scanned. The owner pushes and takes at the
+// bottom, and the other workers steal from the top. Chase-Lev, with the
+// orderings of "Correct and efficient work-stealing for weak memory
+// models" (Le et al, 2013).
+class GcWorkDeque {
+ public:
+  GcWorkDeque();
+  ~GcWorkDeque();
+
+  void push(Object *copy);
+  // NULL if empty.
+  Object *take();
+  // NULL if empty, or if another thief or the owner got there first.
+  Object *steal();
+  bool isEmpty() const;
+
+  // Only when no one is using it.
+  void reset();
+
+ private:
+  struct Buffer {
+    Buffer(intptr_t size);
+    Object *get(intptr_t i) const {
+      return items[i & (size - 1)].load(std::memory_order_relaxed);
+    }
+    void put(intptr_t i, Object *copy) {
+      items[i & (size - 1)].store(copy, std::memory_order_relaxed);
+    }
+
+    intptr_t size;
+    std::vector<std::atomic<Object *> > items;
+  };
+
+  void grow(intptr_t top, intptr_t bottom);
+
+  std::atomic<intptr_t> top, bottom;
+  std::atomic<Buffer *> buffer;
+  // Thieves may still read the old buffers until the gc is over.
+  std::vector<Buffer *> retired;
+};
+
+class ParallelGc;
+
+// One per thread of a parallel major gc. Copies into its own chunks of
+// the to-space, so that only getting a chunk needs an atomic add.
+class GcWorker {
+ public:
+  GcWorker(ParallelGc *gc, intptr_t id);
+
+  // Called by ThreadState::gcScavenge on the threads of a gc, with a
+  // heap object at loc.
+  void scavenge(Object **loc);
+  // This thread's, or NULL outside of a parallel gc.
+  static GcWorker *current();
+
+ private:
+  void work();
+  void scan(Object *copy);
+  // Waits for work to steal. False once every worker is out of work.
+  bool stealOrFinish();
+
+  GcHeader *allocCopy(size_t size);
+  void undoCopy(GcHeader *h);
+  // The pairs get chunks of their own space.
+  void scavengePair(Object **loc);
+  intptr_t allocPairCopy();
+
+  ParallelGc *gc;
+  intptr_t id;
+  intptr_t chunkPtr, chunkLimit;
+  intptr_t pairChunkPtr, pairChunkLimit;
+  GcWorkDeque grey;
+
+  friend class ParallelGc;
+};
+
+// Copies what the roots point to, as gcCollectMajor does, with
+// Option::kGcThreads threads. They are started on the first use and then
+// wait for the next gc. @See CODEGEN_NOTES.md
+class ParallelGc {
+ public:
+  enum {
+    kChunkSize = 32 * 1024,
+    // Below that the threads are not worth waking up.
+    kMinLiveSize = 1024 * 1024
+  };
+
+  static ParallelGc &global();
+
+  // Copies into ts's to-space from heapCopyPtr on. Worker i starts with
+  // the i-th slice of the roots.
+  void run(ThreadState *ts, const std::vector<Object **> &roots);
+
+  // There are other threads, enough to copy, and room in the to-space
+  // for the chunks that the workers leave partly empty.
+  bool shouldRun(ThreadState *ts);
+
+ private:
+  ParallelGc(intptr_t numWorkers);
+  void threadMain(intptr_t id);
+
+  std::vector<GcWorker *> workers;
+
+  ThreadState *ts;
+  const std::vector<Object **> *roots;
+  std::atomic<intptr_t> numIdle;
+
+  // The threads sleep on wake until the epoch changes.
+  std::mutex lock;
+  std::condition_variable wake, done;
+  intptr_t epoch, numRunning;
+
+  friend class GcWorker;
+};
+
+#endif
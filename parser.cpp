@@ -31,6 +31,7 @@ Object *Parser::parseProg(bool *outOk) {
       // since lhs (raw()->cdr()) will be evaluated before rhs (t).
       Handle t = Object::newPair(x, Object::newNil());
       tail->raw()->cdr() = t.getPtr();
+      ThreadState::global().gcWriteBarrier(tail);
       tail = tail->raw()->cdr();
     }
   }
@@ -89,6 +90,7 @@ Object *Parser::parseList(char open) {
           else {
             Handle t = Object::newPair(curr.getPtr(), Object::newNil());
             tail->raw()->cdr() = t.getPtr();
+            ThreadState::global().gcWriteBarrier(tail);
             tail = tail->raw()->cdr();
           }
         }
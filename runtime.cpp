@@ -1,7 +1,14 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <algorithm>
+#include <thread>
 
 #include "runtime.hpp"
+#include "codegen2.hpp"
 #include "gc.hpp"
 #include "object.hpp"
 
@@ -9,44 +16,35 @@ static void printSchemeStackTrace(ThreadState *ts,
                                   intptr_t maxLevel = -1) {
   dprintf(2, "### Stack trace:\n");
 
-  FrameDescr fd = ts->lastFrameDescr();
-  intptr_t stackPtr = ts->lastStackPtr();
-  intptr_t stackTop = ts->firstStackPtr();
-
-  // Do a stack walk.
-  // XXX: duplicate code since gcScavScheme does almost the same.
   intptr_t level = 0;
-  while (maxLevel == -1 || level < maxLevel) {
+  ts->walkSchemeStack([&](intptr_t stackPtr, const StackMap *map) -> bool {
+    if (level) {
+      dprintf(2, "-------------------------------\n");
+    }
+    if (level == maxLevel) {
+      return false;
+    }
+
     Object *thisClosure = NULL;
-    for (intptr_t i = 0; i < fd.frameSize; ++i) {
-      if (fd.isPtr(i)) {
-        Object **loc = reinterpret_cast<Object **>(stackPtr + i * 8);
-        if (i == fd.frameSize - 2) {
-          // fd, thisClo.
-          thisClosure = *loc;
-        }
-        else {
-          dprintf(2, "#%3ld Frame[%ld] ", level, i);
-          (*loc)->displayDetail(2);
-          dprintf(2, "\n");
-        }
+    map->forEachPtr([&](intptr_t i) {
+      Object **loc = reinterpret_cast<Object **>(stackPtr + i * 8);
+      if (i == map->frameSize() - 1) {
+        // thisClo, right below the return address.
+        thisClosure = *loc;
       }
-    }
+      else {
+        dprintf(2, "#%3ld Frame[%ld] ", level, i);
+        (*loc)->displayDetail(2);
+        dprintf(2, "\n");
+      }
+    });
     assert(thisClosure);
     dprintf(2, "#%3ld ^ Inside ", level);
     thisClosure->displayDetail(2);
     dprintf(2, "\n");
     ++level;
-
-    // Find prev stack
-    stackPtr += (1 + fd.frameSize) * 8;
-    if (stackPtr == stackTop) {
-      break;
-    }
-    dprintf(2, "-------------------------------\n");
-    assert(stackPtr < stackTop);
-    fd = *reinterpret_cast<FrameDescr *>(stackPtr - 16);
-  }
+    return true;
+  });
 }
 
 void Runtime::handleNotAClosure(Object *wat, ThreadState *ts) {
@@ -92,38 +90,114 @@ void Runtime::handleStackOvf(ThreadState *ts) {
   exit(1);
 }
 
+void Runtime::handleHeapOvf(ThreadState *ts) {
+  dprintf(2, "Heap exhausted by req %ld: %ld of %ld used, and at most "
+             "%ld allowed.\n", ts->lastAllocReq(),
+          ts->heapSize() - ts->oldSpaceFree(), ts->heapSize(),
+          Option::global().kHeapSize);
+
+  if (!ts->errorJmpBuf()) {
+    // In the compiler
+    ts->destroy();
+    exit(1);
+  }
+
+  dprintf(2, "We display 5 most recent call stack here.\n");
+  printSchemeStackTrace(ts, 5);
+
+  // The heap is as the gc left it, so the thread can run Scheme code
+  // again. The frames are dropped along with what only they refer to.
+  longjmp(*ts->errorJmpBuf(), 1);
+}
+
+// Faults at a stack probe (@See CGFunction::compileFunction) on the guard
+// grow the stack and retry the probe. When it can't grow, they continue
+// in handleStackOvf, on the C stack as there is no room left on the
+// Scheme stack. Others are real crashes.
+static void handleSegv(int, siginfo_t *info, void *rawContext) {
+  ucontext_t *context = reinterpret_cast<ucontext_t *>(rawContext);
+  greg_t *regs = context->uc_mcontext.gregs;
+
+  // Only reads the table, which is not being changed by compiled code.
+  const StackMap *map = StackMap::lookup(regs[REG_RIP]);
+  ThreadState *ts = reinterpret_cast<ThreadState *>(regs[REG_R14]);
+  if (!map ||
+      !ts->isInStackGuard(reinterpret_cast<intptr_t>(info->si_addr))) {
+    // Faults again, without us.
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+
+  intptr_t stackPtr = regs[REG_RSP];
+  if (ts->growStack(&stackPtr)) {
+    regs[REG_RSP] = stackPtr;
+    return;
+  }
+
+  // What syncThreadState would have done at the probe.
+  ts->pairPtr()      = regs[REG_R12];
+  ts->pairLimit()    = regs[REG_R13];
+  ts->lastStackPtr() = regs[REG_RSP];
+  ts->lastStackMap() = map;
+
+  // As if called from Scheme_callRuntime.
+  regs[REG_RSP] = ts->cStackPtr() - sizeof(void *);
+  regs[REG_RDI] = reinterpret_cast<greg_t>(ts);
+  regs[REG_RIP] = reinterpret_cast<greg_t>(&Runtime::handleStackOvf);
+}
+
+void Runtime::installStackOvfHandler() {
+  // The handler can't run on the stack that overflowed.
+  static char altStack[64 * 1024];
+  stack_t ss;
+  ss.ss_sp = altStack;
+  ss.ss_size = sizeof(altStack);
+  ss.ss_flags = 0;
+  sigaltstack(&ss, NULL);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = handleSegv;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+}
+
 void Runtime::collectAndAlloc(ThreadState *ts) {
   if (Option::global().kLogInfo) {
     dprintf(2, "[Runtime::collect]\n");
   }
 
   ts->gcCollect();
+  // Only the pairs: the code allocates objects with allocObject.
+  ts->gcEnsureRoom(ts->pairLimit() - ts->pairPtr());
+}
 
-  /*
-  FrameDescr fd = ts->lastFrameDescr();
-  while (true) {
-    dprintf(2, "[Stack Walk] stackPtr = %p, fd = %ld, size = %d\n",
-            (void *) stackPtr, fd.pack(), fd.frameSize);
-    for (intptr_t i = 0; i < fd.frameSize; ++i) {
-      if (fd.isPtr(i)) {
-        dprintf(2, "[Stack Walk] %ld isPtr\n", i);
-        Util::logObj("E.g.", *(Object **) (stackPtr + i * 8));
-      }
-    }
-    // Get next stackPtr
-    stackPtr += (1 + fd.frameSize) * 8;
+intptr_t Runtime::allocObject(ThreadState *ts, intptr_t tag) {
+  if (Option::global().kLogInfo) {
+    dprintf(2, "[Runtime::allocObject]\n");
+  }
 
-    if (stackPtr == ts->firstStackPtr()) {
-      dprintf(2, "[Stack Walk] done\n");
-      break;
-    }
-    assert(stackPtr < ts->firstStackPtr());
-    // Get next framedescr. -2 slot for (fd + retAddr)
-    fd = *reinterpret_cast<FrameDescr *>(stackPtr - 16);
+#ifdef kSanyaGCDebug
+  // The code never allocates inline: a gc on each, as for the pairs.
+  ts->gcCollect();
+#endif
+  auto raw = reinterpret_cast<RawObject *>(
+      ts->gcAlloc(ts->lastAllocReq() - sizeof(GcHeader)));
+  GcHeader *h = GcHeader::fromRawObject(raw);
+  if (h->markAt<GcHeader::kLarge>()) {
+    // Old from the start, and filled in with no write barrier.
+    ts->gcRemember(raw->tagWith(static_cast<RawObject::Tag>(tag)));
   }
+  return reinterpret_cast<intptr_t>(h);
+}
 
-  exit(1);
-  */
+void Runtime::rememberObject(Object *obj, ThreadState *ts) {
+  ts->gcRemember(obj);
+}
+
+RawObject *Runtime::compileOnFirstCall(CGFunction *f, ThreadState *ts) {
+  return f->compileOnFirstCall();
 }
 
 void Runtime::traceObject(Object *wat) {
@@ -151,6 +225,15 @@ static bool envIs(const char *name, const char *val) {
   return false;
 }
 
+static intptr_t envInt(const char *name, intptr_t orElse) {
+  char *maybeVal = getenv(name);
+  if (maybeVal) {
+    // "NO" also reads as 0.
+    return atol(maybeVal);
+  }
+  return orElse;
+}
+
 void Option::init() {
   if (option.kInitialized) {
     return;
@@ -158,7 +241,19 @@ void Option::init() {
 
   option.kInitialized      = true;
   option.kTailCallOpt      = !envIs("SANYA_TCO", "NO");
+  option.kInlineBudget     = envInt("SANYA_INLINE", 24);
+  option.kUseIR            = !envIs("SANYA_IR", "NO");
   option.kInsertStackCheck = !envIs("SANYA_STACKCHECK", "NO");
+  option.kLazyCompile      = !envIs("SANYA_LAZY", "NO");
+  // Max, in KB
+  option.kStackSize        = envInt("SANYA_STACK_SIZE", 64 * 1024) * 1024;
+  // Max, in KB
+  option.kHeapSize         = Util::align<12>(
+      envInt("SANYA_HEAP_SIZE", 256 * 1024) * 1024);
+  option.kGcThreads        = std::max<intptr_t>(1, envInt("SANYA_GC_THREADS",
+      std::min<intptr_t>(8, std::thread::hardware_concurrency())));
+  // In us
+  option.kGcPauseBudget    = std::max<intptr_t>(0, envInt("SANYA_GC_PAUSE", 0));
   option.kLogInfo          = envIs("SANYA_LOGINFO", "YES");
 }
 
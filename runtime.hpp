@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 
+class CGFunction;
 class Object;
+class RawObject;
 class ThreadState;
 
 class Runtime {
@@ -13,9 +15,24 @@ class Runtime {
   static void handleArgCountMismatch(Object *, intptr_t, ThreadState *);
   static void handleUserError(Object *, ThreadState *);
   static void handleStackOvf(ThreadState *);
+  // The heap can't grow past Option::kHeapSize. Unwinds the Scheme
+  // code to its caller, which gets NULL. @See callScheme_0
+  static void handleHeapOvf(ThreadState *);
+  // Grows the Scheme stack on faults on its guard, or turns them into
+  // handleStackOvf.
+  static void installStackOvfHandler();
 
   // GC
   static void collectAndAlloc(ThreadState *ts);
+  // Slow path of the inline allocation of lastAllocReq bytes, header
+  // included. Returns the header. @See CGFunction::allocObject
+  static intptr_t allocObject(ThreadState *ts, intptr_t tag);
+  // Slow path of the write barrier. @See CGFunction::emitWriteBarrier
+  static void rememberObject(Object *, ThreadState *);
+
+  // Compiles f when its closure is first called. Returns its function.
+  // @See CGModule::makeLazyStub
+  static RawObject *compileOnFirstCall(CGFunction *f, ThreadState *);
 
   // Debug
   static void traceObject(Object *);
@@ -30,8 +47,25 @@ struct Option {
   static void init();
 
   bool kTailCallOpt;
+  // Max size of a function body to inline. 0 turns inlining off.
+  intptr_t kInlineBudget;
+  // Compile through the ssa ir where it handles the function.
+  bool kUseIR;
   bool kInitialized;
+  // Probes the stack in the prologues. Overflows crash without it.
   bool kInsertStackCheck;
+  // Compiles each function on its first call instead of all of them
+  // before main runs.
+  bool kLazyCompile;
+  // Bytes that the Scheme stack can grow to, not counting the guard.
+  intptr_t kStackSize;
+  // Bytes that the old space can grow to. The nursery is not counted.
+  intptr_t kHeapSize;
+  // Threads that copy in a major gc of a large heap.
+  intptr_t kGcThreads;
+  // Microseconds that a gc may pause the Scheme code for. Majors are then
+  // done a slice at a time. 0 stops the world for them.
+  intptr_t kGcPauseBudget;
   bool kLogInfo;
 };
 
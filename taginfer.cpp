@@ -0,0 +1,423 @@
+#include <assert.h>
+
+#include "taginfer.hpp"
+#include "codegen2.hpp"
+
+TagInference::TagInference(CGModule *module)
+  : module(module)
+{ }
+
+void TagInference::run(const std::vector<CGFunction *> &funcs) {
+  // Start from "never returns" and grow the result tags until they are
+  // stable. Recursive calls are then covered as well.
+  for (auto f : funcs) {
+    resultTags[f] = kNone;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto f : funcs) {
+      unsigned tags = resultTags[f] | inferFunction(f, false);
+      if (tags != resultTags[f]) {
+        resultTags[f] = tags;
+        changed = true;
+      }
+    }
+  }
+
+  for (auto f : funcs) {
+    inferFunction(f, true);
+  }
+}
+
+unsigned TagInference::inferFunction(CGFunction *f, bool rewrite) {
+  vars = Util::newGrowableArray();
+  for (intptr_t i = 0; i < f->arity; ++i) {
+    Util::arrayAppend(vars, Util::arrayAt(f->argArray, i));
+  }
+
+  intptr_t len = Util::arrayLength(f->lamBody);
+  for (intptr_t i = 2; i < len; ++i) {
+    collectVars(Util::arrayAt(f->lamBody, i));
+  }
+
+  // Nothing is known about the arguments.
+  Env env(Util::arrayLength(vars), kAny);
+  unsigned tags = kOther;
+  for (intptr_t i = 2; i < len; ++i) {
+    Handle x = infer(Util::arrayAt(f->lamBody, i), &env, &tags);
+    if (rewrite) {
+      Util::arraySet(f->lamBody, i, x);
+    }
+  }
+  return tags;
+}
+
+Object *TagInference::infer(const Handle &expr, Env *env, unsigned *tags) {
+  Handle val;
+  if (isConstant(expr, &val)) {
+    *tags = tagsOf(val);
+    return expr;
+  }
+  else if (expr->isSymbol()) {
+    intptr_t ix = lookupVar(expr);
+    if (ix != -1) {
+      *tags = (*env)[ix];
+    }
+    else {
+      *tags = module->lookupKnownFunction(expr) ? kClosure : kAny;
+    }
+    return expr;
+  }
+  else if (!expr->isPair()) {
+    *tags = kAny;
+    return expr;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  intptr_t len = Util::arrayLength(xs);
+  Handle head = Util::arrayAt(xs, 0);
+  Handle result;
+
+  if (head == module->symLambda) {
+    *tags = kClosure;
+    return expr;
+  }
+  else if (head == module->symIf && len == 4) {
+    return inferIf(xs, env, tags);
+  }
+  else if ((head == module->symDefine || head == module->symSete) &&
+           len == 3) {
+    unsigned valTags;
+    Handle x = infer(Util::arrayAt(xs, 2), env, &valTags);
+    Util::arraySet(xs, 2, x);
+    intptr_t ix = lookupVar(Util::arrayAt(xs, 1));
+    if (ix != -1) {
+      (*env)[ix] = valTags;
+    }
+    *tags = valTags == kNone ? kNone : kOther;
+    return Util::arrayToList(xs);
+  }
+  else if (head == module->symLet && len >= 3) {
+    Handle bindings = Util::newGrowableArray();
+    Util::listToArray(Util::arrayAt(xs, 1), bindings);
+    for (intptr_t i = 0; i < Util::arrayLength(bindings); ++i) {
+      Handle binding = Util::arrayAt(bindings, i);
+      Handle name = binding->raw()->car();
+      unsigned initTags;
+      Handle init = infer(binding->raw()->cdr()->raw()->car(), env,
+                          &initTags);
+      (*env)[lookupVar(name)] = initTags;
+      Handle tail = Object::newPair(init, Object::newNil());
+      binding = Object::newPair(name, tail);
+      Util::arraySet(bindings, i, binding);
+    }
+    Handle newBindings = Util::arrayToList(bindings);
+    Util::arraySet(xs, 1, newBindings);
+    for (intptr_t i = 2; i < len; ++i) {
+      Handle x = infer(Util::arrayAt(xs, i), env, tags);
+      Util::arraySet(xs, i, x);
+    }
+    return Util::arrayToList(xs);
+  }
+  else if (head == module->symBegin) {
+    *tags = kOther;
+    for (intptr_t i = 1; i < len; ++i) {
+      Handle x = infer(Util::arrayAt(xs, i), env, tags);
+      Util::arraySet(xs, i, x);
+    }
+    return Util::arrayToList(xs);
+  }
+  else if ((result = inferPrimOp(xs, env, tags))) {
+    return result;
+  }
+
+  // Funcall. Callees cannot see our locals, so env stays valid.
+  for (intptr_t i = 0; i < len; ++i) {
+    unsigned argTags;
+    Handle x = infer(Util::arrayAt(xs, i), env, &argTags);
+    Util::arraySet(xs, i, x);
+  }
+
+  CGFunction *callee = NULL;
+  if (head->isSymbol() && lookupVar(head) == -1) {
+    callee = module->lookupKnownFunction(head);
+  }
+  if (callee && callee->arity == len - 1) {
+    *tags = resultTags[callee];
+  }
+  else {
+    *tags = kAny;
+  }
+  return Util::arrayToList(xs);
+}
+
+Object *TagInference::inferIf(const Handle &xs, Env *env, unsigned *tags) {
+  unsigned predTags;
+  Handle pred = infer(Util::arrayAt(xs, 1), env, &predTags);
+  Util::arraySet(xs, 1, pred);
+
+  // Only one branch can be taken: drop the other one.
+  intptr_t taken = -1;
+  if (predTags == kFalse) {
+    taken = 3;
+  }
+  else if (predTags != kNone && !(predTags & kFalse)) {
+    taken = 2;
+  }
+
+  if (taken != -1) {
+    Handle branch = infer(Util::arrayAt(xs, taken), env, tags);
+    if (isPure(pred)) {
+      return branch;
+    }
+    Handle tail = Object::newPair(branch, Object::newNil());
+    tail = Object::newPair(pred, tail);
+    return Object::newPair(module->symBegin, tail);
+  }
+
+  Env thenEnv = *env, elseEnv = *env;
+  refine(pred, &thenEnv, &elseEnv);
+
+  unsigned thenTags, elseTags;
+  Handle x = infer(Util::arrayAt(xs, 2), &thenEnv, &thenTags);
+  Util::arraySet(xs, 2, x);
+  x = infer(Util::arrayAt(xs, 3), &elseEnv, &elseTags);
+  Util::arraySet(xs, 3, x);
+
+  // A branch that does not return (e.g. error#) does not join.
+  for (size_t i = 0; i < env->size(); ++i) {
+    (*env)[i] = (thenTags == kNone ? 0 : thenEnv[i]) |
+                (elseTags == kNone ? 0 : elseEnv[i]);
+  }
+  if (thenTags == kNone && elseTags == kNone) {
+    *env = thenEnv;
+  }
+  *tags = thenTags | elseTags;
+  return Util::arrayToList(xs);
+}
+
+Object *TagInference::inferPrimOp(const Handle &xs, Env *env,
+                                  unsigned *tags) {
+  intptr_t len = Util::arrayLength(xs);
+  Handle opName = Util::arrayAt(xs, 0);
+  unsigned resultTags;
+  unsigned predicate = kNone;
+
+  if ((opName == module->symPrimAdd || opName == module->symPrimSub) &&
+      len == 3) {
+    resultTags = kFixnum;
+  }
+  else if (opName == module->symPrimLt && len == 3) {
+    resultTags = kBool;
+  }
+  else if (opName == module->symPrimCons && len == 3) {
+    resultTags = kPair;
+  }
+  else if ((opName == module->symPrimMakeVector && len == 3) ||
+           opName == module->symPrimVector) {
+    resultTags = kVector;
+  }
+  else if (opName == module->symPrimVectorRef && len == 3) {
+    resultTags = kAny;
+  }
+  else if (opName == module->symPrimVectorSet && len == 4) {
+    resultTags = kOther;
+  }
+  else if (opName == module->symPrimVectorLength && len == 2) {
+    resultTags = kFixnum;
+  }
+  else if ((opName == module->symPrimMakeClosure && len >= 2) ||
+           (opName == module->symPrimThisClosure && len == 1)) {
+    resultTags = kClosure;
+  }
+  else if (opName == module->symPrimClosureRef && len == 2) {
+    resultTags = kAny;
+  }
+  else if (opName == module->symPrimTrace && len == 3) {
+    // The second argument's, see below.
+    resultTags = kAny;
+  }
+  else if ((opName == module->symPrimDisplay && len == 2) ||
+           (opName == module->symPrimNewLine && len == 1)) {
+    resultTags = kOther;
+  }
+  else if (opName == module->symPrimError && len == 2) {
+    resultTags = kNone;
+  }
+
+#define MK_ACCESSOR(_unused, _unused2, attrName)                        \
+  else if (opName == module->symPrim ## attrName && len == 2) {         \
+    resultTags = kAny;                                                  \
+  }
+PRIM_ATTR_ACCESSORS(MK_ACCESSOR)
+#undef MK_ACCESSOR
+
+#define MK_PREDICATE(_unused, typeName)                                 \
+  else if (opName == module->symPrim ## typeName ## p && len == 2) {    \
+    resultTags = kBool;                                                 \
+    predicate = k ## typeName;                                          \
+  }
+PRIM_TAG_PREDICATES(MK_PREDICATE)
+PRIM_SINGLETON_PREDICATES(MK_PREDICATE)
+#undef MK_PREDICATE
+
+  else {
+    return NULL;
+  }
+
+  unsigned argTags = kNone;
+  for (intptr_t i = 1; i < len; ++i) {
+    Handle x = infer(Util::arrayAt(xs, i), env, &argTags);
+    Util::arraySet(xs, i, x);
+  }
+  if (opName == module->symPrimTrace) {
+    resultTags = argTags;
+  }
+  *tags = resultTags;
+
+  if (predicate != kNone && argTags != kNone) {
+    Handle answer;
+    if (!(argTags & ~predicate)) {
+      answer = Object::newTrue();
+    }
+    else if (!(argTags & predicate)) {
+      answer = Object::newFalse();
+    }
+
+    if (answer) {
+      *tags = tagsOf(answer);
+      Handle arg = Util::arrayAt(xs, 1);
+      if (isPure(arg)) {
+        return answer;
+      }
+      Handle tail = Object::newPair(answer, Object::newNil());
+      tail = Object::newPair(arg, tail);
+      return Object::newPair(module->symBegin, tail);
+    }
+  }
+
+  return Util::arrayToList(xs);
+}
+
+void TagInference::refine(const Handle &pred, Env *thenEnv, Env *elseEnv) {
+  intptr_t ix;
+  if (pred->isSymbol()) {
+    if ((ix = lookupVar(pred)) != -1) {
+      (*thenEnv)[ix] &= ~kFalse;
+      (*elseEnv)[ix] &= kFalse;
+    }
+    return;
+  }
+
+  if (!pred->isPair() || !pred->raw()->cdr()->isPair()) {
+    return;
+  }
+  Handle opName = pred->raw()->car(),
+         arg = pred->raw()->cdr()->raw()->car();
+  if (!arg->isSymbol() || !pred->raw()->cdr()->raw()->cdr()->isNil() ||
+      (ix = lookupVar(arg)) == -1) {
+    return;
+  }
+
+  unsigned predicate = kNone;
+#define MK_PREDICATE(_unused, typeName)                                 \
+  if (opName == module->symPrim ## typeName ## p) {                     \
+    predicate = k ## typeName;                                          \
+  }
+PRIM_TAG_PREDICATES(MK_PREDICATE)
+PRIM_SINGLETON_PREDICATES(MK_PREDICATE)
+#undef MK_PREDICATE
+
+  if (predicate != kNone) {
+    (*thenEnv)[ix] &= predicate;
+    (*elseEnv)[ix] &= ~predicate;
+  }
+}
+
+unsigned TagInference::tagsOf(const Handle &val) {
+  switch (val->getTag()) {
+  case RawObject::kPairTag:
+    return kPair;
+  case RawObject::kSymbolTag:
+    return kSymbol;
+  case RawObject::kFixnumTag:
+    return kFixnum;
+  case RawObject::kClosureTag:
+    return kClosure;
+  case RawObject::kVectorTag:
+    return kVector;
+  case RawObject::kSingletonTag:
+    if (val->isTrue()) {
+      return kTrue;
+    }
+    else if (val->isFalse()) {
+      return kFalse;
+    }
+    else if (val->isNil()) {
+      return kNil;
+    }
+    return kOther;
+  default:
+    return kOther;
+  }
+}
+
+bool TagInference::isPure(const Handle &expr) {
+  Handle val;
+  return expr->isSymbol() || isConstant(expr, &val);
+}
+
+bool TagInference::isConstant(const Handle &expr, Handle *out) {
+  if (expr->isFixnum() || expr->isTrue() || expr->isFalse()) {
+    *out = expr;
+    return true;
+  }
+  else if (expr->isPair() && expr->raw()->car() == module->symQuote) {
+    Handle rest = expr->raw()->cdr();
+    if (rest->isPair() && rest->raw()->cdr()->isNil()) {
+      *out = rest->raw()->car();
+      return true;
+    }
+  }
+  return false;
+}
+
+intptr_t TagInference::lookupVar(const Handle &name) {
+  for (intptr_t i = 0, len = Util::arrayLength(vars); i < len; ++i) {
+    if (Util::arrayAt(vars, i) == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void TagInference::collectVars(const Handle &expr) {
+  if (!expr->isPair() || expr->raw()->car() == module->symQuote ||
+      expr->raw()->car() == module->symLambda) {
+    return;
+  }
+
+  Handle xs = Util::newGrowableArray();
+  Util::listToArray(expr, xs);
+  Handle head = Util::arrayAt(xs, 0);
+  if (head == module->symDefine && Util::arrayLength(xs) == 3 &&
+      lookupVar(Util::arrayAt(xs, 1)) == -1) {
+    Util::arrayAppend(vars, Util::arrayAt(xs, 1));
+  }
+  else if (head == module->symLet && Util::arrayLength(xs) >= 2) {
+    for (Handle iter = Util::arrayAt(xs, 1); iter->isPair();
+         iter = iter->raw()->cdr()) {
+      Handle name = iter->raw()->car()->raw()->car();
+      if (lookupVar(name) == -1) {
+        Util::arrayAppend(vars, name);
+      }
+    }
+  }
+
+  for (intptr_t i = 0; i < Util::arrayLength(xs); ++i) {
+    collectVars(Util::arrayAt(xs, i));
+  }
+}
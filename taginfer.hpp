@@ -0,0 +1,75 @@
+#ifndef TAGINFER_HPP
+#define TAGINFER_HPP
+
+#include <map>
+#include <vector>
+
+#include "gc.hpp"
+#include "object.hpp"
+#include "util.hpp"
+
+class CGModule;
+class CGFunction;
+
+// Flow-sensitive inference of the tags that an expression can have.
+// Tag predicates whose answer is known are replaced by #t/#f and ifs on
+// them are folded, which removes the (error# ...) branches of the safe
+// library functions once the value has been checked.
+//
+// Runs on the s-expressions, after the Inliner. The result tags of
+// known functions are solved for all of the module first.
+class TagInference {
+ public:
+  // A set of possible tags
+  enum {
+    kPair    = 1 << 0,
+    kSymbol  = 1 << 1,
+    kFixnum  = 1 << 2,
+    kClosure = 1 << 3,
+    kVector  = 1 << 4,
+    kTrue    = 1 << 5,
+    kFalse   = 1 << 6,
+    kNil     = 1 << 7,
+    kOther   = 1 << 8,
+
+    kBool    = kTrue | kFalse,
+    kAny     = (1 << 9) - 1,
+    // Does not return
+    kNone    = 0
+  };
+
+  TagInference(CGModule *module);
+
+  // Rewrites the bodies of funcs in place.
+  void run(const std::vector<CGFunction *> &funcs);
+
+ private:
+  typedef std::vector<unsigned> Env;
+
+  // Returns the tags of f's result. Rewrites the body if rewrite is set.
+  unsigned inferFunction(CGFunction *f, bool rewrite);
+
+  Object *infer(const Handle &expr, Env *env, unsigned *tags);
+  Object *inferIf(const Handle &xs, Env *env, unsigned *tags);
+  Object *inferPrimOp(const Handle &xs, Env *env, unsigned *tags);
+  // (pred# x) and x refine x in the branches of an if.
+  void refine(const Handle &pred, Env *thenEnv, Env *elseEnv);
+
+  static unsigned tagsOf(const Handle &val);
+  // Constants and variables
+  bool isPure(const Handle &expr);
+  bool isConstant(const Handle &expr, Handle *out);
+  // Index into Env, or -1 for globals
+  intptr_t lookupVar(const Handle &name);
+  void collectVars(const Handle &expr);
+
+  CGModule *module;
+
+  // Result tags of the known functions
+  std::map<CGFunction *, unsigned> resultTags;
+
+  // Growable array of the locals of the function being inferred
+  Handle vars;
+};
+
+#endif
@@ -81,6 +81,7 @@ Object *assocInsert(const Handle &assoc, const Handle &key,
   }
   else {
     entry->raw()->cdr() = val.getPtr();
+    ThreadState::global().gcWriteBarrier(entry);
     return assoc.getPtr();
   }
 }
@@ -97,7 +98,10 @@ void arrayAppend(const Handle &arr, const Handle &item) {
   intptr_t nextIx = arr->raw()->cdr()->fromFixnum();
   if (nextIx < size) {
     vec->raw()->vectorAt(nextIx) = item.getPtr();
+    ThreadState::global().gcWriteBarrier(vec);
+    // Not a pointer, but an incremental gc's copy needs it as well.
     arr->raw()->cdr() = Object::newFixnum(nextIx + 1);
+    ThreadState::global().gcWriteBarrier(arr);
   }
   else {
     // Resize
@@ -107,13 +111,14 @@ void arrayAppend(const Handle &arr, const Handle &item) {
       newVec->raw()->vectorAt(i) = vec->raw()->vectorAt(i);
     }
     arr->raw()->car() = newVec.getPtr();
+    ThreadState::global().gcWriteBarrier(arr);
 
     // Try again
     arrayAppend(arr, item);
   }
 }
 
-Object *&arrayAt(const Handle &arr, intptr_t ix) {
+static intptr_t arrayIndex(const Handle &arr, intptr_t ix) {
   intptr_t len = arr->raw()->cdr()->fromFixnum();
   if (ix < 0) {
     ix += len;
@@ -121,8 +126,17 @@ Object *&arrayAt(const Handle &arr, intptr_t ix) {
       ix = 0;
     }
   }
+  return ix;
+}
+
+Object *arrayAt(const Handle &arr, intptr_t ix) {
+  return arr->raw()->car()->raw()->vectorAt(arrayIndex(arr, ix));
+}
 
-  return arr->raw()->car()->raw()->vectorAt(ix);
+void arraySet(const Handle &arr, intptr_t ix, const Handle &val) {
+  Object *vec = arr->raw()->car();
+  vec->raw()->vectorAt(arrayIndex(arr, ix)) = val.getPtr();
+  ThreadState::global().gcWriteBarrier(vec);
 }
 
 intptr_t arrayLength(const Handle &arr) {
@@ -138,4 +152,22 @@ Object *arrayToVector(const Handle &arr) {
   return vec;
 }
 
+Object *listToArray(const Handle &xs, const Handle &out) {
+  Handle iter = xs;
+  while (iter->isPair()) {
+    Util::arrayAppend(out, iter->raw()->car());
+    iter = iter->raw()->cdr();
+  }
+  return iter;
+}
+
+Object *arrayToList(const Handle &arr, intptr_t start) {
+  Handle xs = Object::newNil();
+  for (intptr_t i = Util::arrayLength(arr) - 1; i >= start; --i) {
+    Handle x = Util::arrayAt(arr, i);
+    xs = Object::newPair(x, xs);
+  }
+  return xs;
+}
+
 }
@@ -49,13 +49,21 @@ Object *newGrowableArray();
 void arrayAppend(const Handle &arr, const Handle &item);
 
 // Can use negative index
-Object *&arrayAt(const Handle &arr, intptr_t ix);
+Object *arrayAt(const Handle &arr, intptr_t ix);
+// With the write barrier
+void arraySet(const Handle &arr, intptr_t ix, const Handle &val);
 
 intptr_t arrayLength(const Handle &arr);
 
 // Trim unused parts
 Object *arrayToVector(const Handle &arr);
 
+// Appends the items of a list to the array and returns the tail
+// (nil for a proper list).
+Object *listToArray(const Handle &xs, const Handle &out);
+// Makes a proper list of arr[start:]
+Object *arrayToList(const Handle &arr, intptr_t start = 0);
+
 }
 
 #endif